@@ -14,7 +14,7 @@ public:
   {
     Base::setup();
     addEvent(AF1Event(
-        "Blink-1", [](ECBArg a)
+        "Blink-1", [](const ECBArg &a)
         {
           setBuiltinLED(a.cbCnt % 2); // Blink once per sec
         },
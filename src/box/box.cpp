@@ -21,33 +21,273 @@
 
 #include "box/box.h"
 
+#ifdef ESP32
+// Given from ESP-Now callbacks on the WiFi task, which mustn't block on a mutex
+static StaticSemaphore_t waitSemBuf;
+static SemaphoreHandle_t waitSem = xSemaphoreCreateBinaryStatic(&waitSemBuf);
+#else
+static std::mutex waitMutex;
+static std::condition_variable waitCv;
+static std::atomic<bool> waiting(false);
+#endif
+static std::atomic<bool> pushed(false);
+
 void dummyHandler(AF1Msg &m)
 {
 }
 
-Box::Box()
+Box::Box(const size_t capacity[PRIORITY_CNT], box_policy p, box_drain d)
+    : policy(p), drain(d), curLane(PRIORITY_CNT - 1), credit(0),
+      budgetMsgs(BOX_BUDGET_MSGS), budgetUs(BOX_BUDGET_US),
+      accepted(0), dropped(0), rejected(0), coalesced(0), highWater(0), budgetExhausted(0),
+      latencyCnt(0), latencyMaxUs(0), latencyTotalUs(0)
 {
   msgHandler = dummyHandler;
+  for (int i = 0; i < PRIORITY_CNT; i++)
+  {
+    lanes[i] = new Lane(capacity[i]);
+  }
+  weights[PRIORITY_HIGH] = BOX_WEIGHT_HIGH;
+  weights[PRIORITY_NORMAL] = BOX_WEIGHT_NORMAL;
+  weights[PRIORITY_LOW] = BOX_WEIGHT_LOW;
+}
+
+Box::~Box()
+{
+  for (int i = 0; i < PRIORITY_CNT; i++)
+  {
+    delete lanes[i];
+  }
+}
+
+bool Box::push(AF1Msg &&m)
+{
+  Lane *lane = lanes[m.getPriority()];
+
+  // A failed enqueue leaves m untouched
+  while (!lane->enqueue(std::move(m)))
+  {
+    if (policy == BOX_DROP_NEWEST)
+    {
+      dropped++;
+      return false;
+    }
+    if (policy == BOX_REJECT)
+    {
+      rejected++;
+      return false;
+    }
+    if (policy == BOX_COALESCE_TYPE)
+    {
+      uint8_t type = m.getType();
+      uint8_t state = m.getState();
+      peer_handle sender = m.getSender();
+      if (lane->replaceIf([type, state, sender](AF1Msg &q)
+                          { return q.getType() == type && q.getState() == state && q.getSender() == sender; },
+                          std::move(m)))
+      {
+        coalesced++;
+        notify();
+        return true;
+      }
+    }
+    // Drop oldest
+    if (lane->consume([](AF1Msg &) {}))
+    {
+      dropped++;
+    }
+  }
+  accepted++;
+  updateHighWater();
+  notify();
+  return true;
+}
+
+void Box::notify()
+{
+#ifdef ESP32
+  if (!pushed.exchange(true))
+  {
+    xSemaphoreGive(waitSem);
+  }
+#else
+  pushed = true;
+  if (waiting)
+  {
+    std::lock_guard<std::mutex> l(waitMutex);
+    waitCv.notify_all();
+  }
+#endif
+}
+
+void Box::prepareWait()
+{
+  pushed = false;
+#ifdef ESP32
+  xSemaphoreTake(waitSem, 0); // A give from before now
+#endif
+}
+
+bool Box::wait(unsigned long ms)
+{
+#ifdef ESP32
+  return pushed || xSemaphoreTake(waitSem, pdMS_TO_TICKS(ms)) == pdTRUE;
+#else
+  std::unique_lock<std::mutex> l(waitMutex);
+  waiting = true;
+  bool woken = waitCv.wait_for(l, std::chrono::milliseconds(ms), []
+                               { return pushed.load(); });
+  waiting = false;
+  return woken;
+#endif
+}
+
+void Box::updateHighWater()
+{
+  unsigned long n = size();
+  unsigned long h = highWater.load(std::memory_order_relaxed);
+  while (n > h && !highWater.compare_exchange_weak(h, n, std::memory_order_relaxed))
+    ;
+}
+
+bool Box::handleNext()
+{
+  if (drain == BOX_DRAIN_STRICT)
+  {
+    for (int i = 0; i < PRIORITY_CNT; i++)
+    {
+      if (lanes[i]->consume([this](AF1Msg &m)
+                            { handle(m); }))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Weighted; an empty lane gives up the rest of its turn
+  for (int i = 0; i <= PRIORITY_CNT; i++)
+  {
+    if (credit <= 0)
+    {
+      curLane = (curLane + 1) % PRIORITY_CNT;
+      credit = weights[curLane];
+    }
+    if (lanes[curLane]->consume([this](AF1Msg &m)
+                                { handle(m); }))
+    {
+      credit--;
+      return true;
+    }
+    credit = 0;
+  }
+  return false;
 }
 
-void Box::handleMessages()
+void Box::handle(AF1Msg &m)
 {
-  m.lock();
-  if (!q.empty())
+  if (m.getRxUs())
   {
-    AF1Msg msg = q.front();
-    q.pop();
-    m.unlock();
-    msgHandler(msg);
-    handleMessages();
+    unsigned long l = AF1Clock::now() - m.getRxUs();
+    latencyCnt++;
+    latencyTotalUs += l;
+    unsigned long h = latencyMaxUs.load(std::memory_order_relaxed);
+    while (l > h && !latencyMaxUs.compare_exchange_weak(h, l, std::memory_order_relaxed))
+      ;
   }
-  else
+  msgHandler(m);
+}
+
+int Box::handleMessages()
+{
+  unsigned long startUs = micros();
+  int n = 0;
+  while (true)
   {
-    m.unlock();
+    if ((budgetMsgs > 0 && n >= budgetMsgs) || (budgetUs > 0 && micros() - startUs >= budgetUs))
+    {
+      if (size())
+      {
+        budgetExhausted++;
+      }
+      break;
+    }
+    if (!handleNext())
+    {
+      break;
+    }
+    n++;
   }
+  return n;
 }
 
 void Box::setMsgHandler(msg_handler m)
 {
   msgHandler = m;
 }
+
+void Box::setPolicy(box_policy p)
+{
+  policy = p;
+}
+
+box_policy Box::getPolicy()
+{
+  return policy;
+}
+
+void Box::setDrain(box_drain d)
+{
+  drain = d;
+}
+
+void Box::setWeight(msg_priority p, int w)
+{
+  weights[p] = w < 1 ? 1 : w;
+}
+
+void Box::setBudget(int maxMsgs, unsigned long maxUs)
+{
+  budgetMsgs = maxMsgs;
+  budgetUs = maxUs;
+}
+
+box_stats Box::getStats()
+{
+  box_stats s;
+  s.accepted = accepted;
+  s.dropped = dropped;
+  s.rejected = rejected;
+  s.coalesced = coalesced;
+  s.highWater = highWater;
+  s.budgetExhausted = budgetExhausted;
+  s.latencyCnt = latencyCnt;
+  s.latencyMaxUs = latencyMaxUs;
+  s.latencyTotalUs = latencyTotalUs;
+  return s;
+}
+
+int Box::size()
+{
+  int n = 0;
+  for (int i = 0; i < PRIORITY_CNT; i++)
+  {
+    n += lanes[i]->size();
+  }
+  return n;
+}
+
+int Box::size(msg_priority p)
+{
+  return lanes[p]->size();
+}
+
+size_t Box::capacity()
+{
+  size_t n = 0;
+  for (int i = 0; i < PRIORITY_CNT; i++)
+  {
+    n += lanes[i]->capacity();
+  }
+  return n;
+}
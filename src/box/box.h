@@ -20,19 +20,95 @@
 #ifndef BOX_BOX_H_
 #define BOX_BOX_H_
 
-#include "tsQueue/tsQueue.h"
+#include <condition_variable>
+#include <mutex>
+
+#include "ringBuffer/ringBuffer.h"
 #include "message/message.h"
+#include "pre.h"
 
 typedef void (*msg_handler)(AF1Msg &m);
 
-class Box : public TSQueue<AF1Msg>
+// What push() does when the message's lane is full
+enum box_policy
+{
+  BOX_DROP_NEWEST,   // Discard the incoming message
+  BOX_DROP_OLDEST,   // Discard queued messages until it fits
+  BOX_COALESCE_TYPE, // Replace a queued message of the same type/state/sender; else drop oldest
+  BOX_REJECT         // Refuse the message; the caller decides (backpressure)
+};
+
+// How lanes are picked when draining
+enum box_drain
+{
+  BOX_DRAIN_STRICT,   // Always the highest priority lane with messages
+  BOX_DRAIN_WEIGHTED, // Round-robin; up to the lane's weight in messages per turn
+};
+
+struct box_stats
 {
+  unsigned long accepted;
+  unsigned long dropped;         // Incoming or queued messages discarded
+  unsigned long rejected;        // Refused under BOX_REJECT
+  unsigned long coalesced;       // Replaced a queued message
+  unsigned long highWater;       // Most messages ever queued at once
+  unsigned long budgetExhausted; // handleMessages() calls that stopped with messages left
+  unsigned long latencyCnt;      // Received messages handled (see AF1Msg::getRxUs())
+  unsigned long latencyMaxUs;    // Longest from arrival to handling
+  unsigned long latencyTotalUs;
+};
+
+// One bounded ring per msg_priority lane
+class Box
+{
+  typedef RingBuffer<AF1Msg> Lane;
+
+  Lane *lanes[PRIORITY_CNT];
   msg_handler msgHandler;
+  box_policy policy;
+  box_drain drain;
+  int weights[PRIORITY_CNT];
+  int curLane;
+  int credit;
+  int budgetMsgs;
+  unsigned long budgetUs;
+  std::atomic<unsigned long> accepted;
+  std::atomic<unsigned long> dropped;
+  std::atomic<unsigned long> rejected;
+  std::atomic<unsigned long> coalesced;
+  std::atomic<unsigned long> highWater;
+  std::atomic<unsigned long> budgetExhausted;
+  std::atomic<unsigned long> latencyCnt;
+  std::atomic<unsigned long> latencyMaxUs;
+  std::atomic<unsigned long> latencyTotalUs;
+
+  Box(const Box &) = delete;
+  Box &operator=(const Box &) = delete;
+
+  bool handleNext();
+  void handle(AF1Msg &m);
+  void updateHighWater();
 
 public:
-  Box();
-  void handleMessages();
+  Box(const size_t capacity[PRIORITY_CNT], box_policy p = BOX_DROP_NEWEST, box_drain d = BOX_DRAIN_STRICT);
+  ~Box();
+  bool push(AF1Msg &&m); // False if the message was not queued
+  int handleMessages(); // Handles messages until empty or over budget; returns the number handled
   void setMsgHandler(msg_handler h);
+  void setPolicy(box_policy p);
+  box_policy getPolicy();
+  void setDrain(box_drain d);
+  void setWeight(msg_priority p, int w); // Messages per turn under BOX_DRAIN_WEIGHTED; at least 1
+  void setBudget(int maxMsgs, unsigned long maxUs); // Per handleMessages() call; 0 is unlimited
+  box_stats getStats();
+  int size();
+  int size(msg_priority p);
+  size_t capacity();
+
+  // Block until any box gets a message, or ms pass; call prepareWait() before checking the boxes are empty
+  static void prepareWait();
+  static bool wait(unsigned long ms); // False on timeout
+  static void notify(); // Wakes wait(); for other queues the loop drains
 };
 
 #endif // BOX_BOX_H_
@@ -0,0 +1,158 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "broadcast.h"
+
+uint16_t BroadcastTx::seqs[ESPNOW_BCAST_HISTORY];
+tx_frame *BroadcastTx::frames[ESPNOW_BCAST_HISTORY];
+uint16_t BroadcastTx::nextSeq;
+time_us BroadcastTx::lastUs;
+bool BroadcastTx::heartbeatDue;
+
+static broadcast_stats bcastStats;
+
+#define HISTORY_MASK (ESPNOW_BCAST_HISTORY >= 32 ? 0xFFFFFFFFUL : (1UL << ESPNOW_BCAST_HISTORY) - 1)
+
+BroadcastRx::BroadcastRx()
+{
+  reset();
+}
+
+void BroadcastRx::reset()
+{
+  latest = 0;
+  missing = 0;
+  started = false;
+  lastNackUs = 0;
+}
+
+bool BroadcastRx::receive(uint16_t seq, bool heard)
+{
+  int16_t d = seq - latest;
+  // A big step back means the sender restarted
+  if (!started || d <= -32)
+  {
+    started = true;
+    latest = seq;
+    missing = 0; // Whatever came before we can't tell
+    return !heard;
+  }
+  if (d > 0)
+  {
+    // Bits 0..d-1: the new latest and the ones skipped
+    missing = d >= 32 ? 0xFFFFFFFF : (missing << d) | ((1UL << d) - 1);
+    if (!heard)
+    {
+      missing &= ~1UL;
+    }
+    missing &= HISTORY_MASK; // Older ones can't be resent anymore
+    latest = seq;
+    return !heard;
+  }
+  uint32_t bit = 1UL << -d;
+  if (heard || !(missing & bit))
+  {
+    if (!heard)
+    {
+      bcastStats.duplicates++;
+    }
+    return false;
+  }
+  missing &= ~bit;
+  return true;
+}
+
+bool BroadcastRx::isNackDue(time_us now)
+{
+  if (!missing || (lastNackUs && now - lastNackUs < (time_us)ESPNOW_BCAST_NACK_MS * 1000))
+  {
+    return false;
+  }
+  lastNackUs = now;
+  bcastStats.nacksSent++;
+  return true;
+}
+
+uint16_t BroadcastRx::getLatest()
+{
+  return latest;
+}
+
+uint32_t BroadcastRx::getMissing()
+{
+  return missing;
+}
+
+uint16_t BroadcastTx::getNextSeq()
+{
+  return nextSeq;
+}
+
+uint16_t BroadcastTx::getLastSeq()
+{
+  return nextSeq - 1;
+}
+
+void BroadcastTx::keep(tx_frame *f)
+{
+  int i = nextSeq % ESPNOW_BCAST_HISTORY;
+  if (frames[i] != NULL)
+  {
+    TxQueue::releaseFrame(frames[i]);
+  }
+  f->refs++;
+  frames[i] = f;
+  seqs[i] = nextSeq++;
+  lastUs = AF1Clock::now();
+  heartbeatDue = true;
+  bcastStats.sent++;
+}
+
+tx_frame *BroadcastTx::find(uint16_t seq)
+{
+  int i = seq % ESPNOW_BCAST_HISTORY;
+  if (frames[i] == NULL || seqs[i] != seq)
+  {
+    bcastStats.expired++;
+    return NULL;
+  }
+  bcastStats.nacked++;
+  return frames[i];
+}
+
+bool BroadcastTx::takeHeartbeat(time_us now)
+{
+  if (!heartbeatDue || now - lastUs < (time_us)ESPNOW_BCAST_HEARTBEAT_MS * 1000)
+  {
+    return false;
+  }
+  heartbeatDue = false;
+  bcastStats.heartbeats++;
+  return true;
+}
+
+time_us BroadcastTx::getHeartbeatUs()
+{
+  return heartbeatDue ? lastUs + (time_us)ESPNOW_BCAST_HEARTBEAT_MS * 1000 : 0;
+}
+
+broadcast_stats BroadcastTx::getStats()
+{
+  return bcastStats;
+}
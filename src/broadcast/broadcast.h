@@ -0,0 +1,79 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef BROADCAST_BROADCAST_H_
+#define BROADCAST_BROADCAST_H_
+
+#include <Arduino.h>
+
+#include "clock/clock.h"
+#include "txQueue/txQueue.h"
+#include "pre.h"
+
+struct broadcast_stats
+{
+  unsigned long sent;       // Sequenced broadcast frames
+  unsigned long heartbeats; // Sent after a burst, so the last frame's loss shows
+  unsigned long nacked;     // Frames peers asked for again
+  unsigned long expired;    // Asked for, but no longer in the history
+  unsigned long nacksSent;
+  unsigned long duplicates; // Received again (repairs that crossed, or repeats); not handled
+};
+
+/*
+  Gaps in one peer's broadcast sequence. Broadcasts aren't acked, so receivers find out what they
+  missed from the sequence numbers, and NACK them; the sender resends those to them unicast. Bit i
+  of missing is latest - i. Loop task only.
+*/
+class BroadcastRx
+{
+  uint16_t latest;
+  uint32_t missing;
+  bool started;
+  time_us lastNackUs;
+
+public:
+  BroadcastRx();
+  void reset();
+  bool receive(uint16_t seq, bool heard = false); // False for duplicates. Heard: only announced (by a heartbeat)
+  bool isNackDue(time_us now);                     // Something is missing and the last NACK is ESPNOW_BCAST_NACK_MS old
+  uint16_t getLatest();
+  uint32_t getMissing();
+};
+
+// Our broadcast sequence, and the last ESPNOW_BCAST_HISTORY frames for repairs
+class BroadcastTx
+{
+  static uint16_t seqs[ESPNOW_BCAST_HISTORY];
+  static tx_frame *frames[ESPNOW_BCAST_HISTORY];
+  static uint16_t nextSeq;
+  static time_us lastUs;
+  static bool heartbeatDue;
+
+public:
+  static uint16_t getNextSeq();
+  static uint16_t getLastSeq();
+  static void keep(tx_frame *f); // Takes a reference to f, sent with getNextSeq(); the sequence moves on
+  static tx_frame *find(uint16_t seq);
+  static bool takeHeartbeat(time_us now); // True once, ESPNOW_BCAST_HEARTBEAT_MS after the last broadcast
+  static time_us getHeartbeatUs();        // When takeHeartbeat() will be true; 0 if it won't
+  static broadcast_stats getStats(); // Receive side counts included
+};
+
+#endif // BROADCAST_BROADCAST_H_
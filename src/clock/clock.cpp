@@ -0,0 +1,52 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "clock.h"
+
+#ifdef ESP32
+#include <esp_timer.h>
+#endif
+
+time_us AF1Clock::now()
+{
+#ifdef ESP32
+  return esp_timer_get_time();
+#else
+  // Extend the 32-bit micros() counter; needs calling at least once per wrap (~71 min)
+  static uint32_t last;
+  static time_us high;
+  uint32_t m = micros();
+  if (m < last)
+  {
+    high += 1ULL << 32;
+  }
+  last = m;
+  return high | m;
+#endif
+}
+
+unsigned long AF1Clock::nowMs()
+{
+  return toMs(now());
+}
+
+unsigned long AF1Clock::toMs(time_us t)
+{
+  return (unsigned long)(t / 1000);
+}
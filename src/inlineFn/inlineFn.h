@@ -0,0 +1,127 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef INLINE_FN_INLINE_FN_H_
+#define INLINE_FN_INLINE_FN_H_
+
+#include <new>
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+
+/*
+  Like std::function, but the callable is stored in a fixed N byte buffer and never on the heap.
+  Captures that don't fit fail to compile.
+*/
+template <class Sig, size_t N>
+class InlineFn;
+
+template <class R, class... A, size_t N>
+class InlineFn<R(A...), N>
+{
+  typedef R (*invoke_fn)(void *f, A... a);
+  typedef void (*manage_fn)(void *dst, const void *src); // Copies src into dst, or destroys dst if src is NULL
+
+  typename std::aligned_storage<N>::type data;
+  invoke_fn invoker;
+  manage_fn manager;
+
+  template <class F>
+  static R invoke(void *f, A... a)
+  {
+    return (*static_cast<F *>(f))(std::forward<A>(a)...);
+  }
+
+  template <class F>
+  static void manage(void *dst, const void *src)
+  {
+    if (src != NULL)
+    {
+      new (dst) F(*static_cast<const F *>(src));
+    }
+    else
+    {
+      static_cast<F *>(dst)->~F();
+    }
+  }
+
+  void copy(const InlineFn &f)
+  {
+    if (f.manager != NULL)
+    {
+      f.manager(&data, &f.data);
+    }
+    invoker = f.invoker;
+    manager = f.manager;
+  }
+
+  void reset()
+  {
+    if (manager != NULL)
+    {
+      manager(&data, NULL);
+    }
+    invoker = NULL;
+    manager = NULL;
+  }
+
+public:
+  InlineFn() : invoker(NULL), manager(NULL) {}
+
+  template <class F, class D = typename std::decay<F>::type,
+            class = typename std::enable_if<!std::is_same<D, InlineFn>::value>::type>
+  InlineFn(F &&f) : invoker(invoke<D>), manager(manage<D>)
+  {
+    static_assert(sizeof(D) <= N, "Callable too big for InlineFn; capture less or raise N");
+    static_assert(alignof(D) <= alignof(typename std::aligned_storage<N>::type), "Callable over-aligned for InlineFn");
+    new (&data) D(std::forward<F>(f));
+  }
+
+  InlineFn(const InlineFn &f)
+  {
+    copy(f);
+  }
+
+  InlineFn &operator=(const InlineFn &f)
+  {
+    if (this != &f)
+    {
+      reset();
+      copy(f);
+    }
+    return *this;
+  }
+
+  ~InlineFn()
+  {
+    reset();
+  }
+
+  R operator()(A... a) const
+  {
+    return invoker(const_cast<void *>(static_cast<const void *>(&data)), std::forward<A>(a)...);
+  }
+
+  explicit operator bool() const
+  {
+    return invoker != NULL;
+  }
+};
+
+#endif // INLINE_FN_INLINE_FN_H_
@@ -17,15 +17,35 @@
   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include <atomic>
+
 #include "message.h"
 #include "stateEnt/virtual/base/base.h"
+#include "pool/pool.h"
+
+static std::atomic<uint16_t> nextSeq(0); // Messages are built on the loop, the worker and the WiFi task
+static uint8_t typePriority[256]; // Priority + 1; 0 means the default for the type
 
 AF1Msg::AF1Msg()
 {
-  recipients = {};
+  recipients = PeerSet::everyone();
   sendCnt = 0;
   retries = 0;
   maxRetries = 0;
+  seq = nextSeq++;
+  priority = -1;
+  typeStateValid = false;
+  sender = PEER_NONE;
+  rxUs = 0;
+  txUs = 0;
+  txStamp = false;
+  broadcast = false;
+  group = 0;
+  broadcastSeq = 0;
+  reliable = false;
+  reliableSeq = 0;
+  memset(encoded, 0, sizeof(encoded));
+  memset(encodedLen, 0, sizeof(encodedLen));
   rawLen = 0;
   isTxt = false;
   raw = NULL;
@@ -46,41 +66,85 @@ AF1Msg::AF1Msg(JsonDocument &d) : AF1Msg()
 
 AF1Msg::AF1Msg(uint8_t *r, int l, bool t)
 {
-  recipients = {};
+  recipients = PeerSet::everyone();
   sendCnt = 0;
   retries = 0;
   maxRetries = 0;
+  seq = nextSeq++;
+  priority = -1;
+  typeStateValid = false;
+  sender = PEER_NONE;
+  rxUs = 0;
+  txUs = 0;
+  txStamp = false;
+  broadcast = false;
+  group = 0;
+  broadcastSeq = 0;
+  reliable = false;
+  reliableSeq = 0;
+  memset(encoded, 0, sizeof(encoded));
+  memset(encodedLen, 0, sizeof(encodedLen));
   rawLen = l;
   isTxt = t;
-  raw = new uint8_t[l];
+  raw = MsgPool::alloc(l);
   memcpy(raw, r, l);
 }
 
 AF1Msg::AF1Msg(uint8_t type, uint8_t *r, int l, bool t)
 {
-  recipients = {};
+  recipients = PeerSet::everyone();
   sendCnt = 0;
   retries = 0;
   maxRetries = 0;
+  seq = nextSeq++;
+  priority = -1;
+  typeStateValid = false;
+  sender = PEER_NONE;
+  rxUs = 0;
+  txUs = 0;
+  txStamp = false;
+  broadcast = false;
+  group = 0;
+  broadcastSeq = 0;
+  reliable = false;
+  reliableSeq = 0;
+  memset(encoded, 0, sizeof(encoded));
+  memset(encodedLen, 0, sizeof(encodedLen));
   rawLen = l + 1;
   isTxt = t;
-  raw = new uint8_t[rawLen];
+  raw = MsgPool::alloc(rawLen);
   raw[0] = type;
   memcpy(raw + 1, r, l);
 }
 
 AF1Msg::AF1Msg(const AF1Msg &m)
 {
+  memset(encoded, 0, sizeof(encoded)); // Re-encoded on demand
+  memset(encodedLen, 0, sizeof(encodedLen));
   recipients = m.recipients;
+  sender = m.sender;
+  rxUs = m.rxUs;
+  txUs = m.txUs;
+  txStamp = m.txStamp;
+  broadcast = m.broadcast;
+  group = m.group;
+  broadcastSeq = m.broadcastSeq;
+  reliable = m.reliable;
+  reliableSeq = m.reliableSeq;
   sendCnt = m.sendCnt;
   retries = m.retries;
   maxRetries = m.maxRetries;
+  seq = m.seq;
+  priority = m.priority;
+  type = m.type;
+  state = m.state;
+  typeStateValid = m.typeStateValid;
   rawLen = m.rawLen;
   isTxt = m.isTxt;
   jsonDoc = m.jsonDoc;
   if (m.raw != NULL)
   {
-    raw = new uint8_t[m.rawLen];
+    raw = MsgPool::alloc(m.rawLen);
     memcpy(raw, m.raw, m.rawLen);
   }
   else
@@ -91,23 +155,33 @@ AF1Msg::AF1Msg(const AF1Msg &m)
 
 AF1Msg::AF1Msg(AF1Msg &&m)
 {
+  memcpy(encoded, m.encoded, sizeof(encoded));
+  memcpy(encodedLen, m.encodedLen, sizeof(encodedLen));
+  memset(m.encoded, 0, sizeof(m.encoded));
+  memset(m.encodedLen, 0, sizeof(m.encodedLen));
   recipients = m.recipients;
+  sender = m.sender;
+  rxUs = m.rxUs;
+  txUs = m.txUs;
+  txStamp = m.txStamp;
+  broadcast = m.broadcast;
+  group = m.group;
+  broadcastSeq = m.broadcastSeq;
+  reliable = m.reliable;
+  reliableSeq = m.reliableSeq;
   sendCnt = m.sendCnt;
   retries = m.retries;
   maxRetries = m.maxRetries;
+  seq = m.seq;
+  priority = m.priority;
+  type = m.type;
+  state = m.state;
+  typeStateValid = m.typeStateValid;
   rawLen = m.rawLen;
   isTxt = m.isTxt;
-  jsonDoc = m.jsonDoc;
-  if (m.raw != NULL)
-  {
-    raw = new uint8_t[m.rawLen];
-    memcpy(raw, m.raw, m.rawLen);
-  }
-  else
-  {
-    raw = NULL;
-  }
-  m.recipients = {};
+  jsonDoc = m.jsonDoc; // Inline storage; can't be stolen
+  raw = m.raw;
+  m.recipients = PeerSet::everyone();
   m.sendCnt = 0;
   m.retries = 0;
   m.maxRetries = 0;
@@ -119,68 +193,93 @@ AF1Msg::AF1Msg(AF1Msg &&m)
 
 AF1Msg::~AF1Msg()
 {
+  invalidate();
   if (raw != NULL)
   {
-    delete[] raw;
+    MsgPool::release(raw);
     raw = NULL;
   }
 }
 
 AF1Msg &AF1Msg::operator=(const AF1Msg &m)
-{
-  /*
-  AF1Msg temp(other);
-  std::swap(*this, temp);
-  return *this;
-  */
-  recipients = m.recipients;
-  sendCnt = m.sendCnt;
-  retries = m.retries;
-  maxRetries = m.maxRetries;
-  rawLen = m.rawLen;
-  isTxt = m.isTxt;
-  jsonDoc = m.jsonDoc;
-  if (raw != NULL)
-  {
-    delete[] raw;
-  }
-  if (m.raw != NULL)
-  {
-    raw = new uint8_t[m.rawLen];
-    memcpy(raw, m.raw, m.rawLen);
-  }
-  else
-  {
-    raw = NULL;
-  }
-  return *this;
-}
-
-AF1Msg &AF1Msg::operator=(AF1Msg &&m)
 {
   if (this != &m)
   {
+    invalidate();
     recipients = m.recipients;
+    sender = m.sender;
+    rxUs = m.rxUs;
+    txUs = m.txUs;
+    txStamp = m.txStamp;
+    broadcast = m.broadcast;
+    group = m.group;
+    broadcastSeq = m.broadcastSeq;
+    reliable = m.reliable;
+    reliableSeq = m.reliableSeq;
     sendCnt = m.sendCnt;
     retries = m.retries;
     maxRetries = m.maxRetries;
+    seq = m.seq;
+    priority = m.priority;
+    type = m.type;
+    state = m.state;
+    typeStateValid = m.typeStateValid;
     rawLen = m.rawLen;
     isTxt = m.isTxt;
     jsonDoc = m.jsonDoc;
     if (raw != NULL)
     {
-      delete[] raw;
+      MsgPool::release(raw);
     }
     if (m.raw != NULL)
     {
-      raw = new uint8_t[m.rawLen];
+      raw = MsgPool::alloc(m.rawLen);
       memcpy(raw, m.raw, m.rawLen);
     }
     else
     {
       raw = NULL;
     }
-    m.recipients = {};
+  }
+  return *this;
+}
+
+AF1Msg &AF1Msg::operator=(AF1Msg &&m)
+{
+  if (this != &m)
+  {
+    invalidate();
+    memcpy(encoded, m.encoded, sizeof(encoded));
+    memcpy(encodedLen, m.encodedLen, sizeof(encodedLen));
+    memset(m.encoded, 0, sizeof(m.encoded));
+    memset(m.encodedLen, 0, sizeof(m.encodedLen));
+    recipients = m.recipients;
+    sender = m.sender;
+    rxUs = m.rxUs;
+    txUs = m.txUs;
+    txStamp = m.txStamp;
+    broadcast = m.broadcast;
+    group = m.group;
+    broadcastSeq = m.broadcastSeq;
+    reliable = m.reliable;
+    reliableSeq = m.reliableSeq;
+    sendCnt = m.sendCnt;
+    retries = m.retries;
+    maxRetries = m.maxRetries;
+    seq = m.seq;
+    priority = m.priority;
+    type = m.type;
+    state = m.state;
+    typeStateValid = m.typeStateValid;
+    rawLen = m.rawLen;
+    isTxt = m.isTxt;
+    jsonDoc = m.jsonDoc;
+    if (raw != NULL)
+    {
+      MsgPool::release(raw);
+    }
+    raw = m.raw;
+    m.recipients = PeerSet::everyone();
     m.sendCnt = 0;
     m.retries = 0;
     m.maxRetries = 0;
@@ -194,9 +293,61 @@ AF1Msg &AF1Msg::operator=(AF1Msg &&m)
 
 JsonDocument &AF1Msg::json()
 {
+  invalidate(); // Caller may modify the document
+  typeStateValid = false;
   return jsonDoc;
 }
 
+const JsonDocument &AF1Msg::readJson() const
+{
+  return jsonDoc;
+}
+
+void AF1Msg::invalidate()
+{
+  for (int i = 0; i < WIRE_FORMAT_CNT; i++)
+  {
+    MsgPool::release(encoded[i]);
+    encoded[i] = NULL;
+    encodedLen[i] = 0;
+  }
+}
+
+const uint8_t *AF1Msg::encode(wire_format f, size_t &len)
+{
+  if (encoded[f] == NULL && raw == NULL)
+  {
+    switch (f)
+    {
+    case WIRE_FORMAT_BINARY:
+    {
+      uint8_t *buf = MsgPool::alloc(POOL_SMALL_SIZE);
+      encodedLen[f] = toWire(buf, POOL_SMALL_SIZE);
+      if (encodedLen[f])
+      {
+        encoded[f] = buf;
+      }
+      else
+      {
+        MsgPool::release(buf);
+      }
+    }
+    break;
+    case WIRE_FORMAT_JSON:
+    {
+      size_t l = measureJson(jsonDoc);
+      encoded[f] = MsgPool::alloc(l + 1);
+      encodedLen[f] = serializeJson(jsonDoc, (char *)encoded[f], l + 1);
+    }
+    break;
+    default:
+      break;
+    }
+  }
+  len = encodedLen[f];
+  return encoded[f];
+}
+
 const uint8_t *AF1Msg::getRaw()
 {
   return raw;
@@ -212,35 +363,495 @@ bool AF1Msg::getIsTxt()
   return isTxt;
 }
 
+msg_priority AF1Msg::getPriority()
+{
+  return priority < 0 ? getTypePriority(getType()) : (msg_priority)priority;
+}
+
+void AF1Msg::setPriority(msg_priority p)
+{
+  priority = p;
+}
+
+msg_priority AF1Msg::getTypePriority(uint8_t type)
+{
+  if (typePriority[type])
+  {
+    return (msg_priority)(typePriority[type] - 1);
+  }
+  switch (type)
+  {
+  case TYPE_HANDSHAKE_REQUEST:
+  case TYPE_HANDSHAKE_RESPONSE:
+  case TYPE_CHANGE_STATE:
+  case TYPE_TIME_SYNC:
+  case TYPE_TIME_SYNC_RESPONSE:
+  case TYPE_TIME_SYNC_START:
+  case TYPE_TIME_SYNC_BEACON:
+  case TYPE_TIME_SYNC_REPORT:
+  case TYPE_BROADCAST_HEARTBEAT:
+  case TYPE_BROADCAST_NACK:
+  case TYPE_RELIABLE_ACK:
+  case TYPE_MQTT_SUBACK:
+  case TYPE_MQTT_UNSUBACK:
+  case TYPE_MQTT_PUBACK:
+  case TYPE_MQTT_PUBREC:
+  case TYPE_MQTT_PUBREL:
+  case TYPE_MQTT_PUBCOMP:
+    return PRIORITY_HIGH;
+  case TYPE_EVENT_STATS:
+    return PRIORITY_LOW;
+  default:
+    return PRIORITY_NORMAL;
+  }
+}
+
+void AF1Msg::setTypePriority(uint8_t type, msg_priority p)
+{
+  typePriority[type] = p + 1;
+}
+
+void AF1Msg::decodeTypeState()
+{
+  if (!typeStateValid)
+  {
+    type = jsonDoc["type"];
+    state = jsonDoc["state"];
+    typeStateValid = true;
+  }
+}
+
 uint8_t AF1Msg::getType()
 {
-  return jsonDoc["type"];
+  decodeTypeState();
+  return type;
 }
 
 uint8_t AF1Msg::getState()
 {
-  return jsonDoc["state"];
+  decodeTypeState();
+  return state;
+}
+
+msg_header AF1Msg::getHeader()
+{
+  decodeTypeState();
+  msg_header h;
+  h.type = type;
+  h.state = state;
+  h.seq = seq;
+  h.sender = sender;
+  return h;
 }
 
 String AF1Msg::getSenderId()
 {
-  return jsonDoc["senderId"];
+  const char *id = jsonDoc["senderId"];
+  if (id != NULL)
+  {
+    return id;
+  }
+  // Binary wire messages identify the sender by MAC, resolved to a handle on receive
+  return sender != PEER_NONE ? Base::getPeerId(sender) : "";
+}
+
+peer_handle AF1Msg::getSender()
+{
+  return sender;
+}
+
+time_us AF1Msg::getRxUs()
+{
+  return rxUs;
 }
 
-std::set<String> AF1Msg::getRecipients()
+void AF1Msg::setRxUs(time_us t)
+{
+  rxUs = t;
+}
+
+time_us AF1Msg::getTxUs()
+{
+  return txUs;
+}
+
+void AF1Msg::setTxStamp(bool s)
+{
+  if (s != txStamp)
+  {
+    invalidate();
+  }
+  txStamp = s;
+}
+
+bool AF1Msg::getTxStamp()
+{
+  return txStamp;
+}
+
+void AF1Msg::stampTx(time_us t)
+{
+  txUs = t;
+  if (encoded[WIRE_FORMAT_BINARY] != NULL)
+  {
+    stampTx(encoded[WIRE_FORMAT_BINARY], encodedLen[WIRE_FORMAT_BINARY], t);
+  }
+}
+
+void AF1Msg::stampTx(uint8_t *data, size_t len, time_us t)
+{
+  if (!isWire(data, len) || !(data[2] & WIRE_FLAG_TX_STAMP) || len < AF1_WIRE_HEADER_LEN + AF1_WIRE_TX_STAMP_LEN)
+  {
+    return;
+  }
+  for (int i = 0; i < AF1_WIRE_TX_STAMP_LEN; i++)
+  {
+    data[AF1_WIRE_HEADER_LEN + i] = t >> (8 * i);
+  }
+}
+
+void AF1Msg::setBroadcast(bool b, uint8_t g, uint16_t s)
+{
+  if (b != broadcast || g != group || s != broadcastSeq)
+  {
+    invalidate(); // The header changes
+  }
+  broadcast = b;
+  group = g;
+  broadcastSeq = s;
+}
+
+bool AF1Msg::isBroadcast()
+{
+  return broadcast;
+}
+
+uint8_t AF1Msg::getGroup()
+{
+  return group;
+}
+
+uint16_t AF1Msg::getBroadcastSeq()
+{
+  return broadcastSeq;
+}
+
+void AF1Msg::setReliable(bool r)
+{
+  if (r != reliable)
+  {
+    invalidate();
+  }
+  reliable = r;
+}
+
+bool AF1Msg::isReliable()
+{
+  return reliable;
+}
+
+uint16_t AF1Msg::getReliableSeq()
+{
+  return reliableSeq;
+}
+
+void AF1Msg::setReliableSeq(uint8_t *data, size_t len, uint16_t seq)
+{
+  if (!isWire(data, len) || !(data[2] & WIRE_FLAG_RELIABLE))
+  {
+    return;
+  }
+  size_t i = AF1_WIRE_HEADER_LEN;
+  if (data[2] & WIRE_FLAG_TX_STAMP)
+  {
+    i += AF1_WIRE_TX_STAMP_LEN;
+  }
+  if (data[2] & WIRE_FLAG_BROADCAST)
+  {
+    i += AF1_WIRE_BROADCAST_LEN;
+  }
+  if (i + AF1_WIRE_RELIABLE_LEN > len)
+  {
+    return;
+  }
+  data[i] = seq & 0xFF;
+  data[i + 1] = seq >> 8;
+}
+
+void AF1Msg::setSender(peer_handle h)
+{
+  sender = h;
+}
+
+uint16_t AF1Msg::getSeq()
+{
+  return seq;
+}
+
+static bool isHeaderKey(const char *k)
+{
+  return !strcmp(k, "type") || !strcmp(k, "state") || !strcmp(k, "senderId");
+}
+
+bool AF1Msg::isWire(const uint8_t *buf, size_t len)
+{
+  return len >= AF1_WIRE_HEADER_LEN && buf[0] == AF1_WIRE_MAGIC && buf[1] == AF1_WIRE_VERSION;
+}
+
+size_t AF1Msg::toWire(uint8_t *buf, size_t len)
+{
+  if (raw != NULL || !jsonDoc.is<JsonObject>() || len < AF1_WIRE_HEADER_LEN)
+  {
+    return 0;
+  }
+
+  uint8_t type = getType();
+  // Handshakes introduce the sender, so its MAC may not be known on the other end yet
+  uint8_t flags = type == TYPE_HANDSHAKE_REQUEST || type == TYPE_HANDSHAKE_RESPONSE ? WIRE_FLAG_SENDER_ID : 0;
+  if (txStamp)
+  {
+    flags |= WIRE_FLAG_TX_STAMP;
+  }
+  if (broadcast)
+  {
+    flags |= WIRE_FLAG_BROADCAST;
+  }
+  if (reliable)
+  {
+    flags |= WIRE_FLAG_RELIABLE;
+  }
+
+  size_t i = 0;
+  buf[i++] = AF1_WIRE_MAGIC;
+  buf[i++] = AF1_WIRE_VERSION;
+  buf[i++] = flags;
+  buf[i++] = type;
+  buf[i++] = getState();
+  buf[i++] = seq & 0xFF;
+  buf[i++] = seq >> 8;
+
+  if (flags & WIRE_FLAG_TX_STAMP)
+  {
+    if (i + AF1_WIRE_TX_STAMP_LEN > len)
+    {
+      return 0;
+    }
+    memset(buf + i, 0, AF1_WIRE_TX_STAMP_LEN); // See stampTx()
+    i += AF1_WIRE_TX_STAMP_LEN;
+  }
+
+  if (flags & WIRE_FLAG_BROADCAST)
+  {
+    if (i + AF1_WIRE_BROADCAST_LEN > len)
+    {
+      return 0;
+    }
+    buf[i++] = group;
+    buf[i++] = broadcastSeq & 0xFF;
+    buf[i++] = broadcastSeq >> 8;
+  }
+
+  if (flags & WIRE_FLAG_RELIABLE)
+  {
+    if (i + AF1_WIRE_RELIABLE_LEN > len)
+    {
+      return 0;
+    }
+    buf[i++] = reliableSeq & 0xFF;
+    buf[i++] = reliableSeq >> 8;
+  }
+
+  if (flags & WIRE_FLAG_SENDER_ID)
+  {
+    const char *id = jsonDoc["senderId"];
+    size_t idLen = id != NULL ? strlen(id) : 0;
+    if (idLen > 0xFF || i + 1 + idLen > len)
+    {
+      return 0;
+    }
+    buf[i++] = idLen;
+    memcpy(buf + i, id, idLen);
+    i += idLen;
+  }
+
+  // Payload: MessagePack map of everything except the header keys
+  JsonObjectConst obj = jsonDoc.as<JsonObjectConst>();
+  size_t n = 0;
+  for (JsonPairConst kv : obj)
+  {
+    if (!isHeaderKey(kv.key().c_str()))
+    {
+      n++;
+    }
+  }
+  if (!n)
+  {
+    return i;
+  }
+  if (n < 16)
+  {
+    if (i + 1 > len)
+    {
+      return 0;
+    }
+    buf[i++] = 0x80 | n;
+  }
+  else
+  {
+    if (i + 3 > len)
+    {
+      return 0;
+    }
+    buf[i++] = 0xDE;
+    buf[i++] = n >> 8;
+    buf[i++] = n & 0xFF;
+  }
+  for (JsonPairConst kv : obj)
+  {
+    const char *k = kv.key().c_str();
+    if (isHeaderKey(k))
+    {
+      continue;
+    }
+    size_t kLen = strlen(k);
+    if (kLen > 0xFF || i + 2 + kLen > len)
+    {
+      return 0;
+    }
+    if (kLen < 32)
+    {
+      buf[i++] = 0xA0 | kLen;
+    }
+    else
+    {
+      buf[i++] = 0xD9;
+      buf[i++] = kLen;
+    }
+    memcpy(buf + i, k, kLen);
+    i += kLen;
+    size_t vLen = measureMsgPack(kv.value());
+    if (i + vLen > len)
+    {
+      return 0;
+    }
+    i += serializeMsgPack(kv.value(), buf + i, len - i);
+  }
+  return i;
+}
+
+bool AF1Msg::fromWire(const uint8_t *buf, size_t len)
+{
+  if (!isWire(buf, len))
+  {
+    return false;
+  }
+
+  uint8_t flags = buf[2];
+  size_t i = AF1_WIRE_HEADER_LEN;
+  time_us tx = 0;
+  if (flags & WIRE_FLAG_TX_STAMP)
+  {
+    if (i + AF1_WIRE_TX_STAMP_LEN > len)
+    {
+      return false;
+    }
+    for (int j = 0; j < AF1_WIRE_TX_STAMP_LEN; j++)
+    {
+      tx |= (time_us)buf[i + j] << (8 * j);
+    }
+    i += AF1_WIRE_TX_STAMP_LEN;
+  }
+  uint8_t g = 0;
+  uint16_t bseq = 0;
+  if (flags & WIRE_FLAG_BROADCAST)
+  {
+    if (i + AF1_WIRE_BROADCAST_LEN > len)
+    {
+      return false;
+    }
+    g = buf[i];
+    bseq = buf[i + 1] | (buf[i + 2] << 8);
+    i += AF1_WIRE_BROADCAST_LEN;
+  }
+  uint16_t rseq = 0;
+  if (flags & WIRE_FLAG_RELIABLE)
+  {
+    if (i + AF1_WIRE_RELIABLE_LEN > len)
+    {
+      return false;
+    }
+    rseq = buf[i] | (buf[i + 1] << 8);
+    i += AF1_WIRE_RELIABLE_LEN;
+  }
+  char id[0x100];
+  id[0] = '\0';
+  if (flags & WIRE_FLAG_SENDER_ID)
+  {
+    if (i >= len || i + 1 + buf[i] > len)
+    {
+      return false;
+    }
+    uint8_t idLen = buf[i++];
+    memcpy(id, buf + i, idLen);
+    id[idLen] = '\0';
+    i += idLen;
+  }
+
+  invalidate();
+  typeStateValid = false;
+  jsonDoc.clear();
+  if (i < len && deserializeMsgPack(jsonDoc, buf + i, len - i))
+  {
+    return false;
+  }
+  if (!jsonDoc.is<JsonObject>())
+  {
+    jsonDoc.to<JsonObject>();
+  }
+  jsonDoc["type"] = buf[3];
+  jsonDoc["state"] = buf[4];
+  type = buf[3];
+  state = buf[4];
+  typeStateValid = true;
+  if (flags & WIRE_FLAG_SENDER_ID)
+  {
+    jsonDoc["senderId"] = id; // Non-const char * so the document keeps its own copy
+  }
+  seq = buf[5] | (buf[6] << 8);
+  txUs = tx;
+  txStamp = flags & WIRE_FLAG_TX_STAMP;
+  broadcast = flags & WIRE_FLAG_BROADCAST;
+  group = g;
+  broadcastSeq = bseq;
+  reliable = flags & WIRE_FLAG_RELIABLE;
+  reliableSeq = rseq;
+  return true;
+}
+
+const PeerSet &AF1Msg::getRecipients()
 {
   return recipients;
 }
 
-void AF1Msg::setRecipients(std::set<String> r)
+void AF1Msg::setRecipients(const std::set<String> &ids)
 {
-  recipients = r;
-  for (std::set<String>::iterator it = r.begin(); it != r.end(); it++)
+  if (ids.empty())
+  {
+    recipients = PeerSet::everyone();
+    return;
+  }
+  recipients = PeerSet();
+  for (std::set<String>::const_iterator it = ids.begin(); it != ids.end(); it++)
   {
-    recipients.insert(*it);
+    recipients.add(Base::getPeerHandle(*it));
   }
 }
 
+void AF1Msg::setRecipients(const PeerSet &r)
+{
+  recipients = r;
+}
+
 int AF1Msg::incrementSendCnt()
 {
   return sendCnt++;
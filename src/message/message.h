@@ -24,7 +24,9 @@
 #include <set>
 #include <ArduinoJson.h>
 
+#include "clock/clock.h"
 #include "state/state.h"
+#include "peer/handle.h"
 #include <pre.h>
 
 enum MessageType
@@ -48,6 +50,59 @@ enum MessageType
   TYPE_MQTT_PUBREC,
   TYPE_MQTT_PUBREL,
   TYPE_MQTT_PUBCOMP,
+  // Diagnostics
+  TYPE_EVENT_STATS,
+  // Broadcast time sync (TIME_SYNC_BROADCAST)
+  TYPE_TIME_SYNC_BEACON,
+  TYPE_TIME_SYNC_REPORT,
+  // Broadcast repair (ESPNOW_BROADCAST)
+  TYPE_BROADCAST_HEARTBEAT,
+  TYPE_BROADCAST_NACK,
+  // Reliable channel (AF1Msg::setReliable())
+  TYPE_RELIABLE_ACK,
+};
+
+/*
+  Binary wire format (ESP-Now):
+  [magic][version][flags][type][state][seq lo][seq hi] [tx us (8, LE)] [group][bcast seq lo][bcast seq hi] [rel seq lo][rel seq hi] [id len][id...] [MessagePack payload]
+  The send time is only included when WIRE_FLAG_TX_STAMP is set; it's written into the encoded
+  bytes right before each esp_now_send() (see AF1Msg::stampTx()).
+  The group and broadcast sequence number are only included when WIRE_FLAG_BROADCAST is set, and the
+  reliable channel's sequence number when WIRE_FLAG_RELIABLE is; it's per recipient (see AF1Msg::setReliableSeq()).
+  The sender ID is only included when WIRE_FLAG_SENDER_ID is set; otherwise the receiver
+  resolves the sender from the source MAC address.
+*/
+enum wire_flag
+{
+  WIRE_FLAG_SENDER_ID = 1 << 0,
+  WIRE_FLAG_TX_STAMP = 1 << 1,
+  WIRE_FLAG_BROADCAST = 1 << 2,
+  WIRE_FLAG_RELIABLE = 1 << 3,
+};
+
+// Box lanes; lower drains first
+enum msg_priority
+{
+  PRIORITY_HIGH,   // Control traffic: handshakes, time sync, state changes, MQTT acks
+  PRIORITY_NORMAL, // Default for application messages
+  PRIORITY_LOW,    // Bulk data
+  PRIORITY_CNT
+};
+
+enum wire_format
+{
+  WIRE_FORMAT_BINARY,
+  WIRE_FORMAT_JSON,
+  WIRE_FORMAT_CNT
+};
+
+// Routing fields, decoded once per message
+struct msg_header
+{
+  uint8_t type;
+  uint8_t state;
+  uint16_t seq;
+  peer_handle sender;
 };
 
 class AF1Msg
@@ -56,10 +111,30 @@ class AF1Msg
   uint8_t *raw;
   int rawLen;
   bool isTxt;
-  std::set<String> recipients;
+  PeerSet recipients;
+  peer_handle sender;
+  time_us rxUs;
+  time_us txUs;
+  bool txStamp;
+  bool broadcast;
+  uint8_t group;
+  uint16_t broadcastSeq;
+  bool reliable;
+  uint16_t reliableSeq;
   int sendCnt;
   int retries;
   int maxRetries;
+  uint16_t seq;
+  int8_t priority; // -1: by type
+  uint8_t type;    // Cached from the document while typeStateValid
+  uint8_t state;
+  bool typeStateValid;
+  // Encoded bytes per format; built on first use, dropped whenever json() is accessed (readJson() keeps them)
+  uint8_t *encoded[WIRE_FORMAT_CNT];
+  size_t encodedLen[WIRE_FORMAT_CNT];
+
+  void invalidate();
+  void decodeTypeState();
 
 public:
   AF1Msg();
@@ -73,16 +148,46 @@ public:
   AF1Msg &operator=(const AF1Msg &m); // Copy
   AF1Msg &operator=(AF1Msg &&m);      // Move
 
-  JsonDocument &json();
+  JsonDocument &json();                 // For changes; drops the encoded bytes and cached type/state
+  const JsonDocument &readJson() const; // For reading; keeps them
   const uint8_t *getRaw();
   int getRawLen();
   bool getIsTxt();
   uint8_t getType();
   uint8_t getState();
+  msg_header getHeader();
   String getSenderId();
+  peer_handle getSender(); // PEER_NONE if not received from a known ESP-Now peer
+  void setSender(peer_handle h);
+  time_us getRxUs(); // When the frame arrived (AF1Clock); 0 if not received
+  void setRxUs(time_us t);
+  time_us getTxUs(); // Sent: when we last sent it. Received: the sender's clock, if it was stamped. Else 0
+  void setTxStamp(bool s); // Carry the send time over ESP-Now (binary format only)
+  bool getTxStamp();
+  void stampTx(time_us t); // Sets the send time, in the encoded bytes too
+  static void stampTx(uint8_t *data, size_t len, time_us t); // Patches a copy of the encoded bytes
+  void setBroadcast(bool b, uint8_t group = 0, uint16_t seq = 0); // Sent as one sequenced broadcast frame (binary format only)
+  bool isBroadcast();
+  uint8_t getGroup();
+  uint16_t getBroadcastSeq();
+  void setReliable(bool r); // Acked, resent until it is, and handed over once and in order (binary format, ESP-Now peers only)
+  bool isReliable();
+  uint16_t getReliableSeq();
+  static void setReliableSeq(uint8_t *data, size_t len, uint16_t seq); // Patches a copy of the encoded bytes
+  uint16_t getSeq();
+  msg_priority getPriority();
+  void setPriority(msg_priority p); // Overrides the type's priority for this message
+  static msg_priority getTypePriority(uint8_t type);
+  static void setTypePriority(uint8_t type, msg_priority p);
+
+  size_t toWire(uint8_t *buf, size_t len); // Returns 0 if the message does not fit
+  bool fromWire(const uint8_t *buf, size_t len);
+  const uint8_t *encode(wire_format f, size_t &len); // Cached; NULL if the message can't be encoded in this format
+  static bool isWire(const uint8_t *buf, size_t len);
 
-  void setRecipients(std::set<String> r);
-  std::set<String> getRecipients();
+  void setRecipients(const std::set<String> &ids); // Unknown IDs are ignored; empty means all peers
+  void setRecipients(const PeerSet &r);
+  const PeerSet &getRecipients();
   int incrementSendCnt();
   int getSendCnt();
   void setMaxRetries(int m);
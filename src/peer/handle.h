@@ -0,0 +1,56 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef PEER_HANDLE_H_
+#define PEER_HANDLE_H_
+
+#include <Arduino.h>
+#include <initializer_list>
+
+#include "pre.h"
+
+// Small integer assigned to each ESP-Now peer by the registry; stable for the life of the device
+typedef uint8_t peer_handle;
+
+#define PEER_NONE 0xFF
+
+#define PEER_SET_WORDS ((MAX_PEERS + 31) / 32)
+
+// Bitset of peer handles; iterates in handle order. "All" stands for every known peer.
+class PeerSet
+{
+  uint32_t bits[PEER_SET_WORDS];
+  bool all;
+
+public:
+  PeerSet();
+  PeerSet(std::initializer_list<peer_handle> l);
+  static PeerSet everyone();
+
+  void add(peer_handle h);
+  void remove(peer_handle h);
+  bool has(peer_handle h) const;
+  bool empty() const;
+  bool isAll() const;
+  uint8_t count() const;
+  peer_handle first() const;
+  peer_handle next(peer_handle h) const; // PEER_NONE when done
+};
+
+#endif // PEER_HANDLE_H_
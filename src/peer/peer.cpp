@@ -0,0 +1,282 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "peer.h"
+
+static_assert(MAX_PEERS < PEER_NONE, "MAX_PEERS too large for peer_handle");
+static_assert(PEER_INDEX_SIZE > MAX_PEERS && !(PEER_INDEX_SIZE & (PEER_INDEX_SIZE - 1)), "PEER_INDEX_SIZE must be a power of 2 larger than MAX_PEERS");
+
+PeerSet::PeerSet()
+{
+  memset(bits, 0, sizeof(bits));
+  all = false;
+}
+
+PeerSet::PeerSet(std::initializer_list<peer_handle> l) : PeerSet()
+{
+  for (peer_handle h : l)
+  {
+    add(h);
+  }
+}
+
+PeerSet PeerSet::everyone()
+{
+  PeerSet s;
+  s.all = true;
+  return s;
+}
+
+void PeerSet::add(peer_handle h)
+{
+  if (h < MAX_PEERS)
+  {
+    bits[h >> 5] |= 1UL << (h & 31);
+  }
+}
+
+void PeerSet::remove(peer_handle h)
+{
+  if (h < MAX_PEERS)
+  {
+    bits[h >> 5] &= ~(1UL << (h & 31));
+  }
+}
+
+bool PeerSet::has(peer_handle h) const
+{
+  return h < MAX_PEERS && (bits[h >> 5] >> (h & 31)) & 1;
+}
+
+bool PeerSet::empty() const
+{
+  for (int i = 0; i < PEER_SET_WORDS; i++)
+  {
+    if (bits[i])
+    {
+      return false;
+    }
+  }
+  return !all;
+}
+
+bool PeerSet::isAll() const
+{
+  return all;
+}
+
+uint8_t PeerSet::count() const
+{
+  uint8_t c = 0;
+  for (int i = 0; i < PEER_SET_WORDS; i++)
+  {
+    c += __builtin_popcount(bits[i]);
+  }
+  return c;
+}
+
+peer_handle PeerSet::first() const
+{
+  return has(0) ? 0 : next(0);
+}
+
+peer_handle PeerSet::next(peer_handle h) const
+{
+  int n = h + 1;
+  for (int i = n >> 5; i < PEER_SET_WORDS; i++)
+  {
+    uint32_t w = bits[i];
+    if (i == n >> 5)
+    {
+      w &= n & 31 ? ~0UL << (n & 31) : ~0UL;
+    }
+    if (w)
+    {
+      return (i << 5) + __builtin_ctz(w);
+    }
+  }
+  return PEER_NONE;
+}
+
+static uint32_t hashId(const char *s)
+{
+  // FNV-1a
+  uint32_t h = 2166136261UL;
+  while (*s)
+  {
+    h = (h ^ (uint8_t)*s++) * 16777619UL;
+  }
+  return h;
+}
+
+static uint32_t hashMac(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xFF51AFD7ED558CCDULL;
+  k ^= k >> 33;
+  return k;
+}
+
+PeerRegistry::PeerRegistry()
+{
+  cnt = 0;
+  memset(macIndex, 0, sizeof(macIndex));
+  memset(macIndex[0].byMac, PEER_NONE, sizeof(macIndex[0].byMac));
+  memset(macIndex[1].byMac, PEER_NONE, sizeof(macIndex[1].byMac));
+  activeMac.store(0, std::memory_order_relaxed);
+  macGen.store(0, std::memory_order_relaxed);
+  memset(byId, PEER_NONE, sizeof(byId));
+}
+
+uint64_t PeerRegistry::macToKey(const uint8_t *mac)
+{
+  uint64_t k = 0;
+  for (int i = 0; i < 6; i++)
+  {
+    k = (k << 8) | mac[i];
+  }
+  return k;
+}
+
+// Rebuilds the idle copy of the MAC index with h's MAC set to k, then makes it the active one
+void PeerRegistry::setMac(peer_handle h, uint64_t k)
+{
+  uint8_t w = !activeMac.load(std::memory_order_relaxed);
+  macGen.fetch_add(1, std::memory_order_acq_rel);
+  peer_mac_index &x = macIndex[w];
+  memcpy(x.macs, macIndex[!w].macs, sizeof(x.macs));
+  x.macs[h] = k;
+  memset(x.byMac, PEER_NONE, sizeof(x.byMac));
+  for (peer_handle p = 0; p < cnt; p++)
+  {
+    uint32_t i = hashMac(x.macs[p]) & (PEER_INDEX_SIZE - 1);
+    while (x.byMac[i] != PEER_NONE)
+    {
+      i = (i + 1) & (PEER_INDEX_SIZE - 1);
+    }
+    x.byMac[i] = p;
+  }
+  activeMac.store(w, std::memory_order_release);
+}
+
+peer_handle PeerRegistry::add(const String &id, const uint8_t *mac)
+{
+  peer_handle h = find(id);
+  if (h != PEER_NONE)
+  {
+    // Known ID; the MAC may have changed
+    uint64_t k = macToKey(mac);
+    if (macIndex[activeMac.load(std::memory_order_relaxed)].macs[h] != k)
+    {
+      setMac(h, k);
+    }
+    return h;
+  }
+  if (cnt >= MAX_PEERS)
+  {
+    Serial.println("Peer registry full");
+    return PEER_NONE;
+  }
+
+  h = cnt++;
+  peers[h].id = id;
+  idHashes[h] = hashId(id.c_str());
+  setMac(h, macToKey(mac));
+  uint32_t i = idHashes[h] & (PEER_INDEX_SIZE - 1);
+  while (byId[i] != PEER_NONE)
+  {
+    i = (i + 1) & (PEER_INDEX_SIZE - 1);
+  }
+  byId[i] = h;
+  return h;
+}
+
+peer_handle PeerRegistry::find(const String &id) const
+{
+  return find(id.c_str());
+}
+
+peer_handle PeerRegistry::find(const char *id) const
+{
+  uint32_t hash = hashId(id);
+  for (uint32_t i = hash & (PEER_INDEX_SIZE - 1); byId[i] != PEER_NONE; i = (i + 1) & (PEER_INDEX_SIZE - 1))
+  {
+    peer_handle h = byId[i];
+    if (idHashes[h] == hash && !strcmp(peers[h].id.c_str(), id))
+    {
+      return h;
+    }
+  }
+  return PEER_NONE;
+}
+
+peer_handle PeerRegistry::find(const uint8_t *mac) const
+{
+  uint64_t k = macToKey(mac);
+  while (true)
+  {
+    uint32_t gen = macGen.load(std::memory_order_acquire);
+    const peer_mac_index &x = macIndex[activeMac.load(std::memory_order_acquire)];
+    peer_handle found = PEER_NONE;
+    for (uint32_t i = hashMac(k) & (PEER_INDEX_SIZE - 1); x.byMac[i] != PEER_NONE; i = (i + 1) & (PEER_INDEX_SIZE - 1))
+    {
+      if (x.macs[x.byMac[i]] == k)
+      {
+        found = x.byMac[i];
+        break;
+      }
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // Unchanged unless add() started rebuilding the copy we read; it never waits on us
+    if (macGen.load(std::memory_order_relaxed) == gen)
+    {
+      return found;
+    }
+  }
+}
+
+bool PeerRegistry::has(peer_handle h) const
+{
+  return h < cnt;
+}
+
+const String &PeerRegistry::getId(peer_handle h) const
+{
+  return peers[h].id;
+}
+
+peer_handle PeerRegistry::size() const
+{
+  return cnt;
+}
+
+PeerSet PeerRegistry::getAll() const
+{
+  PeerSet s;
+  for (peer_handle h = 0; h < cnt; h++)
+  {
+    s.add(h);
+  }
+  return s;
+}
+
+af1_peer_info &PeerRegistry::operator[](peer_handle h)
+{
+  return peers[h];
+}
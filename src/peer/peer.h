@@ -0,0 +1,89 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef PEER_PEER_H_
+#define PEER_PEER_H_
+
+#include <Arduino.h>
+#include <esp_now.h>
+#include <atomic>
+
+#include "handle.h"
+#include "clock/clock.h"
+#include "message/message.h"
+#include "timeSync/timeSync.h"
+#include "broadcast/broadcast.h"
+#include "reliable/reliable.h"
+#include "txQueue/txQueue.h"
+#include "pre.h"
+
+typedef struct af1_peer_info
+{
+  String id;
+  esp_now_peer_info_t espnowPeerInfo;
+  bool handshakeRequest;
+  bool handshakeResponse;
+  TimeSync timeSync;
+  TxQueue txQueue;
+  BroadcastRx broadcastRx;
+  ReliableTx reliableTx;
+  ReliableRx reliableRx;
+} af1_peer_info;
+
+struct peer_mac_index
+{
+  uint64_t macs[MAX_PEERS];
+  peer_handle byMac[PEER_INDEX_SIZE];
+};
+
+/*
+  Fixed table of peers indexed by handle, with open-addressed indexes by
+  48-bit MAC and by device ID; lookups don't allocate.
+  The ESP-Now callbacks look peers up by MAC on the WiFi task, so the MAC index is
+  double buffered: add() rebuilds the idle copy and then publishes it. Everything
+  else is loop task only.
+*/
+class PeerRegistry
+{
+  af1_peer_info peers[MAX_PEERS];
+  peer_mac_index macIndex[2];
+  std::atomic<uint8_t> activeMac;
+  std::atomic<uint32_t> macGen; // Bumped before a copy is rebuilt; find(mac) retries if it moved
+  uint32_t idHashes[MAX_PEERS];
+  peer_handle byId[PEER_INDEX_SIZE];
+  peer_handle cnt;
+
+  void setMac(peer_handle h, uint64_t k);
+
+public:
+  PeerRegistry();
+  peer_handle add(const String &id, const uint8_t *mac); // Returns the existing handle if the ID is known
+  peer_handle find(const String &id) const;
+  peer_handle find(const char *id) const;
+  peer_handle find(const uint8_t *mac) const; // Any task
+  bool has(peer_handle h) const;
+  const String &getId(peer_handle h) const;
+  peer_handle size() const;
+  PeerSet getAll() const;
+  af1_peer_info &operator[](peer_handle h);
+
+  static uint64_t macToKey(const uint8_t *mac);
+};
+
+#endif // PEER_PEER_H_
@@ -0,0 +1,158 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <atomic>
+
+#include "pool.h"
+
+/*
+  Lock-free (Treiber) stack of free block indices; usable from the WiFi task callbacks.
+  The head packs a tag in the upper 16 bits to avoid ABA.
+*/
+template <size_t S, size_t N>
+class BlockPool
+{
+  uint8_t blocks[N][S];
+  std::atomic<uint16_t> next[N];
+  std::atomic<uint32_t> head;
+
+public:
+  BlockPool()
+  {
+    for (size_t i = 0; i < N; i++)
+    {
+      next[i].store(i + 1, std::memory_order_relaxed);
+    }
+    head.store(0, std::memory_order_relaxed);
+  }
+
+  uint8_t *take()
+  {
+    uint32_t h = head.load(std::memory_order_acquire);
+    while (true)
+    {
+      uint16_t i = h & 0xFFFF;
+      if (i >= N)
+      {
+        return NULL;
+      }
+      uint32_t n = ((h >> 16) + 1) << 16 | next[i].load(std::memory_order_relaxed);
+      if (head.compare_exchange_weak(h, n, std::memory_order_acq_rel, std::memory_order_acquire))
+      {
+        return blocks[i];
+      }
+    }
+  }
+
+  void give(uint8_t *p)
+  {
+    uint16_t i = (p - blocks[0]) / S;
+    uint32_t h = head.load(std::memory_order_relaxed);
+    uint32_t n;
+    do
+    {
+      next[i].store(h & 0xFFFF, std::memory_order_relaxed);
+      n = ((h >> 16) + 1) << 16 | i;
+    } while (!head.compare_exchange_weak(h, n, std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  bool owns(const uint8_t *p)
+  {
+    return p >= blocks[0] && p < blocks[0] + S * N;
+  }
+};
+
+static BlockPool<POOL_SMALL_SIZE, POOL_SMALL_CNT> smallPool;
+static BlockPool<POOL_LARGE_SIZE, POOL_LARGE_CNT> largePool;
+
+static std::atomic<unsigned long> allocs;
+static std::atomic<unsigned long> fallbacks;
+static std::atomic<unsigned long> exhausted;
+static std::atomic<unsigned long> inUse;
+static std::atomic<unsigned long> highWater;
+
+static uint8_t *taken(uint8_t *p)
+{
+  allocs++;
+  unsigned long u = ++inUse;
+  unsigned long h = highWater.load(std::memory_order_relaxed);
+  while (u > h && !highWater.compare_exchange_weak(h, u, std::memory_order_relaxed))
+    ;
+  return p;
+}
+
+uint8_t *MsgPool::alloc(size_t len)
+{
+  uint8_t *p = NULL;
+  if (len <= POOL_SMALL_SIZE && (p = smallPool.take()) != NULL)
+  {
+    return taken(p);
+  }
+  // Small requests overflow into the large pool before the heap
+  if (len <= POOL_LARGE_SIZE && (p = largePool.take()) != NULL)
+  {
+    return taken(p);
+  }
+  if (len <= POOL_LARGE_SIZE)
+  {
+    exhausted++;
+  }
+  fallbacks++;
+  return new uint8_t[len];
+}
+
+void MsgPool::release(uint8_t *p)
+{
+  if (p == NULL)
+  {
+    return;
+  }
+  if (smallPool.owns(p))
+  {
+    smallPool.give(p);
+    inUse--;
+  }
+  else if (largePool.owns(p))
+  {
+    largePool.give(p);
+    inUse--;
+  }
+  else
+  {
+    delete[] p;
+  }
+}
+
+pool_stats MsgPool::getStats()
+{
+  pool_stats s;
+  s.allocs = allocs;
+  s.fallbacks = fallbacks;
+  s.exhausted = exhausted;
+  s.inUse = inUse;
+  s.highWater = highWater;
+  return s;
+}
+
+void MsgPool::printStats()
+{
+  pool_stats s = getStats();
+  Serial.printf("Msg pool: allocs=%lu; fallbacks=%lu; exhausted=%lu; inUse=%lu; highWater=%lu\n",
+                s.allocs, s.fallbacks, s.exhausted, s.inUse, s.highWater);
+}
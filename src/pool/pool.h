@@ -0,0 +1,46 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef POOL_POOL_H_
+#define POOL_POOL_H_
+
+#include <Arduino.h>
+
+#include "pre.h"
+
+struct pool_stats
+{
+  unsigned long allocs;    // Served from one of the pools
+  unsigned long fallbacks; // Served from the heap (too big for any block, or pool exhausted)
+  unsigned long exhausted; // Fallbacks caused by an empty pool
+  unsigned long inUse;     // Pool blocks currently taken
+  unsigned long highWater; // Most pool blocks ever taken at once
+};
+
+// Fixed-size message buffers, so receiving/sending doesn't fragment the heap
+class MsgPool
+{
+public:
+  static uint8_t *alloc(size_t len);
+  static void release(uint8_t *p);
+  static pool_stats getStats();
+  static void printStats();
+};
+
+#endif // POOL_POOL_H_
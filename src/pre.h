@@ -36,7 +36,7 @@
 #endif
 
 #ifndef PRINT_MSG_RECEIVE
-#define PRINT_MGG_RECEIVE false
+#define PRINT_MSG_RECEIVE false
 #endif
 
 #ifndef ESPNOW_CHANNEL
@@ -55,11 +55,6 @@
 #define DELAY_PREPARE_WIFI 333
 #endif
 
-// WARNING! Some delay is necessary (3ms min?; try 1 and 2 sometime)
-#ifndef DELAY_SEND
-#define DELAY_SEND 3
-#endif
-
 #ifndef MS_PURG_DEFAULT
 #define MS_PURG_DEFAULT 999
 #endif
@@ -76,6 +71,64 @@
 #define MS_TIME_SYNC 30000
 #endif
 
+// Shortest and longest time between time sync rounds with a peer; it starts at MS_TIME_SYNC and adapts
+#ifndef MS_TIME_SYNC_MIN
+#define MS_TIME_SYNC_MIN 5000
+#endif
+
+#ifndef MS_TIME_SYNC_MAX
+#define MS_TIME_SYNC_MAX 300000
+#endif
+
+// Rounds kept per peer to fit offset and drift over (see timeSync/timeSync.h)
+#ifndef TIME_SYNC_WINDOW
+#define TIME_SYNC_WINDOW 8
+#endif
+
+// Exchanges per peer each round; the one with the shortest round trip is used
+#ifndef TIME_SYNC_BURST
+#define TIME_SYNC_BURST 4
+#endif
+
+// Rounds landing further than this from the fit halve the interval; under half of it, double it
+#ifndef TIME_SYNC_TARGET_US
+#define TIME_SYNC_TARGET_US 200
+#endif
+
+// Further than this and the fit starts over
+#ifndef TIME_SYNC_RESET_US
+#define TIME_SYNC_RESET_US 100000
+#endif
+
+// Sync everyone off beacons the master broadcasts, instead of pairwise exchanges (see README)
+#ifndef TIME_SYNC_BROADCAST
+#define TIME_SYNC_BROADCAST false
+#endif
+
+#ifndef MS_TIME_SYNC_BEACON
+#define MS_TIME_SYNC_BEACON 10000
+#endif
+
+// Receivers report a beacon after a random delay up to this, so their broadcasts don't collide
+#ifndef MS_TIME_SYNC_REPORT_SPREAD
+#define MS_TIME_SYNC_REPORT_SPREAD 200
+#endif
+
+// From the master stamping a beacon to a receiver stamping it; offsets to the master are only as good as this
+#ifndef TIME_SYNC_BEACON_US
+#define TIME_SYNC_BEACON_US 0
+#endif
+
+// Beacons remembered, for matching late reports
+#ifndef TIME_SYNC_BEACONS
+#define TIME_SYNC_BEACONS 4
+#endif
+
+// Drift beyond this is ignored as bogus
+#ifndef TIME_SYNC_MAX_PPM
+#define TIME_SYNC_MAX_PPM 200
+#endif
+
 #ifndef MS_TIME_SYNC_SCHEDULE_START
 #define MS_TIME_SYNC_SCHEDULE_START 2000
 #endif
@@ -96,13 +149,284 @@
 #define SAFETY_CHECK_INBOX_OVERFLOW true
 #endif
 
+// Per-event lateness/duration/missed interval counters (see AF1Event::getStats())
+#ifndef EVENT_STATS
+#define EVENT_STATS false
+#endif
+
+// Histogram bucket i counts values below 2^i; the last one counts everything else
+#ifndef EVENT_STATS_BUCKETS
+#define EVENT_STATS_BUCKETS 16
+#endif
+
+// Block in update() until the next event/message instead of returning right away (see Base::idle())
+#ifndef TICKLESS_IDLE
+#define TICKLESS_IDLE false
+#endif
+
+// Longest idle; also bounds how late Serial input, NTP refresh and WS reconnects are seen
+#ifndef TICKLESS_MAX_MS
+#define TICKLESS_MAX_MS 100
+#endif
+
+// Longest idle while the websocket is connected (it has to be polled for data)
+#ifndef TICKLESS_WS_MS
+#define TICKLESS_WS_MS 10
+#endif
+
+// Bytes of captured state an event callback can hold (stored inline; see inlineFn/inlineFn.h)
+#ifndef EVENT_CB_SIZE
+#define EVENT_CB_SIZE 16
+#endif
+
 #ifndef WS_RECONNECT_MS
 #define WS_RECONNECT_MS 10000
 #endif
 
+// Preallocated message slots per box lane (rounded up to a power of 2)
+#ifndef INBOX_CAPACITY
+#define INBOX_CAPACITY 16
+#endif
+
+#ifndef INBOX_CAPACITY_HIGH
+#define INBOX_CAPACITY_HIGH 8
+#endif
+
+#ifndef INBOX_CAPACITY_LOW
+#define INBOX_CAPACITY_LOW 8
+#endif
+
+#ifndef OUTBOX_CAPACITY
+#define OUTBOX_CAPACITY 16
+#endif
+
+#ifndef OUTBOX_CAPACITY_HIGH
+#define OUTBOX_CAPACITY_HIGH 8
+#endif
+
+#ifndef OUTBOX_CAPACITY_LOW
+#define OUTBOX_CAPACITY_LOW 8
+#endif
+
+// What a full box does with a new message (see box/box.h)
+#ifndef INBOX_POLICY
+#define INBOX_POLICY BOX_DROP_NEWEST
+#endif
+
+#ifndef OUTBOX_POLICY
+#define OUTBOX_POLICY BOX_DROP_NEWEST
+#endif
+
+// Order lanes are drained in (see box/box.h)
+#ifndef INBOX_DRAIN
+#define INBOX_DRAIN BOX_DRAIN_STRICT
+#endif
+
+#ifndef OUTBOX_DRAIN
+#define OUTBOX_DRAIN BOX_DRAIN_STRICT
+#endif
+
+// Most messages/time handled per box per update() (0 is unlimited); the rest wait for the next update()
+#ifndef BOX_BUDGET_MSGS
+#define BOX_BUDGET_MSGS 16
+#endif
+
+#ifndef BOX_BUDGET_US
+#define BOX_BUDGET_US 5000
+#endif
+
+// Messages per turn under BOX_DRAIN_WEIGHTED
+#ifndef BOX_WEIGHT_HIGH
+#define BOX_WEIGHT_HIGH 4
+#endif
+
+#ifndef BOX_WEIGHT_NORMAL
+#define BOX_WEIGHT_NORMAL 2
+#endif
+
+#ifndef BOX_WEIGHT_LOW
+#define BOX_WEIGHT_LOW 1
+#endif
+
+// Start a worker task in Base::begin() for events/message types marked to run on it (see worker/worker.h)
+#ifndef WORKER
+#define WORKER false
+#endif
+
+// The Arduino loop runs on core 1
+#ifndef WORKER_CORE
+#define WORKER_CORE 0
+#endif
+
+#ifndef WORKER_STACK_SIZE
+#define WORKER_STACK_SIZE 4096
+#endif
+
+#ifndef WORKER_PRIORITY
+#define WORKER_PRIORITY 1
+#endif
+
+// Task slots each way (rounded up to a power of 2)
+#ifndef WORKER_QUEUE_SIZE
+#define WORKER_QUEUE_SIZE 8
+#endif
+
+// Bytes of captured state a worker task can hold; an event handed over takes its callback, ECBArg and name (~144 on 64-bit hosts)
+#ifndef WORKER_TASK_SIZE
+#define WORKER_TASK_SIZE 160
+#endif
+
+// Name buffer (terminator included) an event handed to the worker carries; events with longer names run on the loop
+#ifndef WORKER_EVENT_NAME_SIZE
+#define WORKER_EVENT_NAME_SIZE 32
+#endif
+
+// Message slots per lane of the worker's box
+#ifndef WORKER_BOX_CAPACITY
+#define WORKER_BOX_CAPACITY 8
+#endif
+
+#ifndef WORKER_POLICY
+#define WORKER_POLICY BOX_DROP_NEWEST
+#endif
+
+// Longest the worker sleeps without being posted to
+#ifndef WORKER_WAIT_MS
+#define WORKER_WAIT_MS 1000
+#endif
+
+// ESP-Now allows 20 unencrypted peers
+#ifndef MAX_PEERS
+#define MAX_PEERS 20
+#endif
+
+// Message buffer pools (see pool/pool.h); the small blocks fit one ESP-Now frame
+#ifndef POOL_SMALL_SIZE
+#define POOL_SMALL_SIZE 250
+#endif
+
+#ifndef POOL_SMALL_CNT
+#define POOL_SMALL_CNT 16
+#endif
+
+#ifndef POOL_LARGE_SIZE
+#define POOL_LARGE_SIZE 1024
+#endif
+
+#ifndef POOL_LARGE_CNT
+#define POOL_LARGE_CNT 4
+#endif
+
+// Send ESP-Now messages as JSON text instead of the binary wire format (receiving accepts both)
+#ifndef ESPNOW_WIRE_JSON
+#define ESPNOW_WIRE_JSON false
+#endif
+
+// ESP-Now frames sent to one peer before waiting on their send callbacks
+#ifndef ESPNOW_TX_WINDOW
+#define ESPNOW_TX_WINDOW 2
+#endif
+
+// Frames queued per peer, in flight included
+#ifndef ESPNOW_TX_QUEUE
+#define ESPNOW_TX_QUEUE 8
+#endif
+
+// Encoded frames for plain unicast, shared by all peers; reliable and broadcast frames have their own
+#ifndef ESPNOW_TX_FRAMES
+#define ESPNOW_TX_FRAMES 16
+#endif
+
+// Of those, kept for PRIORITY_HIGH messages (acks, handshakes, time sync)
+#ifndef ESPNOW_TX_FRAMES_RESERVE
+#define ESPNOW_TX_FRAMES_RESERVE 4
+#endif
+
+// Largest ESP-Now payload (ESP_NOW_MAX_DATA_LEN); every TX frame has this much storage of its own
+#define ESPNOW_FRAME_SIZE 250
+
+// Send completions waiting for the loop
+#ifndef ESPNOW_TX_DONE_SIZE
+#define ESPNOW_TX_DONE_SIZE 32
+#endif
+
+// A frame in flight this long without a send callback counts as failed
+#ifndef ESPNOW_TX_TIMEOUT_MS
+#define ESPNOW_TX_TIMEOUT_MS 100
+#endif
+
+// Send messages for all peers as one broadcast frame (binary wire format only)
+#ifndef ESPNOW_BROADCAST
+#define ESPNOW_BROADCAST true
+#endif
+
+// Broadcasts from devices in other groups are ignored (see Base::setGroup())
+#ifndef ESPNOW_GROUP
+#define ESPNOW_GROUP 0
+#endif
+
+// Broadcast frames kept for resending to peers that missed them
+#ifndef ESPNOW_BCAST_HISTORY
+#define ESPNOW_BCAST_HISTORY 4
+#endif
+
+// Quiet time after a broadcast before announcing its sequence number again
+#ifndef ESPNOW_BCAST_HEARTBEAT_MS
+#define ESPNOW_BCAST_HEARTBEAT_MS 100
+#endif
+
+// Least time between NACKs to one peer
+#ifndef ESPNOW_BCAST_NACK_MS
+#define ESPNOW_BCAST_NACK_MS 50
+#endif
+
+#ifndef RETRIES_BCAST_REPAIR
+#define RETRIES_BCAST_REPAIR 2
+#endif
+
+// Reliable messages (AF1Msg::setReliable()) sent to one peer and not yet acked; at most 33
+#ifndef RELIABLE_WINDOW
+#define RELIABLE_WINDOW 8
+#endif
+
+// First resend timeout; doubles with each resend
+#ifndef RELIABLE_RTO_MS
+#define RELIABLE_RTO_MS 60
+#endif
+
+#ifndef RELIABLE_RTO_MAX_MS
+#define RELIABLE_RTO_MAX_MS 1000
+#endif
+
+// Sends (the first one included) before giving up on a reliable message
+#ifndef RELIABLE_MAX_TRIES
+#define RELIABLE_MAX_TRIES 10
+#endif
+
+// How long received messages wait on a missing one before it's skipped; longer than the sender keeps trying
+#ifndef RELIABLE_HOLD_MS
+#define RELIABLE_HOLD_MS 10000
+#endif
+
+// Reliable messages waiting for room in a recipient's window; pushOutbox() refuses more
+#ifndef RELIABLE_WAITING
+#define RELIABLE_WAITING 8
+#endif
+
 #define AF1_MSG_SIZE 225
 #define AF1JsonDoc StaticJsonDocument<AF1_MSG_SIZE>
 
+#ifndef PEER_INDEX_SIZE
+#define PEER_INDEX_SIZE 64 // Power of 2, > MAX_PEERS
+#endif
+
+#define AF1_WIRE_MAGIC 0xA1
+#define AF1_WIRE_VERSION 1
+#define AF1_WIRE_HEADER_LEN 7
+#define AF1_WIRE_TX_STAMP_LEN 8
+#define AF1_WIRE_BROADCAST_LEN 3
+#define AF1_WIRE_RELIABLE_LEN 2
+
 #define STRINGIFY(s) STRINGIFY1(s)
 #define STRINGIFY1(s) #s
 
@@ -124,9 +448,15 @@
 #define SHKEY_SYNCTEST "synctest"
 #define SHKEY_HANDSHAKE "hs"
 #define SHKEY_DETACH "detach*"
+#define SHKEY_POOL "pool"
+#define SHKEY_BOX "box"
+#define SHKEY_EVENTS "events"
 
 #define EVENTKEY_CONFIG_AUTOPROCEED "Config_AutoProceed"
 #define EVENTKEY_ESP_HANDSHAKE "Global_ESPHandshake"
+#define EVENTKEY_TIME_SYNC "Global_TimeSync"
+#define EVENTKEY_TIME_SYNC_BEACON "Global_TimeSyncBeacon"
+#define EVENTKEY_TIME_SYNC_REPORT "Global_TimeSyncReport"
 #define EVENTKEY_SYNC_START_TIME "Global_SendSyncStartTime"
 #define EVENTKEY_SCHEDULE_SYNC_START "Sync_ScheduleSyncStart"
 #define EVENTKEY_SYNC_START "Base_SyncStart"
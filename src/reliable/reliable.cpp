@@ -0,0 +1,336 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "reliable.h"
+#include "pool/pool.h"
+
+static reliable_stats stats;
+static int unacked; // Across all peers
+
+ReliableRx::ReliableRx()
+{
+  memset(slots, 0, sizeof(slots));
+  reset();
+}
+
+void ReliableRx::release(reliable_held &s)
+{
+  MsgPool::release(s.data);
+  s.data = NULL;
+}
+
+void ReliableRx::reset()
+{
+  for (int i = 0; i < RELIABLE_WINDOW; i++)
+  {
+    release(slots[i]);
+  }
+  expected = 0;
+  ackDue = false;
+  holdSinceUs = 0;
+  resyncing = false;
+}
+
+// Gives up on everything before seq
+void ReliableRx::skipTo(uint16_t seq)
+{
+  while (expected != seq)
+  {
+    reliable_held &s = slots[expected % RELIABLE_WINDOW];
+    if (s.data != NULL && s.seq == expected)
+    {
+      break; // Held; next() hands it over
+    }
+    expected++;
+    stats.skipped++;
+  }
+}
+
+reliable_result ReliableRx::receive(uint16_t seq, time_us now)
+{
+  ackDue = true;
+  int16_t d = seq - expected;
+  // Further ahead than the sender's window allows: it gave up on what we're waiting for
+  if (d >= RELIABLE_WINDOW)
+  {
+    resyncTo = seq - RELIABLE_WINDOW + 1;
+    resyncing = true;
+    return RELIABLE_RESYNC;
+  }
+  if (d < 0)
+  {
+    stats.duplicates++;
+    return RELIABLE_DUP;
+  }
+  if (d == 0)
+  {
+    expected++;
+    stats.delivered++;
+    return RELIABLE_DELIVER;
+  }
+  reliable_held &s = slots[seq % RELIABLE_WINDOW];
+  if (s.data != NULL && s.seq == seq)
+  {
+    stats.duplicates++;
+    return RELIABLE_DUP;
+  }
+  if (!holdSinceUs)
+  {
+    holdSinceUs = now;
+  }
+  return RELIABLE_HOLD;
+}
+
+void ReliableRx::hold(uint16_t seq, const uint8_t *data, size_t len, time_us rxUs, time_us txUs)
+{
+  reliable_held &s = slots[seq % RELIABLE_WINDOW];
+  release(s);
+  s.data = MsgPool::alloc(len);
+  memcpy(s.data, data, len);
+  s.len = len;
+  s.seq = seq;
+  s.rxUs = rxUs;
+  s.txUs = txUs;
+  stats.held++;
+}
+
+bool ReliableRx::next(reliable_held &h, time_us now)
+{
+  if (resyncing)
+  {
+    skipTo(resyncTo); // Stops at a held frame
+    resyncing = expected != resyncTo;
+  }
+  reliable_held &s = slots[expected % RELIABLE_WINDOW];
+  if (s.data == NULL || s.seq != expected)
+  {
+    return false;
+  }
+  h = s;
+  s.data = NULL; // The taker's now
+  expected++;
+  stats.delivered++;
+  // Still held up by another gap? Its wait starts now
+  holdSinceUs = 0;
+  for (int i = 0; i < RELIABLE_WINDOW; i++)
+  {
+    if (slots[i].data != NULL)
+    {
+      holdSinceUs = now;
+      break;
+    }
+  }
+  return true;
+}
+
+void ReliableRx::expire(time_us now)
+{
+  if (!holdSinceUs || now - holdSinceUs < (time_us)RELIABLE_HOLD_MS * 1000)
+  {
+    return;
+  }
+  // Up to the first held frame
+  for (uint16_t i = 1; i < RELIABLE_WINDOW; i++)
+  {
+    reliable_held &s = slots[(uint16_t)(expected + i) % RELIABLE_WINDOW];
+    if (s.data != NULL && s.seq == (uint16_t)(expected + i))
+    {
+      skipTo(s.seq);
+      break;
+    }
+  }
+  holdSinceUs = 0;
+  ackDue = true; // So the sender stops resending what we skipped
+}
+
+time_us ReliableRx::getExpiryUs()
+{
+  return holdSinceUs ? holdSinceUs + (time_us)RELIABLE_HOLD_MS * 1000 : 0;
+}
+
+bool ReliableRx::takeAck(uint16_t &n, uint32_t &held)
+{
+  if (!ackDue)
+  {
+    return false;
+  }
+  ackDue = false;
+  n = expected;
+  held = 0;
+  for (uint16_t i = 1; i < RELIABLE_WINDOW; i++)
+  {
+    uint16_t seq = expected + i;
+    reliable_held &s = slots[seq % RELIABLE_WINDOW];
+    if (s.data != NULL && s.seq == seq)
+    {
+      held |= 1UL << (i - 1);
+    }
+  }
+  return true;
+}
+
+ReliableTx::ReliableTx()
+{
+  memset(entries, 0, sizeof(entries));
+  base = 0;
+  nextSeq = 0;
+}
+
+void ReliableTx::finish(reliable_entry &e)
+{
+  TxQueue::releaseFrame(e.frame);
+  e.frame = NULL;
+  unacked--;
+}
+
+// Past the acked and given up ones at the front
+void ReliableTx::advance()
+{
+  while (base != nextSeq && entries[base % RELIABLE_WINDOW].frame == NULL)
+  {
+    base++;
+  }
+}
+
+void ReliableTx::reset()
+{
+  for (int i = 0; i < RELIABLE_WINDOW; i++)
+  {
+    if (entries[i].frame != NULL)
+    {
+      finish(entries[i]);
+    }
+  }
+  base = 0;
+  nextSeq = 0;
+}
+
+bool ReliableTx::isFull()
+{
+  return (uint16_t)(nextSeq - base) >= RELIABLE_WINDOW;
+}
+
+uint16_t ReliableTx::getNextSeq()
+{
+  return nextSeq;
+}
+
+void ReliableTx::add(tx_frame *f, time_us now)
+{
+  reliable_entry &e = entries[nextSeq % RELIABLE_WINDOW];
+  f->refs++;
+  e.frame = f;
+  e.tries = 1;
+  e.rtoMs = RELIABLE_RTO_MS;
+  e.sentUs = now;
+  nextSeq++;
+  unacked++;
+  stats.sent++;
+}
+
+void ReliableTx::ack(uint16_t n, uint32_t held)
+{
+  // Everything before n, and the held ones after it
+  if ((uint16_t)(n - base) > (uint16_t)(nextSeq - base))
+  {
+    return; // Stale, or not ours
+  }
+  for (; base != n; base++)
+  {
+    reliable_entry &e = entries[base % RELIABLE_WINDOW];
+    if (e.frame != NULL)
+    {
+      finish(e);
+      stats.acked++;
+    }
+  }
+  for (uint16_t i = 1; i < RELIABLE_WINDOW && (uint16_t)(n + i - base) < (uint16_t)(nextSeq - base); i++)
+  {
+    if (held & (1UL << (i - 1)))
+    {
+      reliable_entry &e = entries[(uint16_t)(n + i) % RELIABLE_WINDOW];
+      if (e.frame != NULL)
+      {
+        finish(e);
+        stats.acked++;
+      }
+    }
+  }
+  advance();
+}
+
+tx_frame *ReliableTx::takeDue(time_us now)
+{
+  for (uint16_t seq = base; seq != nextSeq; seq++)
+  {
+    reliable_entry &e = entries[seq % RELIABLE_WINDOW];
+    if (e.frame == NULL || now - e.sentUs < (time_us)e.rtoMs * 1000)
+    {
+      continue;
+    }
+    if (e.tries >= RELIABLE_MAX_TRIES)
+    {
+      finish(e); // The receiver skips it after RELIABLE_HOLD_MS
+      stats.failed++;
+      continue;
+    }
+    e.tries++;
+    e.rtoMs = e.rtoMs * 2 < RELIABLE_RTO_MAX_MS ? e.rtoMs * 2 : RELIABLE_RTO_MAX_MS;
+    e.sentUs = now;
+    stats.retransmits++;
+    return e.frame;
+  }
+  advance();
+  return NULL;
+}
+
+time_us ReliableTx::getDueUs()
+{
+  time_us due = 0;
+  for (uint16_t seq = base; seq != nextSeq; seq++)
+  {
+    reliable_entry &e = entries[seq % RELIABLE_WINDOW];
+    time_us t = e.sentUs + (time_us)e.rtoMs * 1000;
+    if (e.frame != NULL && (!due || t < due))
+    {
+      due = t;
+    }
+  }
+  return due;
+}
+
+bool ReliableTx::hasUnacked()
+{
+  return unacked > 0;
+}
+
+reliable_stats ReliableTx::getStats()
+{
+  return stats;
+}
+
+void ReliableTx::noteWaited()
+{
+  stats.waited++;
+}
+
+void ReliableTx::noteDropped()
+{
+  stats.dropped++;
+}
@@ -0,0 +1,131 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef RELIABLE_RELIABLE_H_
+#define RELIABLE_RELIABLE_H_
+
+#include <Arduino.h>
+
+#include "clock/clock.h"
+#include "txQueue/txQueue.h"
+#include "pre.h"
+
+enum reliable_result
+{
+  RELIABLE_DELIVER, // Next in order; handle it now
+  RELIABLE_HOLD,    // Ahead of a gap; hold() it until the gap is filled
+  RELIABLE_DUP,     // Already had it
+  RELIABLE_RESYNC,  // Too far ahead; take what's held with next(), then receive() it again
+};
+
+// A frame received ahead of a gap, in its encoded form
+struct reliable_held
+{
+  uint8_t *data; // From MsgPool; the taker releases it
+  uint16_t len;
+  uint16_t seq;
+  time_us rxUs;
+  time_us txUs;
+};
+
+struct reliable_entry
+{
+  tx_frame *frame; // NULL once acked or given up on
+  uint8_t tries;
+  uint16_t rtoMs;
+  time_us sentUs;
+};
+
+struct reliable_stats
+{
+  unsigned long sent;
+  unsigned long retransmits;
+  unsigned long acked;
+  unsigned long failed;     // Out of tries (RELIABLE_MAX_TRIES)
+  unsigned long waited;     // Messages that waited for room in a recipient's window
+  unsigned long dropped;    // Not sent; RELIABLE_WAITING messages were already waiting
+  unsigned long delivered;
+  unsigned long held;       // Arrived ahead of a gap
+  unsigned long duplicates;
+  unsigned long skipped;    // Given up on by the receiver (RELIABLE_HOLD_MS), or lost to a resync
+};
+
+/*
+  Receive side of one peer's reliable channel. Sequence numbers are per peer and direction; frames
+  are handed over once each, in order. Frames ahead of a gap are held (up to RELIABLE_WINDOW) until
+  it's filled, or for RELIABLE_HOLD_MS, after which the gap is skipped. Every frame is acked with the
+  next sequence number expected plus a bitmap of the ones held after it. Anything behind is a duplicate,
+  so reset() when the sender restarts (its handshake). A frame further ahead than the sender's window
+  means it gave up on the gap; the frames held before the new window are still handed over, in order.
+  Loop task only.
+*/
+class ReliableRx
+{
+  reliable_held slots[RELIABLE_WINDOW]; // By seq % RELIABLE_WINDOW
+  uint16_t expected;
+  bool ackDue;
+  time_us holdSinceUs; // When the oldest gap started holding frames up; 0 if none
+  uint16_t resyncTo;   // next() skips gaps up to here while resyncing
+  bool resyncing;
+
+  void release(reliable_held &s);
+  void skipTo(uint16_t seq);
+
+public:
+  ReliableRx();
+  void reset();
+  reliable_result receive(uint16_t seq, time_us now);
+  void hold(uint16_t seq, const uint8_t *data, size_t len, time_us rxUs, time_us txUs);
+  bool next(reliable_held &h, time_us now); // The next held frame, if it's now in order
+  void expire(time_us now);    // Skips the gap if it held frames up for too long
+  time_us getExpiryUs();       // When expire() would skip it; 0 if nothing is held
+  bool takeAck(uint16_t &next, uint32_t &held); // False if nothing arrived since the last ack
+};
+
+/*
+  Send side of one peer's reliable channel: up to RELIABLE_WINDOW frames unacked, each resent when
+  its timer runs out. The timer starts at RELIABLE_RTO_MS and doubles with each resend, up to
+  RELIABLE_RTO_MAX_MS. Loop task only.
+*/
+class ReliableTx
+{
+  reliable_entry entries[RELIABLE_WINDOW]; // By seq % RELIABLE_WINDOW
+  uint16_t base;                           // Oldest unacked
+  uint16_t nextSeq;
+
+  void finish(reliable_entry &e);
+  void advance();
+
+public:
+  ReliableTx();
+  void reset();
+  bool isFull();
+  uint16_t getNextSeq();
+  void add(tx_frame *f, time_us now); // Takes a reference to f, sent with getNextSeq(); the sequence moves on
+  void ack(uint16_t next, uint32_t held);
+  tx_frame *takeDue(time_us now); // A frame to resend, or NULL; call until NULL
+  time_us getDueUs();              // When the next resend is due; 0 if nothing is unacked
+
+  static bool hasUnacked(); // Any peer
+  static reliable_stats getStats();
+  static void noteWaited();
+  static void noteDropped();
+};
+
+#endif // RELIABLE_RELIABLE_H_
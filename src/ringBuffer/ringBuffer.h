@@ -0,0 +1,229 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+  http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+*/
+
+#ifndef RING_BUFFER_H_
+#define RING_BUFFER_H_
+
+#include <atomic>
+#include <new>
+#include <utility>
+#include <stddef.h>
+#include <stdint.h>
+
+// A bounded lock-free queue (multi-producer, multi-consumer); slots are allocated once up front
+template <class T>
+class RingBuffer
+{
+  struct Cell
+  {
+    std::atomic<size_t> seq;
+    std::atomic<bool> busy; // Held while the element is read or replaced in place
+    alignas(T) unsigned char data[sizeof(T)];
+  };
+
+  Cell *buf;
+  size_t mask;
+  std::atomic<size_t> enqueuePos;
+  std::atomic<size_t> dequeuePos;
+
+  RingBuffer(const RingBuffer &) = delete;
+  RingBuffer &operator=(const RingBuffer &) = delete;
+
+  static size_t roundUp(size_t n)
+  {
+    size_t c = 2;
+    while (c < n)
+    {
+      c <<= 1;
+    }
+    return c;
+  }
+
+  template <class U>
+  bool push(U &&t)
+  {
+    Cell *cell;
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    while (true)
+    {
+      cell = &buf[pos & mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+      if (dif == 0)
+      {
+        if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (dif < 0)
+      {
+        return false; // Full
+      }
+      else
+      {
+        pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    new (cell->data) T(std::forward<U>(t));
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+public:
+  // Capacity is rounded up to a power of 2
+  RingBuffer(size_t capacity)
+      : buf(NULL), mask(roundUp(capacity) - 1), enqueuePos(0), dequeuePos(0)
+  {
+    buf = new Cell[mask + 1];
+    for (size_t i = 0; i <= mask; i++)
+    {
+      buf[i].seq.store(i, std::memory_order_relaxed);
+      buf[i].busy.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  ~RingBuffer()
+  {
+    while (consume([](T &) {}))
+      ;
+    delete[] buf;
+  }
+
+  // Add an element to the queue; false if full
+  bool enqueue(const T &t)
+  {
+    return push(t);
+  }
+
+  bool enqueue(T &&t)
+  {
+    return push(std::move(t));
+  }
+
+  // Call f on the front element in place, then remove it; false if empty
+  template <class F>
+  bool consume(F f)
+  {
+    Cell *cell;
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    while (true)
+    {
+      cell = &buf[pos & mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (dif == 0)
+      {
+        if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        {
+          break;
+        }
+      }
+      else if (dif < 0)
+      {
+        return false; // Empty
+      }
+      else
+      {
+        pos = dequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+    // A replaceIf() in progress on this cell finishes first
+    while (cell->busy.exchange(true, std::memory_order_acquire))
+      ;
+    T *p = reinterpret_cast<T *>(cell->data);
+    f(*p);
+    p->~T();
+    cell->seq.store(pos + mask + 1, std::memory_order_release);
+    cell->busy.store(false, std::memory_order_release);
+    return true;
+  }
+
+  /*
+    Overwrite the first queued element matching pred with t; false if none matched.
+    Cells being consumed are skipped rather than waited on, so producers never block.
+  */
+  template <class P, class U>
+  bool replaceIf(P pred, U &&t)
+  {
+    // Dequeue position first, so it can't pass the end
+    size_t pos = dequeuePos.load(std::memory_order_acquire);
+    size_t end = enqueuePos.load(std::memory_order_acquire);
+    for (; pos != end; pos++)
+    {
+      Cell *cell = &buf[pos & mask];
+      if (cell->seq.load(std::memory_order_acquire) != pos + 1)
+      {
+        continue; // Not yet written, or already consumed
+      }
+      if (cell->busy.exchange(true, std::memory_order_acquire))
+      {
+        continue;
+      }
+      bool replaced = false;
+      // Re-check now that no consumer can take it
+      if (cell->seq.load(std::memory_order_acquire) == pos + 1)
+      {
+        T *p = reinterpret_cast<T *>(cell->data);
+        if (pred(*p))
+        {
+          *p = std::forward<U>(t);
+          replaced = true;
+        }
+      }
+      cell->busy.store(false, std::memory_order_release);
+      if (replaced)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Move the front element into t; false if empty
+  bool tryDequeue(T &t)
+  {
+    return consume([&t](T &front)
+                   { t = std::move(front); });
+  }
+
+  // Approximate while producers/consumers are active
+  int size()
+  {
+    size_t e = enqueuePos.load(std::memory_order_relaxed);
+    size_t d = dequeuePos.load(std::memory_order_relaxed);
+    return e > d ? e - d : 0;
+  }
+
+  bool empty()
+  {
+    return !size();
+  }
+
+  size_t capacity()
+  {
+    return mask + 1;
+  }
+};
+
+#endif // RING_BUFFER_H_
@@ -25,7 +25,7 @@
 Init::Init()
 {
   addEvent(AF1Event(
-      EVENTKEY_ESP_HANDSHAKE, [](ECBArg a)
+      EVENTKEY_ESP_HANDSHAKE, [](const ECBArg &a)
       {
     if (getCurStateEnt()->doScanForPeersESPNow())
     {
@@ -37,17 +37,32 @@ Init::Init()
     } },
       EVENT_TYPE_GLOBAL, MS_HANDSHAKE_LOOP, 0, 0, START_DEVICE_MS));
 
+#if TIME_SYNC_BROADCAST
   if (getIsMaster())
   {
     addEvent(AF1Event(
-        EVENTKEY_SYNC_START_TIME, [](ECBArg a)
+        EVENTKEY_TIME_SYNC_BEACON, [](const ECBArg &a)
+        { sendTimeSyncBeacon(); },
+        EVENT_TYPE_GLOBAL, MS_TIME_SYNC_BEACON, 0, 0, START_DEVICE_MS));
+  }
+#else
+  addEvent(AF1Event(
+      EVENTKEY_TIME_SYNC, [](const ECBArg &a)
+      { sendAllTimeSyncMessages(); },
+      EVENT_TYPE_GLOBAL, MS_TIME_SYNC_MIN, 0, 0, START_DEVICE_MS));
+#endif
+
+  if (getIsMaster())
+  {
+    addEvent(AF1Event(
+        EVENTKEY_SYNC_START_TIME, [](const ECBArg &a)
         {
     if (getCurStateEnt()->doSync())
     {
-      syncStartTime = millis() + (unsigned long)MS_TIME_SYNC_START;
+      syncStartTime = AF1Clock::now() + MS_TIME_SYNC_START * 1000ULL;
       AF1Msg msg(TYPE_TIME_SYNC_START);
-      msg.json()["timeSyncStart"] = syncStartTime;
-      pushOutbox(msg);
+      msg.json()["timeSyncStartUs"] = syncStartTime;
+      pushOutbox(std::move(msg));
       Serial.println("Scheduling sync start");
       scheduleSyncStart();
     } },
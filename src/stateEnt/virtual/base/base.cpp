@@ -25,6 +25,7 @@
 #include "stateEnt/init/init.h"
 #include "stateEnt/purg/purg.h"
 #include "stateEnt/synctest/syncTest.h"
+#include "pool/pool.h"
 
 static int curState;
 static int prevState;
@@ -35,45 +36,63 @@ static Base *stateEnt;
 static std::map<int, Base *> stateEntMap;
 
 static std::map<String, string_input_handler> stringHandlerMap;
+static type_msg_handler msgHandlers[256];
+static bool workerTypes[256];
+static EventScheduler eventScheduler;
+static event_handle nextEventHandle = EVENT_NONE + 1;
 static std::vector<wifi_ap_info> wifiAPs;
 
 static ws_client_info curWSClientInfo;
 static ws_client_info defaultWSClientInfo;
 
-std::map<String, af1_peer_info> Base::peerInfoMap;
-std::map<String, String> Base::macToIDMap;
+PeerRegistry Base::peers;
 
 WiFiUDP Base::ntpUDP;
 NTPClient Base::timeClient(ntpUDP);
 
-unsigned long startMs;
+static time_us startUs; // When the current state started
 
-static Box inbox;
-static Box outbox;
+static const size_t inboxCapacity[PRIORITY_CNT] = {INBOX_CAPACITY_HIGH, INBOX_CAPACITY, INBOX_CAPACITY_LOW};
+static const size_t outboxCapacity[PRIORITY_CNT] = {OUTBOX_CAPACITY_HIGH, OUTBOX_CAPACITY, OUTBOX_CAPACITY_LOW};
+static Box inbox(inboxCapacity, INBOX_POLICY, INBOX_DRAIN);
+static Box outbox(outboxCapacity, OUTBOX_POLICY, OUTBOX_DRAIN);
 
 static HTTPClient httpClient;
 static WiFiMulti wifiMulti;
 
 static bool isMaster;
+static uint8_t group = ESPNOW_GROUP;
 
-unsigned long Base::syncStartTime;
+time_us Base::syncStartTime;
 
 uint8_t Base::macAP[6];
 uint8_t Base::macSTA[6];
 
 WebSocketsClient Base::webSocketClient;
 
-std::map<String, AF1Event> Base::globalEventMap;
+event_map Base::globalEventMap;
+std::map<String, event_handle> Base::globalEventNames;
 
 static bool detached;
 
 #define MAX_PACKET_ID 5 // Can't store many unacked
 
+static RingBuffer<tx_done> txDone(ESPNOW_TX_DONE_SIZE);
+static uint8_t txDoneTags[MAX_PEERS]; // Completions per peer; WiFi task only
+
+static time_sync_beacon beacons[TIME_SYNC_BEACONS];
+static const uint8_t broadcastMac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+static AF1Msg reliableWaiting[RELIABLE_WAITING]; // For room in a recipient's window, oldest first
+static uint8_t waitingHead;
+static std::atomic<uint8_t> waitingCnt; // Read by pushOutbox() on any task
+
 static uint8_t nextPacketId;
 static std::map<uint8_t, AF1Msg> unackedPackets;
 
 Base::Base()
 {
+  stateMsgHandlers = NULL;
 }
 
 void Base::begin(String id)
@@ -100,6 +119,110 @@ void Base::begin(String id)
                    { handleHandshakes(true); });
   addStringHandler(SHKEY_DETACH, [](SHArg a)
                    { detach(a.getValue().toInt()); });
+  addStringHandler(SHKEY_POOL, [](SHArg a)
+                   { MsgPool::printStats(); });
+  addStringHandler(SHKEY_BOX, [](SHArg a)
+                   { printBoxStats(); });
+#if EVENT_STATS
+  addStringHandler(SHKEY_EVENTS, [](SHArg a)
+                   { printEventStats(); });
+#endif
+
+  addMsgHandler(TYPE_CHANGE_STATE, [](AF1Msg &m, const msg_header &h)
+                {
+                  Serial.println("State change request message in inbox");
+                  if (detached)
+                  {
+                    Serial.println("Detached; ignoring state change request message");
+                  }
+                  else
+                  {
+                    requestedState = h.state;
+                  } });
+  addMsgHandler(TYPE_HANDSHAKE_REQUEST, [](AF1Msg &m, const msg_header &h)
+                {
+                  Serial.println("Handshake request message in inbox");
+                  receiveHandshakeRequest(m);
+                  sendHandshakeResponses({m.getSender()}); });
+  addMsgHandler(TYPE_HANDSHAKE_RESPONSE, [](AF1Msg &m, const msg_header &h)
+                {
+                  Serial.println("Handshake response message in inbox");
+                  receiveHandshakeResponse(m);
+#if !TIME_SYNC_BROADCAST
+                  startTimeSync({h.sender});
+#endif
+                });
+  addMsgHandler(TYPE_TIME_SYNC, [](AF1Msg &m, const msg_header &h)
+                {
+                  Serial.println("Time sync message in inbox");
+                  receiveTimeSyncMsg(m); });
+  addMsgHandler(TYPE_TIME_SYNC_RESPONSE, [](AF1Msg &m, const msg_header &h)
+                {
+                  Serial.println("Time sync response message in inbox");
+                  receiveTimeSyncMsg(m); });
+  addMsgHandler(TYPE_TIME_SYNC_BEACON, [](AF1Msg &m, const msg_header &h)
+                { receiveTimeSyncBeacon(m); });
+  addMsgHandler(TYPE_TIME_SYNC_REPORT, [](AF1Msg &m, const msg_header &h)
+                { receiveTimeSyncReport(m); });
+  addMsgHandler(TYPE_BROADCAST_NACK, [](AF1Msg &m, const msg_header &h)
+                { receiveBroadcastNack(m); });
+  addMsgHandler(TYPE_RELIABLE_ACK, [](AF1Msg &m, const msg_header &h)
+                {
+                  if (peers.has(h.sender))
+                  {
+                    peers[h.sender].reliableTx.ack(m.readJson()["next"], m.readJson()["held"]);
+                  } });
+  addMsgHandler(TYPE_TIME_SYNC_START, [](AF1Msg &m, const msg_header &h)
+                {
+                  time_us t = m.readJson()["timeSyncStartUs"].as<time_us>();
+                  syncStartTime = convertTime(h.sender, t);
+                  Serial.printf("Received time: %llu us; Converted time: %llu us\n",
+                                (unsigned long long)t, (unsigned long long)syncStartTime);
+                  scheduleSyncStart(); });
+  // MQTT acks
+  addMsgHandler(TYPE_MQTT_PUBLISH, [](AF1Msg &m, const msg_header &h)
+                {
+                  uint8_t q = m.readJson()["qos"];
+                  if (q == 1)
+                  {
+                    int p = m.readJson()["packetId"];
+                    AF1Msg res(TYPE_MQTT_PUBACK);
+                    res.json()["packetId"] = p;
+                    pushOutbox(std::move(res));
+                  }
+                  else if (q == 2)
+                  {
+                    int p = m.readJson()["packetId"];
+                    AF1Msg res(TYPE_MQTT_PUBREC);
+                    res.json()["packetId"] = p;
+                    pushOutbox(std::move(res));
+                  } });
+  addMsgHandler(TYPE_MQTT_PUBACK, [](AF1Msg &m, const msg_header &h)
+                {
+                  uint8_t p = m.readJson()["packetId"];
+                  unackedPackets.erase(p); });
+  addMsgHandler(TYPE_MQTT_PUBCOMP, [](AF1Msg &m, const msg_header &h)
+                {
+                  uint8_t p = m.readJson()["packetId"];
+                  unackedPackets.erase(p); });
+  addMsgHandler(TYPE_MQTT_PUBREC, [](AF1Msg &m, const msg_header &h)
+                {
+                  uint8_t p = m.readJson()["packetId"];
+                  unackedPackets[p] = m;
+                  AF1Msg res(TYPE_MQTT_PUBREL);
+                  res.json()["packetId"] = p;
+                  pushOutbox(std::move(res)); });
+  addMsgHandler(TYPE_MQTT_PUBREL, [](AF1Msg &m, const msg_header &h)
+                {
+                  int p = m.readJson()["packetId"];
+                  AF1Msg res(TYPE_MQTT_PUBCOMP);
+                  res.json()["packetId"] = p;
+                  pushOutbox(std::move(res)); });
+
+  Worker::setMsgHandler(handleWorkerMsg);
+#if WORKER
+  Worker::begin();
+#endif
 
   initialState = STATE_IDLE_BASE;
   defaultWSClientInfo = {"", "", 0, ""};
@@ -124,6 +247,9 @@ void Base::update()
 
   inbox.handleMessages();
   outbox.handleMessages();
+  serviceReliable();
+  handleESPNowSent();
+  Worker::handleLoopTasks();
 
   // Handling user input
   if (Serial.available() > 0)
@@ -132,16 +258,8 @@ void Base::update()
     handleUserInput(s);
   }
 
-  // State Events
-  for (std::map<String, AF1Event>::iterator it = stateEnt->eventMap.begin(); it != stateEnt->eventMap.end(); it++)
-  {
-    stateEnt->eventMap[it->first].cbIfTimeAndActive();
-  }
-  // Global Events
-  for (std::map<String, AF1Event>::iterator it = globalEventMap.begin(); it != globalEventMap.end(); it++)
-  {
-    globalEventMap[it->first].cbIfTimeAndActive();
-  }
+  // State and global events
+  eventScheduler.run(AF1Clock::now());
 
   webSocketClient.loop();
 
@@ -160,6 +278,62 @@ void Base::update()
     handleStateChange(requestedState);
     Serial.println("State change complete");
   }
+#if TICKLESS_IDLE
+  else
+  {
+    idle();
+  }
+#endif
+}
+
+// The sooner of two deadlines; 0 is none
+static time_us earliest(time_us a, time_us b)
+{
+  return !a || (b && b < a) ? b : a;
+}
+
+// Wait for the earliest of: next event, a message pushed to either box, or the polling caps
+void Base::idle()
+{
+  if (!stateEnt->doIdle())
+  {
+    return;
+  }
+  long ms = getMsToNextEvent();
+  if (ms < 0 || ms > TICKLESS_MAX_MS)
+  {
+    ms = TICKLESS_MAX_MS;
+  }
+  if (webSocketClient.isConnected() && ms > TICKLESS_WS_MS)
+  {
+    ms = TICKLESS_WS_MS;
+  }
+  // ESP-Now timers: sends awaiting callbacks, reliable resends and holds, the broadcast heartbeat
+  time_us due = BroadcastTx::getHeartbeatUs();
+  bool pump = false; // Frames the window has room for
+  for (peer_handle h = 0; h < peers.size(); h++)
+  {
+    pump = pump || peers[h].txQueue.next() != NULL;
+    due = earliest(due, peers[h].txQueue.getExpiryUs());
+    due = earliest(due, peers[h].reliableTx.getDueUs());
+    due = earliest(due, peers[h].reliableRx.getExpiryUs());
+  }
+  if (due)
+  {
+    time_us now = AF1Clock::now();
+    long dueMs = due > now ? (due - now + 999) / 1000 : 0;
+    if (dueMs < ms)
+    {
+      ms = dueMs;
+    }
+  }
+  // Send completions are queued before their notify(); one queued since handleESPNowSent() may have been cleared here
+  Box::prepareWait();
+  if (ms == 0 || pump || !txDone.empty() || inbox.size() || outbox.size() || Worker::hasLoopTasks() || Serial.available() > 0)
+  {
+    return;
+  }
+  Box::wait(ms);
 }
 
 void Base::setup()
@@ -167,7 +341,7 @@ void Base::setup()
   Serial.println("Base::setup()");
   resetEvents();
   activateEvents();
-  startMs = millis();
+  startUs = AF1Clock::now();
   connectToWifi();
   connectToWS();
 }
@@ -193,126 +367,74 @@ void Base::preStateChange(int s)
 
 unsigned long Base::getElapsedMs()
 {
-  unsigned long nowMs = millis();
-  return nowMs - startMs;
+  return AF1Clock::toMs(getElapsedUs());
+}
+
+time_us Base::getElapsedUs()
+{
+  return AF1Clock::now() - startUs;
 }
 
 void Base::handleInboxMsg(AF1Msg &m)
 {
   Serial.print("<");
 
-#if PRINT_MSG_RECV
+#if PRINT_MSG_RECEIVE
   Serial.print("Handling inbox msg: ");
   m.print();
 #endif
 
-  switch (m.getType())
-  {
-  case TYPE_CHANGE_STATE:
-  {
-    Serial.println("State change request message in inbox");
-    if (detached)
-    {
-      Serial.println("Detached; ignoring state change request message");
-    }
-    else
-    {
-      requestedState = m.getState();
-    }
-  }
-  break;
-  case TYPE_HANDSHAKE_REQUEST:
-  {
-    Serial.println("Handshake request message in inbox");
-    receiveHandshakeRequest(m);
-    sendHandshakeResponses({m.getSenderId()});
-  }
-  break;
-  case TYPE_HANDSHAKE_RESPONSE:
-  {
-    Serial.println("Handshake response message in inbox");
-    receiveHandshakeResponse(m);
-    sendTimeSyncMsg({m.getSenderId()});
-  }
-  break;
-  case TYPE_TIME_SYNC:
+  if (m.isBroadcast() && !receiveBroadcast(m))
   {
-    Serial.println("Time sync message in inbox");
-    receiveTimeSyncMsg(m);
+    return;
   }
-  break;
-  case TYPE_TIME_SYNC_RESPONSE:
+  if (m.isReliable())
   {
-    Serial.println("Time sync response message in inbox");
-    receiveTimeSyncMsg(m);
+    receiveReliable(m); // Dispatched from there, in order
+    return;
   }
-  break;
-  case TYPE_TIME_SYNC_START:
+  dispatchInboxMsg(m);
+}
+
+void Base::dispatchInboxMsg(AF1Msg &m)
+{
+  msg_header h = m.getHeader();
+  if (workerTypes[h.type] && Worker::isRunning())
   {
-    Serial.print("Received time: ");
-    unsigned long t = m.json()["timeSyncStart"];
-    Serial.println(t);
-    syncStartTime = convertTime(m.getSenderId(), t);
-    Serial.print("Converted time: ");
-    Serial.println(syncStartTime);
-    scheduleSyncStart();
+    Worker::pushMsg(std::move(m)); // Counted by the worker's box stats if dropped
   }
-  break;
-  case TYPE_MQTT_PUBLISH:
+  else
   {
-    // Acks
-    uint8_t q = m.json()["qos"];
-    if (q == 1)
+    if (msgHandlers[h.type] != NULL)
     {
-      int p = m.json()["packetId"];
-      AF1Msg res(TYPE_MQTT_PUBACK);
-      res.json()["packetId"] = p;
-      pushOutbox(res);
+      msgHandlers[h.type](m, h);
     }
-    else if (q == 2)
+    if (stateEnt != NULL && stateEnt->stateMsgHandlers != NULL && stateEnt->stateMsgHandlers[h.type] != NULL)
     {
-      int p = m.json()["packetId"];
-      AF1Msg res(TYPE_MQTT_PUBREC);
-      res.json()["packetId"] = p;
-      pushOutbox(res);
+      stateEnt->stateMsgHandlers[h.type](m, h);
     }
   }
-  break;
-  case TYPE_MQTT_PUBACK:
-  case TYPE_MQTT_PUBCOMP:
-  {
-    uint8_t p = m.json()["packetId"];
-    unackedPackets.erase(p);
-  }
-  break;
-  case TYPE_MQTT_PUBREC:
-  {
-    uint8_t p = m.json()["packetId"];
-    unackedPackets[p] = m;
-    AF1Msg res(TYPE_MQTT_PUBREL);
-    res.json()["packetId"] = p;
-    pushOutbox(res);
-  }
-  break;
-  case TYPE_MQTT_PUBREL:
-  {
-    int p = m.json()["packetId"];
-    AF1Msg res(TYPE_MQTT_PUBCOMP);
-    res.json()["packetId"] = p;
-    pushOutbox(res);
-  }
-  break;
-  }
 
 #if IMPLICIT_STATE_CHANGE
-  if (!isMaster && m.getState() != curState && m.getState() != requestedState && !detached)
+  if (!isMaster && h.state != curState && h.state != requestedState && !detached)
   {
-    Serial.println("Implicit state change to " + stateToString(m.getState()));
-    requestedState = m.getState();
+    Serial.println("Implicit state change to " + stateToString(h.state));
+    requestedState = h.state;
   }
 #endif
 }
 
+// On the worker task
+void Base::handleWorkerMsg(AF1Msg &m)
+{
+  msg_header h = m.getHeader();
+  type_msg_handler handler = msgHandlers[h.type];
+  if (handler != NULL)
+  {
+    handler(m, h);
+  }
+}
+
 void Base::handleOutboxMsg(AF1Msg &m)
 {
   Serial.print(">");
@@ -320,7 +442,7 @@ void Base::handleOutboxMsg(AF1Msg &m)
   m.print();
 #endif
 
-  uint8_t q = m.json()["qos"];
+  uint8_t q = m.readJson()["qos"];
   switch (m.getType())
   {
   case TYPE_MQTT_PUBLISH:
@@ -332,13 +454,28 @@ void Base::handleOutboxMsg(AF1Msg &m)
       nextPacketId = (nextPacketId + 1) % MAX_PACKET_ID;
     }
     break;
+#if ESPNOW_WIRE_JSON
+  // No room for the send time in JSON; this is as late as it gets
   case TYPE_TIME_SYNC:
-    m.json()["timeSyncTime"] = millis();
+    m.json()["t1"] = AF1Clock::now();
+    break;
+  case TYPE_TIME_SYNC_RESPONSE:
+    m.json()["t3"] = AF1Clock::now();
     break;
+#endif
   }
 
   // ESPNow
   sendMsgESPNow(m);
+  if (m.getType() == TYPE_TIME_SYNC_BEACON)
+  {
+    noteBeacon(m.getSeq(), m.getTxUs() + TIME_SYNC_BEACON_US);
+    return;
+  }
+  if (m.getType() == TYPE_TIME_SYNC_REPORT || m.getType() == TYPE_BROADCAST_NACK || m.getType() == TYPE_RELIABLE_ACK)
+  {
+    return;
+  }
   // Websocket
   sendMsgWS(m);
   // sendHTTP?
@@ -362,44 +499,45 @@ String Base::getName()
 
 void Base::resetEvents()
 {
-  for (std::map<String, AF1Event>::iterator it = eventMap.begin(); it != eventMap.end(); it++)
+  for (event_map::iterator it = eventMap.begin(); it != eventMap.end(); it++)
   {
-    eventMap[it->first].reset();
+    it->second.reset();
   }
   // Global
-  for (std::map<String, AF1Event>::iterator it = globalEventMap.begin(); it != globalEventMap.end(); it++)
+  for (event_map::iterator it = globalEventMap.begin(); it != globalEventMap.end(); it++)
   {
-    if (globalEventMap[it->first].getStartTimeType() == START_STATE_MS)
+    if (it->second.getStartTimeType() == START_STATE_MS)
     {
-      globalEventMap[it->first].reset();
+      it->second.reset();
     }
   }
 }
 
 void Base::activateEvents()
 {
-  for (std::map<String, AF1Event>::iterator it = eventMap.begin(); it != eventMap.end(); it++)
+  for (event_map::iterator it = eventMap.begin(); it != eventMap.end(); it++)
   {
-    eventMap[it->first].activate();
+    it->second.activate();
   }
 }
 
 void Base::deactivateEvents()
 {
-  std::vector<String> delKeys;
-  for (std::map<String, AF1Event>::iterator it = eventMap.begin(); it != eventMap.end(); it++)
+  for (event_map::iterator it = eventMap.begin(); it != eventMap.end();)
   {
-    eventMap[it->first].deactivate();
-    if (eventMap[it->first].getType() == EVENT_TYPE_TEMP)
+    it->second.deactivate();
+    eventScheduler.unschedule(&it->second);
+    if (it->second.getType() == EVENT_TYPE_TEMP)
     {
-      delKeys.push_back(it->first);
+      Serial.print("Deleting temporary Event ");
+      Serial.println(it->second.getName());
+      eventNames.erase(it->second.getName());
+      it = eventMap.erase(it);
+    }
+    else
+    {
+      it++;
     }
-  }
-  for (String s : delKeys)
-  {
-    Serial.print("Deleting temporary Event ");
-    Serial.println(s);
-    eventMap.erase(s);
   }
 }
 
@@ -420,14 +558,19 @@ bool Base::broadcastAP()
 
 String Base::macToString(const uint8_t *m)
 {
-  char buffer[33];
-  String result = "";
-  for (int i = 0; i < 6; i++)
-  {
-    itoa(m[i], buffer, 16);
-    result += buffer;
-  }
-  return result;
+  char buffer[13];
+  snprintf(buffer, sizeof(buffer), "%02x%02x%02x%02x%02x%02x", m[0], m[1], m[2], m[3], m[4], m[5]);
+  return buffer;
+}
+
+peer_handle Base::getPeerHandle(String id)
+{
+  return peers.find(id);
+}
+
+String Base::getPeerId(peer_handle h)
+{
+  return peers.has(h) ? peers.getId(h) : "";
 }
 
 void Base::printMac(const uint8_t *m)
@@ -521,24 +664,121 @@ void Base::setOutboxMsgHandler(msg_handler h)
   outbox.setMsgHandler(h);
 }
 
-void Base::pushOutbox(AF1Msg m)
+bool Base::pushOutbox(const AF1Msg &m)
+{
+  return pushOutbox(AF1Msg(m));
+}
+
+bool Base::pushOutbox(AF1Msg &&m)
+{
+  if (m.isReliable() && waitingCnt >= RELIABLE_WAITING)
+  {
+#if PRINT_MSG_SEND
+    Serial.println("Reliable messages backed up; message not queued");
+#endif
+    return false;
+  }
+  if (!outbox.push(std::move(m)))
+  {
+#if PRINT_MSG_SEND
+    Serial.println("Outbox full; message not queued");
+#endif
+    return false;
+  }
+  return true;
+}
+
+bool Base::pushInbox(const AF1Msg &m)
 {
-  outbox.enqueue(m);
+  return pushInbox(AF1Msg(m));
 }
 
-void Base::pushInbox(AF1Msg m)
+bool Base::pushInbox(AF1Msg &&m)
 {
 #if SAFETY_CHECK_INBOX_OVERFLOW
-  if (inbox.size() > 3)
+  if (inbox.size() >= (int)(inbox.capacity() * 3 / 4))
   {
 #if PRINT_MSG_RECEIVE
     Serial.println("Warning: inbox overflow approaching");
 #endif
-    // do something
   }
 #endif
 
-  inbox.enqueue(m);
+  if (!inbox.push(std::move(m)))
+  {
+#if PRINT_MSG_RECEIVE
+    Serial.println("Inbox full; message not queued");
+#endif
+    return false;
+  }
+  return true;
+}
+
+void Base::setInboxPolicy(box_policy p)
+{
+  inbox.setPolicy(p);
+}
+
+void Base::setOutboxPolicy(box_policy p)
+{
+  outbox.setPolicy(p);
+}
+
+void Base::setInboxDrain(box_drain d)
+{
+  inbox.setDrain(d);
+}
+
+void Base::setOutboxDrain(box_drain d)
+{
+  outbox.setDrain(d);
+}
+
+void Base::setInboxBudget(int maxMsgs, unsigned long maxUs)
+{
+  inbox.setBudget(maxMsgs, maxUs);
+}
+
+void Base::setOutboxBudget(int maxMsgs, unsigned long maxUs)
+{
+  outbox.setBudget(maxMsgs, maxUs);
+}
+
+box_stats Base::getInboxStats()
+{
+  return inbox.getStats();
+}
+
+box_stats Base::getOutboxStats()
+{
+  return outbox.getStats();
+}
+
+void Base::printBoxStats()
+{
+  box_stats i = inbox.getStats();
+  box_stats o = outbox.getStats();
+  Serial.printf("Inbox: size=%d/%u; highWater=%lu; accepted=%lu; dropped=%lu; rejected=%lu; coalesced=%lu; budgetExhausted=%lu; latency avg=%lu us, max=%lu us\n",
+                inbox.size(), (unsigned)inbox.capacity(), i.highWater, i.accepted, i.dropped, i.rejected, i.coalesced, i.budgetExhausted,
+                i.latencyCnt ? i.latencyTotalUs / i.latencyCnt : 0, i.latencyMaxUs);
+  Serial.printf("Outbox: size=%d/%u; highWater=%lu; accepted=%lu; dropped=%lu; rejected=%lu; coalesced=%lu; budgetExhausted=%lu\n",
+                outbox.size(), (unsigned)outbox.capacity(), o.highWater, o.accepted, o.dropped, o.rejected, o.coalesced, o.budgetExhausted);
+  tx_stats t = TxQueue::getStats();
+  Serial.printf("ESP-Now TX: sent=%lu; failed=%lu; retried=%lu; dropped=%lu; timedOut=%lu\n",
+                t.sent, t.failed, t.retried, t.dropped, t.timedOut);
+  broadcast_stats b = BroadcastTx::getStats();
+  Serial.printf("ESP-Now broadcast: sent=%lu; heartbeats=%lu; nacked=%lu; expired=%lu; NACKs sent=%lu; duplicates=%lu\n",
+                b.sent, b.heartbeats, b.nacked, b.expired, b.nacksSent, b.duplicates);
+  reliable_stats r = ReliableTx::getStats();
+  Serial.printf("Reliable: sent=%lu; retransmits=%lu; acked=%lu; failed=%lu; waited=%lu; dropped=%lu; delivered=%lu; held=%lu; duplicates=%lu; skipped=%lu\n",
+                r.sent, r.retransmits, r.acked, r.failed, r.waited, r.dropped, r.delivered, r.held, r.duplicates, r.skipped);
+  if (Worker::isRunning())
+  {
+    worker_stats w = Worker::getStats();
+    box_stats b = Worker::getBoxStats();
+    Serial.printf("Worker: tasks posted=%lu; full=%lu; ran=%lu; loop tasks posted=%lu; full=%lu; ran=%lu; msgs size=%d; accepted=%lu; dropped=%lu\n",
+                  w.posted, w.full, w.ran, w.loopPosted, w.loopFull, w.loopRan, Worker::getBoxSize(), b.accepted, b.dropped + b.rejected);
+  }
 }
 
 /*
@@ -614,14 +854,10 @@ void Base::setBuiltinLED(bool on)
   From ESPNowEnt
 */
 
+// WiFi task; the loop advances the peer's queue
 void Base::onESPNowDataSent(const uint8_t *mac_addr, esp_now_send_status_t status)
 {
-  char macStr[18];
-  snprintf(macStr, sizeof(macStr), "%02x:%02x:%02x:%02x:%02x:%02x",
-           mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]);
-  // Serial.print("Last Packet Sent to ");
-  // Serial.println(macStr);
-  // Serial.print("Last Packet Send Status: ");
+  peer_handle h = peers.find(mac_addr);
   if (status == ESP_NOW_SEND_SUCCESS)
   {
 #if PRINT_MSG_SEND
@@ -630,40 +866,26 @@ void Base::onESPNowDataSent(const uint8_t *mac_addr, esp_now_send_status_t statu
   }
   else
   {
-    // Serial.println("Delivery Fail");
-    String peerDeviceID = macToIDMap[macToString(mac_addr)];
 #if PRINT_MSG_SEND
-    Serial.println("Delivery failed to peer ID " + deviceID);
+    Serial.println("Delivery failed to peer ID " + getPeerId(h));
 #else
     Serial.print("X");
 #endif
-    peerInfoMap[peerDeviceID].mutex.lock();
-    // Check if there are more retries remaining and retry if so
-    if (peerInfoMap[peerDeviceID].lastMsg.getSendCnt() - 1 < peerInfoMap[peerDeviceID].lastMsg.getMaxRetries())
-    {
-#if PRINT_MSG_SEND
-      Serial.println("Retrying send to device ID " + peerDeviceID);
-#endif
-      AF1Msg msg = peerInfoMap[peerDeviceID].lastMsg;
-      msg.incrementSendCnt();
-      msg.setRecipients({peerDeviceID}); // Only resending to 1 device!
-      pushOutbox(msg);
-      // outbox.enqueue(msg);
-    }
-    else
-    {
-#if PRINT_MSG_SEND
-      Serial.println("Max retries reached; not sending");
-#endif
-    }
-    peerInfoMap[peerDeviceID].mutex.unlock();
   }
+  if (h == PEER_NONE)
+  {
+    return; // Broadcasts aren't queued
+  }
+  tx_done d = {h, txDoneTags[h]++, status == ESP_NOW_SEND_SUCCESS};
+  txDone.enqueue(d); // If full, the frame times out instead
+  Box::notify();
 }
 
 void Base::onESPNowDataRecv(const uint8_t *mac, const uint8_t *incomingData, int len)
 {
+  time_us rx = AF1Clock::now(); // First, for time sync
   Serial.print(".");
-#if PRINT_MSG_RECV
+#if PRINT_MSG_RECEIVE
   char macStr[18];
   snprintf(macStr, sizeof(macStr), "%02x:%02x:%02x:%02x:%02x:%02x",
            mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
@@ -671,14 +893,35 @@ void Base::onESPNowDataRecv(const uint8_t *mac, const uint8_t *incomingData, int
   Serial.println(macStr);
 #endif
 
+  AF1Msg wm;
+  if (wm.fromWire(incomingData, len))
+  {
+    if (wm.isBroadcast() && wm.getGroup() != group)
+    {
+      return;
+    }
+    wm.setSender(peers.find(mac));
+    wm.setRxUs(rx);
+#if PRINT_MSG_RECEIVE
+    Serial.print("Received ESP Now message: ");
+    wm.print();
+#endif
+    pushInbox(std::move(wm));
+    return;
+  }
+
   uint8_t nonConst[len];
   memcpy(nonConst, incomingData, len);
   AF1JsonDoc doc;
   deserializeJson(doc, nonConst);
   AF1Msg m = !doc.isNull() ? doc : AF1Msg(nonConst, len);
+  m.setSender(peers.find(mac));
+  m.setRxUs(rx);
+#if PRINT_MSG_RECEIVE
   Serial.print("Received ESP Now message: ");
   m.print();
-  pushInbox(m);
+#endif
+  pushInbox(std::move(m));
 }
 
 void Base::initEspNow()
@@ -688,6 +931,14 @@ void Base::initEspNow()
     Serial.println("ESP-NOW Init Success");
     esp_now_register_recv_cb(onESPNowDataRecv);
     esp_now_register_send_cb(onESPNowDataSent);
+
+    esp_now_peer_info_t info;
+    memset(&info, 0, sizeof(info));
+    memcpy(info.peer_addr, broadcastMac, 6);
+    info.channel = ESPNOW_CHANNEL;
+    info.encrypt = 0;
+    info.ifidx = WIFI_IF_AP;
+    esp_now_add_peer(&info);
   }
   else
   {
@@ -732,7 +983,7 @@ int8_t Base::scanForPeersESPNow()
       {
         String deviceID = SSID.substring(String(DEVICE_PREFIX).length());
         // Check the overwrite argument and only overwrite existing entries if true
-        if (!peerInfoMap.count(deviceID))
+        if (peers.find(deviceID) == PEER_NONE)
         {
           Serial.print(i + 1);
           Serial.print(": ");
@@ -757,12 +1008,16 @@ int8_t Base::scanForPeersESPNow()
             info.channel = ESPNOW_CHANNEL;
             info.encrypt = 0; // no encryption
             info.ifidx = WIFI_IF_AP;
-            peerInfoMap[deviceID].espnowPeerInfo = info;
-            peerInfoMap[deviceID].handshakeResponse = false;
-            peerInfoMap[deviceID].lastMsg = AF1Msg();
-            peerInfoMap[deviceID].otherTimeSync = 0;
-            peerInfoMap[deviceID].thisTimeSync = 0;
-            macToIDMap[macToString(info.peer_addr)] = deviceID;
+            peer_handle h = peers.add(deviceID, info.peer_addr);
+            if (h == PEER_NONE)
+            {
+              continue;
+            }
+            peers[h].espnowPeerInfo = info;
+            peers[h].handshakeResponse = false;
+            peers[h].timeSync.reset();
+            peers[h].broadcastRx.reset();
+            peers[h].reliableRx.reset();
             Serial.println("Saved peer info for device ID " + deviceID);
           }
         }
@@ -786,21 +1041,21 @@ int8_t Base::scanForPeersESPNow()
 void Base::connectToPeers()
 {
   // Try to connect if not connected already
-  if (peerInfoMap.size())
+  if (peers.size())
   {
-    for (std::map<String, af1_peer_info>::iterator it = peerInfoMap.begin(); it != peerInfoMap.end(); it++)
+    for (peer_handle h = 0; h < peers.size(); h++)
     {
       // Check if the peer exists
-      if (esp_now_is_peer_exist(it->second.espnowPeerInfo.peer_addr))
+      if (esp_now_is_peer_exist(peers[h].espnowPeerInfo.peer_addr))
       {
         Serial.print("Peer ID ");
-        Serial.print(it->first);
+        Serial.print(peers.getId(h));
         Serial.println(" already paired");
       }
       else
       {
         // Peer not connected; attempt to connect
-        esp_err_t connectStatus = esp_now_add_peer(&it->second.espnowPeerInfo);
+        esp_err_t connectStatus = esp_now_add_peer(&peers[h].espnowPeerInfo);
         // IMPORTANT: Should the peer/peerInfo be removed from the map if pairing failed? TO DO
         if (connectStatus == ESP_OK)
         {
@@ -836,78 +1091,414 @@ void Base::connectToPeers()
   }
 }
 
-void Base::sendMsgESPNow(AF1Msg msg)
+void Base::sendMsgESPNow(AF1Msg &msg)
 {
-  // If recipients set is empty then send to all
-  std::set<String> recipientIDs = msg.getRecipients().size() ? msg.getRecipients() : getPeerIDs();
+  const PeerSet &recipients = msg.getRecipients().isAll() ? peers.getAll() : msg.getRecipients();
 
-  if (!recipientIDs.size())
+  if (recipients.empty())
   {
 #if PRINT_MSG_SEND
     Serial.println("No ESPNow peers; unable to send message");
 #endif
+    return;
+  }
+
+  // Beacons must arrive everywhere at once or not at all; a late repaired copy would corrupt the offsets
+  bool beacon = msg.getType() == TYPE_TIME_SYNC_BEACON || msg.getType() == TYPE_TIME_SYNC_REPORT;
+  if (!beacon && msg.isReliable() && sendReliableESPNow(msg, recipients))
+  {
+    return;
+  }
+  if (!beacon && ESPNOW_BROADCAST && msg.getRecipients().isAll() && sendBroadcastESPNow(msg))
+  {
+    return;
+  }
+
+  // Encoded once for all recipients
+  const uint8_t *data;
+  size_t len;
+  if (msg.getRaw() != NULL)
+  {
+    data = msg.getRaw();
+    len = msg.getRawLen();
+  }
+  else
+  {
+    data = ESPNOW_WIRE_JSON ? NULL : msg.encode(WIRE_FORMAT_BINARY, len);
+    if (data == NULL)
+    {
+      // JSON fallback (opt-in, or if the message doesn't fit the wire format)
+      data = msg.encode(WIRE_FORMAT_JSON, len);
+    }
   }
+#if PRINT_MSG_SEND
+  Serial.print("Sending: ");
+  hexdump(data, len);
+#endif
 
-  for (std::set<String>::iterator it = recipientIDs.begin(); it != recipientIDs.end() && peerInfoMap.count(*it); it++)
+  // One unsequenced frame for everyone in range; no acks, so no retries or repairs
+  if (beacon)
   {
-    peerInfoMap[*it].mutex.lock();
-    // Update last msg sent for this peer (now doing this even if sending fails)
-    peerInfoMap[*it].lastMsg = msg;
+    msg.stampTx(AF1Clock::now());
+    esp_now_send(broadcastMac, data, len);
+    return;
+  }
 
-    esp_err_t result;
-    if (msg.getRaw() != NULL)
+  // Copied once, and shared by the recipients' queues
+  tx_frame *f = TxQueue::newFrame(data, len, msg.getPriority() == PRIORITY_HIGH ? TX_FRAME_CONTROL : TX_FRAME_QUEUED);
+  if (f == NULL)
+  {
+    Serial.println("ESP-Now TX frames full; message dropped");
+    TxQueue::noteDropped();
+    return;
+  }
+  for (peer_handle h = recipients.first(); h != PEER_NONE; h = recipients.next(h))
+  {
+    if (peers.has(h))
     {
-      Serial.print("Sending raw: ");
-      hexdump(msg.getRaw(), msg.getRawLen());
-      result = esp_now_send(peerInfoMap[*it].espnowPeerInfo.peer_addr, msg.getRaw(), msg.getRawLen());
+      peers[h].txQueue.push(f, msg.getMaxRetries());
     }
-    else
+  }
+  TxQueue::releaseFrame(f);
+  pumpESPNow();
+}
+
+/*
+  One sequenced frame for everyone in range, kept for a while in case some peers NACK it.
+  False if the message has to go unicast (it doesn't fit the binary format, or is raw).
+*/
+bool Base::sendBroadcastESPNow(AF1Msg &msg)
+{
+  if (msg.getRaw() != NULL || ESPNOW_WIRE_JSON)
+  {
+    return false;
+  }
+  msg.setBroadcast(true, group, BroadcastTx::getNextSeq());
+  size_t len;
+  const uint8_t *data = msg.encode(WIRE_FORMAT_BINARY, len);
+  if (data == NULL)
+  {
+    msg.setBroadcast(false);
+    return false;
+  }
+  tx_frame *f = TxQueue::newFrame(data, len, TX_FRAME_BROADCAST);
+  if (f == NULL)
+  {
+    Serial.println("ESP-Now TX frames full; message dropped");
+    TxQueue::noteDropped();
+    return true;
+  }
+  msg.stampTx(AF1Clock::now());
+  esp_now_send(broadcastMac, data, len);
+  BroadcastTx::keep(f); // Repairs get their own stamp (see pumpESPNow())
+  TxQueue::releaseFrame(f);
+  return true;
+}
+
+// Our last broadcast sequence number, so peers that missed the last frame find out
+void Base::sendBroadcastHeartbeat()
+{
+  AF1Msg msg(TYPE_BROADCAST_HEARTBEAT);
+  msg.setBroadcast(true, group, BroadcastTx::getLastSeq());
+  size_t len;
+  const uint8_t *data = msg.encode(WIRE_FORMAT_BINARY, len);
+  if (data != NULL)
+  {
+    esp_now_send(broadcastMac, data, len);
+  }
+}
+
+// Drops duplicates, and NACKs the sender's broadcasts we missed; false if m shouldn't be handled
+bool Base::receiveBroadcast(AF1Msg &m)
+{
+  bool heartbeat = m.getType() == TYPE_BROADCAST_HEARTBEAT;
+  peer_handle h = m.getSender();
+  if (!peers.has(h))
+  {
+    return !heartbeat;
+  }
+  BroadcastRx &rx = peers[h].broadcastRx;
+  bool fresh = rx.receive(m.getBroadcastSeq(), heartbeat);
+  if (rx.isNackDue(AF1Clock::now()))
+  {
+    AF1Msg nack(TYPE_BROADCAST_NACK);
+    nack.json()["latest"] = rx.getLatest();
+    nack.json()["missing"] = rx.getMissing();
+    nack.setRecipients({h});
+    nack.setMaxRetries(DEFAULT_RETRIES);
+    pushOutbox(std::move(nack));
+  }
+  return fresh;
+}
+
+// Resend what the peer missed, unicast, if we still have it
+void Base::receiveBroadcastNack(AF1Msg &m)
+{
+  peer_handle h = m.getSender();
+  if (!peers.has(h))
+  {
+    return;
+  }
+  uint16_t latest = m.readJson()["latest"];
+  uint32_t missing = m.readJson()["missing"];
+  for (int i = 31; i >= 0; i--)
+  {
+    if (missing & (1UL << i))
     {
-      String s;
-      size_t len = serializeJson(msg.json(), s);
-      Serial.printf("Sending json: %s (size: %d)\n", s.c_str(), len);
-      result = esp_now_send(peerInfoMap[*it].espnowPeerInfo.peer_addr, (uint8_t *)s.c_str(), len);
+      tx_frame *f = BroadcastTx::find(latest - i);
+      if (f != NULL)
+      {
+        peers[h].txQueue.push(f, RETRIES_BCAST_REPAIR);
+      }
     }
+  }
+  pumpESPNow();
+}
 
-    // Serial.print("Send Status: ");
-    if (result == ESP_OK)
+/*
+  A copy per recipient, each with the next number in that peer's sequence; kept until acked.
+  Recipients without room in their window get it later, in order (see sendReliableWaiting()).
+  False if the message has to go as usual (it doesn't fit the binary format, or is raw).
+*/
+bool Base::sendReliableESPNow(AF1Msg &msg, const PeerSet &recipients)
+{
+  size_t len;
+  const uint8_t *data = msg.getRaw() == NULL ? msg.encode(WIRE_FORMAT_BINARY, len) : NULL;
+  if (data == NULL)
+  {
+    Serial.println("Reliable message doesn't fit the binary format; sending it unreliably");
+    msg.setReliable(false);
+    return false;
+  }
+  // Behind any already waiting, so each peer gets them in order
+  PeerSet left = waitingCnt ? recipients : sendReliableFrames(data, len, recipients, msg.getMaxRetries());
+  if (!left.empty())
+  {
+    if (waitingCnt >= RELIABLE_WAITING)
+    {
+      Serial.println("Reliable messages backed up; message dropped");
+      ReliableTx::noteDropped();
+    }
+    else
     {
-      // Serial.println("Success");
+      AF1Msg &w = reliableWaiting[(waitingHead + waitingCnt) % RELIABLE_WAITING];
+      w = msg;
+      w.setRecipients(left);
+      waitingCnt++;
+      ReliableTx::noteWaited();
+    }
+  }
+  pumpESPNow();
+  return true;
+}
 
-      // Update the send count of that last msg
-      peerInfoMap[*it].lastMsg.incrementSendCnt();
+// Queues a copy for each recipient with room in its window; returns the ones without
+PeerSet Base::sendReliableFrames(const uint8_t *data, size_t len, const PeerSet &recipients, uint8_t maxRetries)
+{
+  time_us now = AF1Clock::now();
+  PeerSet left;
+  for (peer_handle h = recipients.first(); h != PEER_NONE; h = recipients.next(h))
+  {
+    if (!peers.has(h))
+    {
+      continue;
     }
-    else if (result == ESP_ERR_ESPNOW_NOT_INIT)
+    ReliableTx &rt = peers[h].reliableTx;
+    tx_frame *f = rt.isFull() ? NULL : TxQueue::newFrame(data, len, TX_FRAME_RELIABLE);
+    if (f == NULL)
     {
-      // How did we get so far!!
-      Serial.println("ESPNOW not Init.");
+      left.add(h);
+      continue;
     }
-    else if (result == ESP_ERR_ESPNOW_ARG)
+    AF1Msg::setReliableSeq(f->data, f->len, rt.getNextSeq());
+    rt.add(f, now);
+    peers[h].txQueue.push(f, maxRetries);
+    TxQueue::releaseFrame(f);
+  }
+  return left;
+}
+
+// Sends waiting reliable messages, oldest first, as windows open; from serviceReliable()
+void Base::sendReliableWaiting()
+{
+  while (waitingCnt)
+  {
+    AF1Msg &w = reliableWaiting[waitingHead];
+    size_t len;
+    const uint8_t *data = w.encode(WIRE_FORMAT_BINARY, len);
+    PeerSet left = data == NULL ? PeerSet() : sendReliableFrames(data, len, w.getRecipients(), w.getMaxRetries());
+    if (!left.empty())
     {
-      Serial.println("Invalid Argument");
+      w.setRecipients(left);
+      return;
     }
-    else if (result == ESP_ERR_ESPNOW_INTERNAL)
+    w = AF1Msg();
+    waitingHead = (waitingHead + 1) % RELIABLE_WAITING;
+    waitingCnt--;
+  }
+}
+
+// Hands m, and whatever it was holding up, over in order; acks are sent from serviceReliable()
+void Base::receiveReliable(AF1Msg &m)
+{
+  peer_handle h = m.getSender();
+  if (!peers.has(h))
+  {
+    dispatchInboxMsg(m); // Can't ack it
+    return;
+  }
+  ReliableRx &rr = peers[h].reliableRx;
+  time_us now = AF1Clock::now();
+  reliable_result r = rr.receive(m.getReliableSeq(), now);
+  if (r == RELIABLE_RESYNC)
+  {
+    deliverReliable(h); // What was held before the sender's window, in order
+    r = rr.receive(m.getReliableSeq(), now);
+  }
+  switch (r)
+  {
+  case RELIABLE_DELIVER:
+    dispatchInboxMsg(m);
+    break;
+  case RELIABLE_HOLD:
+  {
+    size_t len;
+    const uint8_t *data = m.encode(WIRE_FORMAT_BINARY, len);
+    if (data != NULL)
     {
-      Serial.println("Internal Error");
+      rr.hold(m.getReliableSeq(), data, len, m.getRxUs(), m.getTxUs());
     }
-    else if (result == ESP_ERR_ESPNOW_NO_MEM)
+    break;
+  }
+  case RELIABLE_DUP:
+  case RELIABLE_RESYNC:
+    break;
+  }
+  deliverReliable(h);
+}
+
+void Base::deliverReliable(peer_handle h)
+{
+  ReliableRx &rr = peers[h].reliableRx;
+  reliable_held held;
+  while (rr.next(held, AF1Clock::now()))
+  {
+    AF1Msg m;
+    if (m.fromWire(held.data, held.len))
     {
-      Serial.println("ESP_ERR_ESPNOW_NO_MEM");
+      m.setSender(h);
+      m.setRxUs(held.rxUs);
+      m.stampTx(held.txUs);
+      dispatchInboxMsg(m);
     }
-    else if (result == ESP_ERR_ESPNOW_NOT_FOUND)
+    MsgPool::release(held.data);
+  }
+}
+
+// Acks, resends, gaps given up on, and messages waiting for room; from update()
+void Base::serviceReliable()
+{
+  time_us now = AF1Clock::now();
+  for (peer_handle h = 0; h < peers.size(); h++)
+  {
+    ReliableRx &rr = peers[h].reliableRx;
+    rr.expire(now);
+    deliverReliable(h);
+    uint16_t next;
+    uint32_t held;
+    if (rr.takeAck(next, held))
     {
-      Serial.println("Peer not found.");
+      AF1Msg ack(TYPE_RELIABLE_ACK);
+      ack.json()["next"] = next;
+      ack.json()["held"] = held;
+      ack.setRecipients({h});
+      pushOutbox(std::move(ack));
     }
-    else if (result == ESP_ERR_ESPNOW_IF)
+    tx_frame *f;
+    while ((f = peers[h].reliableTx.takeDue(now)) != NULL)
     {
-      Serial.println("Current wifi interface doesnt match that of peer");
+      peers[h].txQueue.push(f, 0); // MAC retries were spent on the first send
     }
-    else
+  }
+  sendReliableWaiting();
+}
+
+// Send what each peer's window has room for; completions come back through onESPNowDataSent()
+void Base::pumpESPNow()
+{
+  time_us now = AF1Clock::now();
+  for (peer_handle h = 0; h < peers.size(); h++)
+  {
+    TxQueue &q = peers[h].txQueue;
+    q.expire(now);
+    tx_entry *e;
+    while ((e = q.next()) != NULL)
+    {
+      AF1Msg::stampTx(e->frame->data, e->frame->len, AF1Clock::now()); // If it has room for it
+      esp_err_t result = esp_now_send(peers[h].espnowPeerInfo.peer_addr, e->frame->data, e->frame->len);
+      if (result == ESP_OK)
+      {
+        q.sent(now);
+        continue;
+      }
+      if (result == ESP_ERR_ESPNOW_NO_MEM)
+      {
+        return; // Driver queue full; retried when something completes
+      }
+      if (result == ESP_ERR_ESPNOW_NOT_INIT)
+      {
+        // How did we get so far!!
+        Serial.println("ESPNOW not Init.");
+      }
+      else if (result == ESP_ERR_ESPNOW_ARG)
+      {
+        Serial.println("Invalid Argument");
+      }
+      else if (result == ESP_ERR_ESPNOW_INTERNAL)
+      {
+        Serial.println("Internal Error");
+      }
+      else if (result == ESP_ERR_ESPNOW_NOT_FOUND)
+      {
+        Serial.println("Peer not found.");
+      }
+      else if (result == ESP_ERR_ESPNOW_IF)
+      {
+        Serial.println("Current wifi interface doesnt match that of peer");
+      }
+      else
+      {
+        Serial.println("Not sure what happened");
+      }
+      if (q.getInFlight())
+      {
+        break; // Dropped once the frames ahead of it are done
+      }
+      q.drop();
+    }
+  }
+}
+
+void Base::handleESPNowSent()
+{
+  tx_done d;
+  bool any = false;
+  while (txDone.consume([&d](tx_done &t)
+                        { d = t; }))
+  {
+    if (peers.has(d.peer))
     {
-      Serial.println("Not sure what happened");
+      peers[d.peer].txQueue.complete(d.tag, d.ok);
+      any = true;
     }
-    peerInfoMap[*it].mutex.unlock();
-    delay(DELAY_SEND);
+  }
+  if (any || TxQueue::hasPending())
+  {
+    pumpESPNow();
+  }
+  if (BroadcastTx::takeHeartbeat(AF1Clock::now()))
+  {
+    sendBroadcastHeartbeat();
   }
 }
 
@@ -923,10 +1514,10 @@ void Base::sendStateChangeMessages(int s)
   AF1Msg msg = AF1Msg(TYPE_CHANGE_STATE);
   msg.json()["state"] = s;
   msg.setMaxRetries(DEFAULT_RETRIES);
-  pushOutbox(msg);
+  pushOutbox(std::move(msg));
 }
 
-void Base::sendHandshakeRequests(std::set<String> ids)
+void Base::sendHandshakeRequests(const PeerSet &ids)
 {
   Serial.println("Pushing handshake requests to outbox");
 
@@ -935,104 +1526,202 @@ void Base::sendHandshakeRequests(std::set<String> ids)
   JsonArray macJson = msg.json().createNestedArray("mac");
   copyArray(macAP, macJson);
   msg.setRecipients(ids);
-  pushOutbox(msg);
+  pushOutbox(std::move(msg));
 
-  for (std::set<String>::const_iterator it = ids.begin(); it != ids.end(); it++)
+  for (peer_handle h = ids.first(); h != PEER_NONE; h = ids.next(h))
   {
-    peerInfoMap[*it].handshakeRequest = true;
+    peers[h].handshakeRequest = true;
   }
 }
 
-void Base::receiveHandshakeRequest(AF1Msg m)
+void Base::receiveHandshakeRequest(AF1Msg &m)
 {
   Serial.println("Receiving handshake request from ID " + String(m.getSenderId()));
 
   esp_now_peer_info_t ei;
   memset(&ei, 0, sizeof(ei));
-  copyArray(m.json()["mac"], ei.peer_addr);
+  copyArray(m.readJson()["mac"], ei.peer_addr);
   // memcpy(&ei.peer_addr, (uint8_t *) m.json()["mac"], 6);
   ei.channel = ESPNOW_CHANNEL;
   ei.encrypt = 0; // No encryption
   ei.ifidx = WIFI_IF_AP;
-  peerInfoMap[m.getSenderId()].espnowPeerInfo = ei;
-  peerInfoMap[m.getSenderId()].handshakeResponse = false;
-  peerInfoMap[m.getSenderId()].lastMsg = AF1Msg();
-  peerInfoMap[m.getSenderId()].otherTimeSync = 0;
-  peerInfoMap[m.getSenderId()].thisTimeSync = 0;
+  peer_handle h = peers.add(m.getSenderId(), ei.peer_addr);
+  m.setSender(h);
+  if (h == PEER_NONE)
+  {
+    return;
+  }
+  peers[h].espnowPeerInfo = ei;
+  peers[h].handshakeResponse = false;
+  peers[h].timeSync.reset();
+  peers[h].broadcastRx.reset();
+  peers[h].reliableRx.reset();
 
   connectToPeers();
 }
 
-void Base::sendHandshakeResponses(std::set<String> ids)
+void Base::sendHandshakeResponses(const PeerSet &ids)
 {
   Serial.println("Pushing handshake responses to outbox");
   AF1Msg msg = AF1Msg(TYPE_HANDSHAKE_RESPONSE);
   msg.setRecipients(ids);
-  pushOutbox(msg);
+  pushOutbox(std::move(msg));
 }
 
-void Base::receiveHandshakeResponse(AF1Msg m)
+void Base::receiveHandshakeResponse(AF1Msg &m)
 {
   Serial.println("Receiving handshake response from ID " + m.getSenderId());
-  peerInfoMap[m.getSenderId()].handshakeResponse = true;
-  stateEnt->onConnectEspNowPeer(m.getSenderId());
+  if (peers.has(m.getSender()))
+  {
+    peers[m.getSender()].handshakeResponse = true;
+    stateEnt->onConnectEspNowPeer(m.getSenderId());
+  }
 }
 
 void Base::sendAllHandshakes(bool resend)
 {
-  for (std::map<String, af1_peer_info>::const_iterator it = peerInfoMap.begin(); it != peerInfoMap.end() && (!it->second.handshakeRequest || resend); it++)
+  for (peer_handle h = 0; h < peers.size(); h++)
+  {
+    if (!peers[h].handshakeRequest || resend)
+    {
+      sendHandshakeRequests({h});
+    }
+  }
+}
+
+void Base::startTimeSync(const PeerSet &ids)
+{
+  for (peer_handle h = ids.first(); h != PEER_NONE; h = ids.next(h))
   {
-    sendHandshakeRequests({it->first});
+    peers[h].timeSync.startBurst(TIME_SYNC_BURST - 1);
   }
+  sendTimeSyncMsg(ids);
 }
 
-void Base::sendTimeSyncMsg(std::set<String> ids, bool isResponse)
+void Base::sendTimeSyncMsg(const PeerSet &ids)
 {
-  Serial.print("Pushing time sync ");
-  Serial.print(isResponse ? "response " : "");
-  Serial.println("messages to outbox");
+  Serial.println("Pushing time sync messages to outbox");
 
-  AF1Msg msg = AF1Msg(isResponse ? TYPE_TIME_SYNC_RESPONSE : TYPE_TIME_SYNC);
-  msg.json()["timeSyncTime"] = millis(); // Not sure if this is really necessary; time is now set right before sending which is better
+  AF1Msg msg = AF1Msg(TYPE_TIME_SYNC);
+  msg.setTxStamp(true); // t1
   msg.setRecipients(ids);
   msg.setMaxRetries(DEFAULT_RETRIES);
 
-  pushOutbox(msg);
+  pushOutbox(std::move(msg));
 }
 
-void Base::receiveTimeSyncMsg(AF1Msg m)
+void Base::receiveTimeSyncMsg(AF1Msg &m)
 {
+  // When the frame arrived, not when the inbox got to it
+  time_us rx = m.getRxUs() ? m.getRxUs() : AF1Clock::now();
+
   Serial.print("Receiving time sync ");
-  Serial.print(m.getType() == TYPE_TIME_SYNC_RESPONSE ? "response" : "");
-  Serial.print(" msg from ID ");
+  Serial.print(m.getType() == TYPE_TIME_SYNC_RESPONSE ? "response " : "");
+  Serial.print("msg from ID ");
   Serial.println(m.getSenderId());
 
-  if (peerInfoMap.count(m.getSenderId()))
+  peer_handle h = m.getSender();
+  if (!peers.has(h))
   {
-    peerInfoMap[m.getSenderId()].otherTimeSync = m.json()["timeSyncTime"];
-    unsigned long thisMs = millis();
-    peerInfoMap[m.getSenderId()].thisTimeSync = thisMs;
-    Serial.print("Other device time: ");
-    Serial.print(peerInfoMap[m.getSenderId()].otherTimeSync);
-    Serial.print("; This device time: ");
-    Serial.println(peerInfoMap[m.getSenderId()].thisTimeSync);
+    Serial.println("Time sync message rejected; need to handshake first");
+    return;
+  }
 
-    if (m.getType() == TYPE_TIME_SYNC)
-    {
-      sendTimeSyncMsg({m.getSenderId()}, true);
-    }
+  if (m.getType() == TYPE_TIME_SYNC)
+  {
+    AF1Msg res(TYPE_TIME_SYNC_RESPONSE);
+    res.json()["t1"] = m.getTxUs() ? m.getTxUs() : m.json()["t1"].as<time_us>();
+    res.json()["t2"] = rx;
+    res.setTxStamp(true); // t3
+    res.setRecipients({h});
+    res.setMaxRetries(DEFAULT_RETRIES);
+    pushOutbox(std::move(res));
+    return;
   }
-  else
+
+  TimeSync &ts = peers[h].timeSync;
+  time_us t3 = m.getTxUs() ? m.getTxUs() : m.readJson()["t3"].as<time_us>();
+  if (!ts.addSample(m.readJson()["t1"].as<time_us>(), m.readJson()["t2"].as<time_us>(), t3, rx))
   {
-    Serial.println("Time sync message rejected; need to handshake first");
+    Serial.println("Time sync sample rejected");
+  }
+  if (ts.takeBurst())
+  {
+    sendTimeSyncMsg({h});
+  }
+  else if (ts.isSynced())
+  {
+    Serial.printf("Time sync with ID %s: offset=%lld us; drift=%.2f ppm; rtt=%llu us; error=%llu us; next in %lu ms\n",
+                  m.getSenderId().c_str(), (long long)ts.getOffsetUs(), ts.getSkewPpm(), (unsigned long long)ts.getRttUs(),
+                  (unsigned long long)ts.getErrorUs(), ts.getIntervalMs());
+  }
+}
+
+void Base::sendTimeSyncBeacon()
+{
+  AF1Msg msg(TYPE_TIME_SYNC_BEACON);
+  msg.setTxStamp(true);
+  pushOutbox(std::move(msg));
+}
+
+void Base::noteBeacon(uint16_t seq, time_us at)
+{
+  time_sync_beacon &b = beacons[seq % TIME_SYNC_BEACONS];
+  b.seq = seq;
+  b.atUs = at;
+}
+
+// Everyone hears the same frame at (nearly) the same instant, so comparing receive times gives offsets without the sender's delays
+void Base::receiveTimeSyncBeacon(AF1Msg &m)
+{
+  time_us rx = m.getRxUs() ? m.getRxUs() : AF1Clock::now();
+  uint16_t seq = m.getSeq();
+  noteBeacon(seq, rx);
+
+  peer_handle h = m.getSender();
+  if (peers.has(h) && m.getTxUs())
+  {
+    peers[h].timeSync.addOffset(rx, (int64_t)(m.getTxUs() + TIME_SYNC_BEACON_US - rx));
+  }
+
+  addEvent(AF1Event(
+      EVENTKEY_TIME_SYNC_REPORT, [seq, rx](const ECBArg &a)
+      {
+        AF1Msg r(TYPE_TIME_SYNC_REPORT);
+        r.json()["b"] = seq;
+        r.json()["rx"] = rx;
+        pushOutbox(std::move(r)); },
+      EVENT_TYPE_GLOBAL, 0, 1, AF1Clock::nowMs() + random(MS_TIME_SYNC_REPORT_SPREAD + 1), START_DEVICE_MS));
+}
+
+void Base::receiveTimeSyncReport(AF1Msg &m)
+{
+  peer_handle h = m.getSender();
+  uint16_t seq = m.readJson()["b"];
+  const time_sync_beacon &b = beacons[seq % TIME_SYNC_BEACONS];
+  if (!peers.has(h) || !b.atUs || b.seq != seq)
+  {
+    return;
   }
+  time_us rx = m.readJson()["rx"].as<time_us>();
+  TimeSync &ts = peers[h].timeSync;
+  ts.addOffset(b.atUs, (int64_t)(rx - b.atUs));
+#if PRINT_MSG_RECEIVE
+  Serial.printf("Beacon %u report from ID %s: offset=%lld us; drift=%.2f ppm\n", seq, m.getSenderId().c_str(),
+                (long long)ts.getOffsetUs(), ts.getSkewPpm());
+#endif
 }
 
+// Peers whose round is due
 void Base::sendAllTimeSyncMessages()
 {
-  for (std::map<String, af1_peer_info>::const_iterator it = peerInfoMap.begin(); it != peerInfoMap.end(); it++)
+  time_us now = AF1Clock::now();
+  for (peer_handle h = 0; h < peers.size(); h++)
   {
-    sendTimeSyncMsg({it->first});
+    if (peers[h].handshakeResponse && peers[h].timeSync.isDue(now))
+    {
+      startTimeSync({h});
+    }
   }
 }
 
@@ -1047,7 +1736,7 @@ void Base::setWS(String host, String path, int port, String protocol, unsigned l
   wsClientInfo.reconnectMs = reconnectMs;
 }
 
-void Base::sendMsgWS(AF1Msg m)
+void Base::sendMsgWS(AF1Msg &m)
 {
   if (webSocketClient.isConnected())
   {
@@ -1061,9 +1750,10 @@ void Base::sendMsgWS(AF1Msg m)
     }
     else
     {
-      String s;
-      serializeJson(m.json(), s);
-      webSocketClient.sendTXT(s);
+      size_t len;
+      const uint8_t *s = m.encode(WIRE_FORMAT_JSON, len);
+      m.stampTx(AF1Clock::now());
+      webSocketClient.sendTXT(s, len);
     }
   }
   else
@@ -1122,37 +1812,41 @@ bool Base::doConnectToWSServer()
 
 unsigned long Base::getStartMs()
 {
-  return startMs;
+  return AF1Clock::toMs(startUs);
+}
+
+time_us Base::getStartUs()
+{
+  return startUs;
 }
 
 void Base::scheduleSyncStart()
 {
-  unsigned long s = syncStartTime;
+  time_us s = syncStartTime;
+  time_us now = AF1Clock::now();
 
   Serial.println("Scheduling");
-  Serial.print("Current time: ");
-  Serial.print(millis());
-  Serial.print("; Start time: ");
-  Serial.print(s);
-  Serial.print("; diff: ");
-  Serial.println(s - millis());
+  Serial.printf("Current time: %llu us; Start time: %llu us; diff: %lld us\n",
+                (unsigned long long)now, (unsigned long long)s, (long long)(s - now));
 
-  unsigned long dif = s - millis();
-  unsigned long startMs = dif + stateEnt->getElapsedMs();
+  // State time, with the sub-ms remainder as the event's phase
+  time_us stateUs = s > startUs ? s - startUs : 0;
 
-  addEvent(AF1Event(
-      EVENTKEY_SCHEDULE_SYNC_START, [](ECBArg a)
+  AF1Event e(
+      EVENTKEY_SCHEDULE_SYNC_START, [](const ECBArg &a)
       {
     Serial.println("Starting");
     stateEnt->doSynced(); },
-      EVENT_TYPE_TEMP, 0, 1, startMs));
+      EVENT_TYPE_TEMP, 0, 1, AF1Clock::toMs(stateUs));
+  e.setPhaseUs(stateUs % 1000);
+  addEvent(e);
 }
 
 void Base::doSynced()
 {
   addEvent(AF1Event(
       EVENTKEY_SYNC_START,
-      [](ECBArg a)
+      [](const ECBArg &a)
       { setBuiltinLED(a.cbCnt % 2); },
       EVENT_TYPE_TEMP, 300));
 }
@@ -1162,6 +1856,11 @@ bool Base::doSync()
   return false;
 }
 
+bool Base::doIdle()
+{
+  return true;
+}
+
 // StateManager - BEGIN
 
 int Base::getCurState()
@@ -1241,6 +1940,7 @@ bool Base::handleStateChange(int s)
 
     stateEnt = stateEntMap[s];
     stateEnt->setup();
+    rescheduleEvents(); // State ms and the active state's events have changed
     stateEnt->setInboxMsgHandler(stateEnt->getInboxHandler());
     stateEnt->setOutboxMsgHandler(stateEnt->getOutboxHandler());
 
@@ -1272,6 +1972,38 @@ void Base::removeStringHandler(String s)
   stringHandlerMap.erase(s);
 }
 
+void Base::addMsgHandler(uint8_t type, type_msg_handler h)
+{
+  msgHandlers[type] = h;
+}
+
+void Base::removeMsgHandler(uint8_t type)
+{
+  msgHandlers[type] = NULL;
+}
+
+void Base::setMsgWorker(uint8_t type, bool w)
+{
+  workerTypes[type] = w;
+}
+
+void Base::addStateMsgHandler(uint8_t type, type_msg_handler h)
+{
+  if (stateMsgHandlers == NULL)
+  {
+    stateMsgHandlers = new type_msg_handler[256]();
+  }
+  stateMsgHandlers[type] = h;
+}
+
+void Base::removeStateMsgHandler(uint8_t type)
+{
+  if (stateMsgHandlers != NULL)
+  {
+    stateMsgHandlers[type] = NULL;
+  }
+}
+
 void Base::addWifiAP(String s, String p)
 {
   wifi_ap_info i;
@@ -1366,55 +2098,251 @@ void Base::onConnectEspNowPeer(String p)
 {
 }
 
-std::set<String> Base::getPeerIDs()
+Base *Base::getCurStateEnt()
+{
+  return stateEntMap[curState];
+}
+
+time_us Base::convertTime(peer_handle h, time_us t)
 {
-  std::set<String> result;
-  for (std::map<String, af1_peer_info>::iterator it = peerInfoMap.begin(); it != peerInfoMap.end(); it++)
+  if (peers.has(h))
   {
-    result.insert(it->first);
+    return peers[h].timeSync.toLocal(t);
   }
-  return result;
+  return 0;
 }
 
-Base *Base::getCurStateEnt()
+AF1Event *Base::findEvent(event_handle h)
 {
-  return stateEntMap[curState];
+  event_map::iterator it = globalEventMap.find(h);
+  if (it != globalEventMap.end())
+  {
+    return &it->second;
+  }
+  if (stateEnt != NULL)
+  {
+    it = stateEnt->eventMap.find(h);
+    if (it != stateEnt->eventMap.end())
+    {
+      return &it->second;
+    }
+  }
+  return NULL;
 }
 
-unsigned long Base::convertTime(String id, unsigned long t)
+event_handle Base::findEvent(String name)
 {
-  if (peerInfoMap.count(id))
+  std::map<String, event_handle>::iterator it = globalEventNames.find(name);
+  if (it != globalEventNames.end())
   {
-    unsigned long dif = t - peerInfoMap[id].otherTimeSync;
-    return peerInfoMap[id].thisTimeSync + dif;
+    return it->second;
   }
-  return 0;
+  if (stateEnt != NULL)
+  {
+    it = stateEnt->eventNames.find(name);
+    if (it != stateEnt->eventNames.end())
+    {
+      return it->second;
+    }
+  }
+  return EVENT_NONE;
 }
 
 void Base::setIntervalTime(String e, unsigned long t)
 {
-  if (stateEnt->eventMap.count(e))
+  setIntervalTime(findEvent(e), t);
+}
+
+void Base::setIntervalTime(event_handle h, unsigned long t)
+{
+  AF1Event *e = findEvent(h);
+  if (e != NULL)
   {
-    stateEnt->eventMap.at(e).setIntervalTime(t, stateEnt->getElapsedMs());
+    eventScheduler.unschedule(e);
+    e->setIntervalTime(t, stateEnt->getElapsedMs());
+    eventScheduler.schedule(e);
   }
 }
 
-void Base::addEvent(AF1Event e)
+event_handle Base::addEvent(AF1Event e)
 {
-  if (e.getType() == EVENT_TYPE_GLOBAL)
+  bool global = e.getType() == EVENT_TYPE_GLOBAL;
+  event_map &m = global ? globalEventMap : stateEnt->eventMap;
+  std::map<String, event_handle> &names = global ? globalEventNames : stateEnt->eventNames;
+
+  event_handle h = EVENT_NONE;
+  if (e.getName().length())
+  {
+    std::map<String, event_handle>::iterator it = names.find(e.getName());
+    if (it != names.end())
+    {
+      h = it->second;
+    }
+  }
+
+  AF1Event *ev;
+  event_map::iterator it = m.find(h);
+  if (it != m.end())
   {
-    globalEventMap[e.getName()] = e;
+    ev = &it->second;
+    eventScheduler.unschedule(ev);
+    e.setHandle(h);
+    *ev = e;
   }
   else
   {
-    stateEnt->eventMap[e.getName()] = e;
+    h = nextEventHandle++;
+    e.setHandle(h);
+    ev = &m.insert(std::make_pair(h, e)).first->second;
+    if (e.getName().length())
+    {
+      names[e.getName()] = h;
+    }
+  }
+  if (stateEnt != NULL) // Otherwise scheduled once the first state is set up
+  {
+    eventScheduler.schedule(ev);
   }
+  return h;
 }
 
 void Base::removeEvent(String e)
 {
-  globalEventMap.erase(e);
-  stateEnt->eventMap.erase(e);
+  std::map<String, event_handle>::iterator it = globalEventNames.find(e);
+  if (it != globalEventNames.end())
+  {
+    removeEvent(it->second);
+  }
+  it = stateEnt->eventNames.find(e);
+  if (it != stateEnt->eventNames.end())
+  {
+    removeEvent(it->second);
+  }
+}
+
+void Base::removeEvent(event_handle h)
+{
+  event_map *maps[] = {&globalEventMap, &stateEnt->eventMap};
+  std::map<String, event_handle> *names[] = {&globalEventNames, &stateEnt->eventNames};
+  for (int i = 0; i < 2; i++)
+  {
+    event_map::iterator it = maps[i]->find(h);
+    if (it != maps[i]->end())
+    {
+      eventScheduler.unschedule(&it->second);
+      names[i]->erase(it->second.getName());
+      maps[i]->erase(it);
+      return;
+    }
+  }
+}
+
+void Base::rescheduleEvents()
+{
+  eventScheduler.clear();
+  for (event_map::iterator it = stateEnt->eventMap.begin(); it != stateEnt->eventMap.end(); it++)
+  {
+    eventScheduler.schedule(&it->second);
+  }
+  for (event_map::iterator it = globalEventMap.begin(); it != globalEventMap.end(); it++)
+  {
+    eventScheduler.schedule(&it->second);
+  }
+}
+
+#if EVENT_STATS
+bool Base::getEventStats(event_handle h, event_stats &s)
+{
+  AF1Event *e = findEvent(h);
+  if (e == NULL)
+  {
+    return false;
+  }
+  s = e->getStats();
+  return true;
+}
+
+void Base::resetEventStats()
+{
+  for (event_map::iterator it = globalEventMap.begin(); it != globalEventMap.end(); it++)
+  {
+    it->second.resetStats();
+  }
+  for (event_map::iterator it = stateEnt->eventMap.begin(); it != stateEnt->eventMap.end(); it++)
+  {
+    it->second.resetStats();
+  }
+}
+
+static void printHist(const char *label, const unsigned long *h)
+{
+  Serial.print(label);
+  for (int i = 0; i < EVENT_STATS_BUCKETS; i++)
+  {
+    Serial.print(' ');
+    Serial.print(h[i]);
+  }
+  Serial.println();
+}
+
+static void printEventStats(AF1Event &e)
+{
+  const event_stats &s = e.getStats();
+  Serial.printf("Event %lu %s: fires=%lu; missed=%lu; lateMax=%lu; lateAvg=%lu; durMaxUs=%lu; durAvgUs=%lu\n",
+                (unsigned long)e.getHandle(), e.getName().c_str(), s.fires, s.missed, s.lateMax,
+                s.fires ? s.lateTotal / s.fires : 0, s.durMaxUs, s.fires ? s.durTotalUs / s.fires : 0);
+  printHist("  late (<2^i):", s.lateHist);
+  printHist("  durUs (<2^i):", s.durHist);
+}
+
+void Base::printEventStats()
+{
+  for (event_map::iterator it = globalEventMap.begin(); it != globalEventMap.end(); it++)
+  {
+    ::printEventStats(it->second);
+  }
+  for (event_map::iterator it = stateEnt->eventMap.begin(); it != stateEnt->eventMap.end(); it++)
+  {
+    ::printEventStats(it->second);
+  }
+}
+
+static AF1Msg eventStatsMsg(AF1Event &e)
+{
+  const event_stats &s = e.getStats();
+  AF1Msg m(TYPE_EVENT_STATS);
+  m.json()["name"] = e.getName();
+  m.json()["fires"] = s.fires;
+  m.json()["missed"] = s.missed;
+  m.json()["lateMax"] = s.lateMax;
+  m.json()["lateAvg"] = s.fires ? s.lateTotal / s.fires : 0;
+  m.json()["durMaxUs"] = s.durMaxUs;
+  m.json()["durAvgUs"] = s.fires ? s.durTotalUs / s.fires : 0;
+  return m;
+}
+
+void Base::sendEventStats()
+{
+  for (event_map::iterator it = globalEventMap.begin(); it != globalEventMap.end(); it++)
+  {
+    pushOutbox(eventStatsMsg(it->second));
+  }
+  for (event_map::iterator it = stateEnt->eventMap.begin(); it != stateEnt->eventMap.end(); it++)
+  {
+    pushOutbox(eventStatsMsg(it->second));
+  }
+}
+#endif
+
+long Base::getMsToNextEvent()
+{
+  time_us d;
+  if (!eventScheduler.getNextDeadline(d))
+  {
+    return -1;
+  }
+  time_us now = AF1Clock::now();
+  return d > now ? (long)((d - now + 999) / 1000) : 0;
 }
 
 void Base::detach(bool d)
@@ -1442,6 +2370,7 @@ void Base::hexdump(const void *mem, uint32_t len, uint8_t cols)
 
 void Base::handleWebSocketEvent(WStype_t type, uint8_t *payload, size_t length)
 {
+  time_us rx = AF1Clock::now(); // Called from webSocketClient.loop(), so this is when update() polled it
   switch (type)
   {
   case WStype_DISCONNECTED:
@@ -1468,7 +2397,10 @@ void Base::handleWebSocketEvent(WStype_t type, uint8_t *payload, size_t length)
 
     AF1JsonDoc doc;
     deserializeJson(doc, String((char *)payload));
-    pushInbox(!doc.isNull() ? doc : AF1Msg(payload, length, true));
+    AF1Msg m = !doc.isNull() ? doc : AF1Msg(payload, length, true);
+    m.setSender(peers.find(m.getSenderId()));
+    m.setRxUs(rx);
+    pushInbox(std::move(m));
   }
   break;
   case WStype_BIN:
@@ -1477,7 +2409,9 @@ void Base::handleWebSocketEvent(WStype_t type, uint8_t *payload, size_t length)
     // hexdump(payload, length);
     // send data to server
     // webSocket.sendBIN(payload, length);
-    pushInbox(AF1Msg(payload, length));
+    AF1Msg m(payload, length);
+    m.setRxUs(rx);
+    pushInbox(std::move(m));
   }
   break;
   case WStype_ERROR:
@@ -1498,3 +2432,13 @@ void Base::setIsMaster(bool m)
 {
   isMaster = m;
 }
+
+void Base::setGroup(uint8_t g)
+{
+  group = g;
+}
+
+uint8_t Base::getGroup()
+{
+  return group;
+}
@@ -36,9 +36,12 @@
 #include <WiFiUdp.h>
 
 #include "event/event.h"
+#include "event/scheduler.h"
 #include "state/state.h"
 #include "message/message.h"
 #include "box/box.h"
+#include "peer/peer.h"
+#include "worker/worker.h"
 #include "pre.h"
 
 #define preMax(a, b) ((a) >= (b) ? (a) : (b))
@@ -61,6 +64,8 @@ public:
 };
 
 typedef void (*string_input_handler)(SHArg a);
+typedef void (*type_msg_handler)(AF1Msg &m, const msg_header &h);
+typedef std::map<event_handle, AF1Event> event_map;
 
 struct wifi_ap_info
 {
@@ -71,17 +76,6 @@ struct wifi_ap_info
   int subnetIP[4];
 };
 
-typedef struct af1_peer_info
-{
-  esp_now_peer_info_t espnowPeerInfo;
-  bool handshakeRequest;
-  bool handshakeResponse;
-  AF1Msg lastMsg;
-  unsigned long otherTimeSync;
-  unsigned long thisTimeSync;
-  std::mutex mutex;
-} af1_peer_info;
-
 class ws_client_info
 {
 public:
@@ -110,40 +104,62 @@ class Base
   static void onESPNowDataRecv(const uint8_t *mac, const uint8_t *incomingData, int len);
   static void setInboxMsgHandler(msg_handler h);
   static void setOutboxMsgHandler(msg_handler h);
+  static void handleWorkerMsg(AF1Msg &m);
+  static void dispatchInboxMsg(AF1Msg &m);
   static bool handleStateChange(int s);
   static void handleUserInput(String s);
   static void sendStateChangeMessages(int s);
-  static void sendHandshakeRequests(std::set<String> ids);
-  static void receiveHandshakeRequest(AF1Msg m);
-  static void sendHandshakeResponses(std::set<String> ids);
-  static void receiveHandshakeResponse(AF1Msg m);
+  static void sendHandshakeRequests(const PeerSet &peers);
+  static void receiveHandshakeRequest(AF1Msg &m);
+  static void sendHandshakeResponses(const PeerSet &peers);
+  static void receiveHandshakeResponse(AF1Msg &m);
   static void sendAllHandshakes(bool resend = false);
-  static void sendMsgESPNow(AF1Msg msg);
-  static void sendTimeSyncMsg(std::set<String> ids, bool isResponse = false);
-  static void receiveTimeSyncMsg(AF1Msg m);
-  static void sendAllTimeSyncMessages();
-  static void sendMsgWS(AF1Msg msg);
+  static void sendMsgESPNow(AF1Msg &msg);
+  static bool sendBroadcastESPNow(AF1Msg &msg);
+  static void sendBroadcastHeartbeat();
+  static bool receiveBroadcast(AF1Msg &m);
+  static void receiveBroadcastNack(AF1Msg &m);
+  static bool sendReliableESPNow(AF1Msg &msg, const PeerSet &recipients);
+  static PeerSet sendReliableFrames(const uint8_t *data, size_t len, const PeerSet &recipients, uint8_t maxRetries);
+  static void sendReliableWaiting();
+  static void receiveReliable(AF1Msg &m);
+  static void deliverReliable(peer_handle h);
+  static void serviceReliable();
+  static void pumpESPNow();
+  static void handleESPNowSent();
+  static void startTimeSync(const PeerSet &peers);
+  static void sendTimeSyncMsg(const PeerSet &peers);
+  static void receiveTimeSyncMsg(AF1Msg &m);
+  static void receiveTimeSyncBeacon(AF1Msg &m);
+  static void receiveTimeSyncReport(AF1Msg &m);
+  static void noteBeacon(uint16_t seq, time_us at);
+  static void sendMsgWS(AF1Msg &msg);
   static void connectToWS();
   static void connectToWifi();
   static int8_t scanForPeersESPNow();
   static void connectToPeers();
   static const std::vector<wifi_ap_info> getWifiAPs();
-  static unsigned long convertTime(String id, unsigned long t);
-  static std::set<String> getPeerIDs();
+  static time_us convertTime(peer_handle h, time_us t); // Peer's AF1Clock time to ours
   static void handleWebSocketEvent(WStype_t type, uint8_t *payload, size_t length);
 
-  static std::map<String, AF1Event> globalEventMap;
-  static std::map<String, af1_peer_info> peerInfoMap;
-  static std::map<String, String> macToIDMap;
+  static event_map globalEventMap;
+  static std::map<String, event_handle> globalEventNames;
+  static PeerRegistry peers;
   static WiFiUDP ntpUDP;
   static WebSocketsClient webSocketClient;
 
   void resetEvents();
   void activateEvents();
   void deactivateEvents();
+  static void rescheduleEvents();
+  static void idle();
+  static AF1Event *findEvent(event_handle h);
+  static event_handle findEvent(String name);
 
-  std::map<String, AF1Event> eventMap;
+  event_map eventMap;
+  std::map<String, event_handle> eventNames;
   ws_client_info wsClientInfo;
+  type_msg_handler *stateMsgHandlers; // Indexed by type; allocated on first use
 
 protected:
   static void handleInboxMsg(AF1Msg &m);
@@ -151,20 +167,35 @@ protected:
   static bool broadcastAP();
   static void handleHandshakes(bool resend = false);
   static void scheduleSyncStart();
+  static void sendAllTimeSyncMessages();
+  static void sendTimeSyncBeacon();
   static void initEspNow();
 
   static uint8_t macAP[6];
   static uint8_t macSTA[6];
-  static unsigned long syncStartTime;
+  static time_us syncStartTime;
 
 public:
   Base();
   static void begin(String id);
   static void update();
   static String macToString(const uint8_t *m);
+  static peer_handle getPeerHandle(String id); // PEER_NONE if unknown
+  static String getPeerId(peer_handle h);
   static void printMac(const uint8_t *m);
-  static void pushOutbox(AF1Msg m);
-  static void pushInbox(AF1Msg m);
+  static bool pushOutbox(const AF1Msg &m); // False if the message was dropped/rejected
+  static bool pushOutbox(AF1Msg &&m);
+  static bool pushInbox(const AF1Msg &m);
+  static bool pushInbox(AF1Msg &&m);
+  static void setInboxPolicy(box_policy p);
+  static void setOutboxPolicy(box_policy p);
+  static void setInboxDrain(box_drain d);
+  static void setOutboxDrain(box_drain d);
+  static void setInboxBudget(int maxMsgs, unsigned long maxUs);
+  static void setOutboxBudget(int maxMsgs, unsigned long maxUs);
+  static box_stats getInboxStats();
+  static box_stats getOutboxStats();
+  static void printBoxStats();
   static StaticJsonDocument<2048> httpGet(String url);
   static StaticJsonDocument<2048> httpPost(String url, JsonDocument &body);
   static void setBuiltinLED(bool on);
@@ -179,18 +210,32 @@ public:
   static Base *getCurStateEnt();
   static String getDeviceID();
   static void setIntervalTime(String e, unsigned long t);
+  static void setIntervalTime(event_handle h, unsigned long t);
   static void detach(bool detach);
   static void setDefaultWS(String host, String path, int port, String protocol = "", unsigned long reconnectMs = WS_RECONNECT_MS);
-  static void addEvent(AF1Event e);
+  static event_handle addEvent(AF1Event e); // Replaces an event with the same (non-empty) name, keeping its handle
   static void removeEvent(String eventName);
+  static void removeEvent(event_handle h);
+  static long getMsToNextEvent(); // -1 if no event is scheduled
+#if EVENT_STATS
+  static bool getEventStats(event_handle h, event_stats &s);
+  static void resetEventStats();
+  static void printEventStats();
+  static void sendEventStats(); // One TYPE_EVENT_STATS message per event, as many as the outbox takes; no histograms
+#endif
   static void addStateEnt(int i, Base *s);
   static void removeStateEnt(int i);
   static void addStringHandler(String s, string_input_handler h);
   static void removeStringHandler(String s);
+  static void addMsgHandler(uint8_t type, type_msg_handler h); // Replaces any handler for the type, built-in ones included
+  static void removeMsgHandler(uint8_t type);
+  static void setMsgWorker(uint8_t type, bool w); // Run the type's global handler on the worker task while it's running; state handlers are skipped
   static void addWifiAP(String s, String p);
   static void addWifiAP(String s, String p, int a, int b, int c, int d, int ga, int gb, int gc, int gd, int sa, int sb, int sc, int sd);
   static bool getIsMaster();
   static void setIsMaster(bool isMaster);
+  static void setGroup(uint8_t g); // Broadcasts are sent to, and taken from, this group only
+  static uint8_t getGroup();
   static void hexdump(const void *mem, uint32_t len, uint8_t cols = 16);
 
   static NTPClient timeClient;
@@ -205,6 +250,7 @@ public:
   virtual bool doConnectToWSServer();
   virtual void doSynced();
   virtual bool doSync();
+  virtual bool doIdle(); // With TICKLESS_IDLE; false if loop() must run every update()
   virtual void onConnectWSServer();
   virtual void onDisconnectWSServer();
   virtual void onConnectWifi();
@@ -213,6 +259,10 @@ public:
 
   unsigned long getStartMs();
   unsigned long getElapsedMs();
+  time_us getStartUs();
+  time_us getElapsedUs();
+  void addStateMsgHandler(uint8_t type, type_msg_handler h); // Only while this is the current state; runs after the global handler
+  void removeStateMsgHandler(uint8_t type);
   void setWS(String host, String path, int port, String protocol = "", unsigned long reconnectMs = WS_RECONNECT_MS);
 };
 
@@ -20,34 +20,52 @@
 #include <Arduino.h>
 
 #include "event.h"
+#include "scheduler.h"
 #include "stateEnt/virtual/base/base.h"
+#include "worker/worker.h"
 
-ECBArg::ECBArg(unsigned long e, unsigned long i, unsigned long s, start_time_type s2, unsigned long c, unsigned long m, String n, event_type t)
-    : name(n), curTime(e), cbCnt(c), maxCbCnt(m), intervalTime(i), startTime(s), startTimeType(s2), type(t) {}
+ECBArg::ECBArg(unsigned long e, unsigned long i, unsigned long s, start_time_type s2, unsigned long c, unsigned long m, const char *n, event_type t, event_handle h, unsigned long missed)
+    : nameStr(n), curTime(e), cbCnt(c), maxCbCnt(m), intervalTime(i), startTime(s), startTimeType(s2), type(t), handle(h), missedCnt(missed) {}
 
-AF1Event::AF1Event() : name(""), mode(MODE_INACTIVE), type(EVENT_TYPE_TEMP)
+// us per unit of the time base's unsigned long API
+static time_us unitUs(start_time_type t)
 {
-  cb = [](ECBArg a)
+  return t == START_EPOCH_SEC ? 1000000ULL : 1000ULL;
+}
+
+AF1Event::AF1Event() : intervalUs(0), cbCnt(0), startUs(0), startTimeType(START_STATE_MS), name(""), mode(MODE_INACTIVE), type(EVENT_TYPE_TEMP), handle(EVENT_NONE), catchup(CATCHUP_COALESCE), catchupLimit(0), phaseUs(0), worker(false)
+{
+#if EVENT_STATS
+  resetStats();
+#endif
+  cb = [](const ECBArg &a)
   { Serial.println("No event cb provided"); };
 }
 
 AF1Event::AF1Event(String n, event_cb c, event_type t, unsigned long i, unsigned long m, unsigned long s, start_time_type s2, event_mode m2, unsigned long c2)
-    : name(n), cb(c), type(t), intervalTime(i), maxCbCnt(m), startTime(s), startTimeType(s2), mode(m2), cbCnt(c2) {}
+    : name(n), cb(c), type(t), intervalUs(i * unitUs(s2)), maxCbCnt(m), startUs(s * unitUs(s2)), startTimeType(s2), mode(m2), cbCnt(c2), handle(EVENT_NONE), catchup(CATCHUP_COALESCE), catchupLimit(0), phaseUs(0), worker(false)
+{
+#if EVENT_STATS
+  resetStats();
+#endif
+}
 
 unsigned long AF1Event::getIntervalTime()
 {
-  return intervalTime;
+  return intervalUs / unitUs(startTimeType);
 }
 
 void AF1Event::setIntervalTime(unsigned long t)
 {
-  intervalTime = t;
+  intervalUs = t * unitUs(startTimeType);
+  changed();
 }
 
 void AF1Event::setIntervalTime(unsigned long t, unsigned long c)
 {
-  intervalTime = t;
+  intervalUs = t * unitUs(startTimeType);
   cbCnt = t > 0 ? c / t : 0;
+  changed();
 }
 
 unsigned long AF1Event::getCbCnt()
@@ -58,6 +76,7 @@ unsigned long AF1Event::getCbCnt()
 void AF1Event::setCbCnt(unsigned long c)
 {
   cbCnt = c;
+  changed();
 }
 
 String AF1Event::getName()
@@ -70,6 +89,16 @@ void AF1Event::setName(String n)
   name = n;
 }
 
+event_handle AF1Event::getHandle()
+{
+  return handle;
+}
+
+void AF1Event::setHandle(event_handle h)
+{
+  handle = h;
+}
+
 unsigned long AF1Event::getMaxCbCnt()
 {
   return maxCbCnt;
@@ -78,16 +107,18 @@ unsigned long AF1Event::getMaxCbCnt()
 void AF1Event::setMaxCbCnt(unsigned long c)
 {
   maxCbCnt = c;
+  changed();
 }
 
 unsigned long AF1Event::getStartTime()
 {
-  return startTime;
+  return startUs / unitUs(startTimeType);
 }
 
 void AF1Event::setStartTime(unsigned long t)
 {
-  startTime = t;
+  startUs = t * unitUs(startTimeType);
+  changed();
 }
 
 start_time_type AF1Event::getStartTimeType()
@@ -95,43 +126,197 @@ start_time_type AF1Event::getStartTimeType()
   return startTimeType;
 }
 
+void AF1Event::setCatchup(event_catchup c, unsigned long l)
+{
+  catchup = c;
+  catchupLimit = l;
+}
+
+event_catchup AF1Event::getCatchup()
+{
+  return catchup;
+}
+
 unsigned long AF1Event::getLastCbTime()
 {
-  return intervalTime * cbCnt + getStartTime();
+  return (intervalUs * cbCnt + startUs) / unitUs(startTimeType);
 }
 
 unsigned long AF1Event::getNextCbTime()
 {
-  return intervalTime ? getLastCbTime() + intervalTime : getStartTime();
+  return (intervalUs ? intervalUs * (cbCnt + 1) + startUs : startUs) / unitUs(startTimeType);
+}
+
+time_us AF1Event::getNextCbUs()
+{
+  time_us next = intervalUs ? intervalUs * (cbCnt + 1) + startUs : startUs;
+  return startTimeType == START_EPOCH_SEC ? next : next + phaseUs;
 }
 
 bool AF1Event::isTime(unsigned long curTime)
 {
-  return curTime >= getNextCbTime() && (!maxCbCnt || cbCnt < maxCbCnt);
+  return isTimeUs(curTime * unitUs(startTimeType));
+}
+
+bool AF1Event::isTimeUs(time_us curUs)
+{
+  return curUs >= getNextCbUs() && !isDone();
+}
+
+bool AF1Event::isDone()
+{
+  return maxCbCnt && cbCnt >= maxCbCnt;
+}
+
+time_us AF1Event::getNextCbDeviceUs()
+{
+  time_us now = AF1Clock::now();
+  time_us next = getNextCbUs();
+  switch (startTimeType)
+  {
+  case START_STATE_MS:
+    return Base::getCurStateEnt()->getStartUs() + next;
+  case START_DEVICE_MS:
+    return next;
+  case START_EPOCH_SEC:
+  {
+    // Whole seconds, and NTP may step the clock; re-check every second (every 10ms in the last one)
+    time_us cur = getCurUs();
+    if (next <= cur)
+    {
+      return now;
+    }
+    return now + (next - cur > 1000000 ? 1000000 : 10000);
+  }
+  default:
+    return now;
+  }
+}
+
+void AF1Event::setPhaseUs(unsigned long p)
+{
+  phaseUs = p;
+  changed();
+}
+
+unsigned long AF1Event::getPhaseUs()
+{
+  return phaseUs;
+}
+
+void AF1Event::fire(time_us curUs, unsigned long late, unsigned long missed)
+{
+#if EVENT_STATS
+  unsigned long cbStartUs = micros();
+#endif
+  ECBArg a(curUs / unitUs(startTimeType), getIntervalTime(), getStartTime(), startTimeType, cbCnt, maxCbCnt, name.c_str(), type, handle, missed);
+  if (!worker || !fireOnWorker(a))
+  {
+    cb(a);
+  }
+#if EVENT_STATS
+  recordStats(late, micros() - cbStartUs, missed);
+#endif
+}
+
+// The event may change or go away before the worker gets to it, so the callback and name go along as copies.
+// The name goes in the task itself, not a String, so handing over doesn't allocate
+bool AF1Event::fireOnWorker(const ECBArg &a)
+{
+  if (name.length() >= WORKER_EVENT_NAME_SIZE)
+  {
+    return false;
+  }
+  event_cb c = cb;
+  char n[WORKER_EVENT_NAME_SIZE];
+  memcpy(n, name.c_str(), name.length() + 1);
+  return Worker::post([c, a, n]()
+                      { c(ECBArg(a.curTime, a.intervalTime, a.startTime, a.startTimeType, a.cbCnt, a.maxCbCnt, n, a.type, a.handle, a.missedCnt)); });
+}
+
+void AF1Event::setWorker(bool w)
+{
+  worker = w;
+}
+
+bool AF1Event::getWorker()
+{
+  return worker;
 }
 
 bool AF1Event::cbIfTimeAndActive(unsigned long curTime)
 {
-  if (mode == MODE_ACTIVE && isTime(curTime))
+  return cbIfTimeAndActiveUs(curTime * unitUs(startTimeType));
+}
+
+bool AF1Event::cbIfTimeAndActiveUs(time_us curUs)
+{
+  if (mode == MODE_ACTIVE && isTimeUs(curUs))
   {
-    cb(ECBArg(curTime, intervalTime, startTime, startTimeType, cbCnt, maxCbCnt, name, type));
-    cbCnt = intervalTime > 0 ? curTime / intervalTime : startTime ? curTime / startTime
-                                                                  : 0; // Setting cbCnt to expected value rather than just incrementing; don't divide by 0
+    time_us lateUs = curUs - getNextCbUs();
+    unsigned long late = lateUs / unitUs(startTimeType);
+    unsigned long missed = intervalUs > 0 ? lateUs / intervalUs : 0;
+    switch (catchup)
+    {
+    case CATCHUP_SKIP:
+      if (catchupLimit && late > catchupLimit)
+      {
+#if EVENT_STATS
+        stats.missed += missed + 1;
+#endif
+        break;
+      }
+      fire(curUs, late, missed);
+      break;
+    case CATCHUP_BURST:
+    {
+      unsigned long replay = missed < catchupLimit ? missed : catchupLimit;
+      for (unsigned long i = 0; i < replay && !isDone(); i++)
+      {
+        fire(curUs, late, 0);
+        cbCnt++;
+      }
+      if (!isDone())
+      {
+        fire(curUs, late, missed - replay);
+      }
+    }
+    break;
+    default:
+      fire(curUs, late, missed);
+      break;
+    }
+    // Setting cbCnt to expected value rather than just incrementing; don't divide by 0
+    if (intervalUs > 0)
+    {
+      // Intervals since the start (phase included, as in getNextCbUs()), so the next is the first after now
+      time_us firstUs = startUs + (startTimeType == START_EPOCH_SEC ? 0 : phaseUs);
+      cbCnt = curUs > firstUs ? (curUs - firstUs) / intervalUs : 0;
+    }
+    else
+    {
+      cbCnt = startUs ? curUs / startUs : 0;
+    }
     return true;
   }
   return false;
 }
 
 unsigned long AF1Event::getCurTime()
+{
+  return getCurUs() / unitUs(startTimeType);
+}
+
+time_us AF1Event::getCurUs()
 {
   switch (startTimeType)
   {
   case START_EPOCH_SEC:
-    return Base::timeClient.isTimeSet() ? Base::timeClient.getEpochTime() : (Base::getCurStateEnt()->getElapsedMs() / 1000UL);
+    return Base::timeClient.isTimeSet() ? Base::timeClient.getEpochTime() * 1000000ULL : Base::getCurStateEnt()->getElapsedUs() / 1000000 * 1000000;
   case START_STATE_MS:
-    return Base::getCurStateEnt()->getElapsedMs();
+    return Base::getCurStateEnt()->getElapsedUs();
   case START_DEVICE_MS:
-    return millis();
+    return AF1Clock::now();
   default:
     return 0;
   }
@@ -139,7 +324,7 @@ unsigned long AF1Event::getCurTime()
 
 bool AF1Event::cbIfTimeAndActive()
 {
-  return cbIfTimeAndActive(getCurTime());
+  return cbIfTimeAndActiveUs(getCurUs());
 }
 
 event_type AF1Event::getType()
@@ -150,6 +335,7 @@ event_type AF1Event::getType()
 void AF1Event::setMode(event_mode m)
 {
   mode = m;
+  changed();
 }
 
 event_mode AF1Event::getMode()
@@ -157,22 +343,69 @@ event_mode AF1Event::getMode()
   return mode;
 }
 
+#if EVENT_STATS
+static int statsBucket(unsigned long v)
+{
+  int i = 0;
+  while (i < EVENT_STATS_BUCKETS - 1 && v >= (1UL << i))
+  {
+    i++;
+  }
+  return i;
+}
+
+void AF1Event::recordStats(unsigned long late, unsigned long durUs, unsigned long missed)
+{
+  stats.fires++;
+  stats.missed += missed;
+  stats.lateTotal += late;
+  stats.lateMax = preMax(stats.lateMax, late);
+  stats.lateHist[statsBucket(late)]++;
+  stats.durTotalUs += durUs;
+  stats.durMaxUs = preMax(stats.durMaxUs, durUs);
+  stats.durHist[statsBucket(durUs)]++;
+}
+
+const event_stats &AF1Event::getStats()
+{
+  return stats;
+}
+
+void AF1Event::resetStats()
+{
+  memset(&stats, 0, sizeof(stats));
+}
+#endif
+
 void AF1Event::reset()
 {
   cbCnt = 0;
+  changed();
+}
+
+// Events found through Base::findEvent() or an event map can be changed directly, so they put themselves back
+// on the schedule (or take themselves off it)
+void AF1Event::changed()
+{
+  if (link.scheduler != NULL)
+  {
+    link.scheduler->reschedule(this);
+  }
 }
 
 void AF1Event::activate()
 {
   mode = MODE_ACTIVE;
+  changed();
 }
 
 void AF1Event::deactivate()
 {
   mode = MODE_INACTIVE;
+  changed();
 }
 
-event_cb AF1Event::getCb()
+const event_cb &AF1Event::getCb()
 {
   return cb;
 }
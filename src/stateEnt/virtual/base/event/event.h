@@ -22,6 +22,13 @@
 
 #include <Arduino.h>
 
+#include "clock/clock.h"
+#include "inlineFn/inlineFn.h"
+#include "pre.h"
+
+typedef uint32_t event_handle;
+#define EVENT_NONE 0
+
 enum start_time_type
 {
   START_STATE_MS,
@@ -35,6 +42,14 @@ enum event_mode
   MODE_ACTIVE
 };
 
+// What a periodic event does when it fires more than one interval late
+enum event_catchup
+{
+  CATCHUP_COALESCE, // Fire once and realign; ECBArg::missedCnt says how many intervals were folded in
+  CATCHUP_SKIP,     // Like coalesce, but don't fire at all if later than the limit (0: no limit)
+  CATCHUP_BURST     // Fire once per missed interval, at most limit extra times per update; the rest are coalesced
+};
+
 enum event_type
 {
   EVENT_TYPE_PERM,
@@ -52,24 +67,71 @@ public:
   const unsigned long cbCnt;
   const unsigned long maxCbCnt;
   const event_type type;
-  const String name;
-  ECBArg(unsigned long e, unsigned long i, unsigned long s, start_time_type s2, unsigned long c, unsigned long m, String n, event_type t);
+  const char *nameStr; // Valid during the callback; compare with strcmp() (was String name)
+  const event_handle handle;
+  const unsigned long missedCnt; // Intervals skipped since the last callback
+  ECBArg(unsigned long e, unsigned long i, unsigned long s, start_time_type s2, unsigned long c, unsigned long m, const char *n, event_type t, event_handle h, unsigned long missed = 0);
 };
 
-typedef void (*event_cb)(ECBArg a);
+#if EVENT_STATS
+struct event_stats
+{
+  unsigned long fires;
+  unsigned long missed;    // Intervals skipped because the callback fired late
+  unsigned long lateMax;   // Behind getNextCbTime(), in the event's time unit (s for START_EPOCH_SEC, else ms)
+  unsigned long lateTotal;
+  unsigned long durMaxUs;  // Callback run time
+  unsigned long durTotalUs;
+  unsigned long lateHist[EVENT_STATS_BUCKETS];
+  unsigned long durHist[EVENT_STATS_BUCKETS]; // us
+};
+#endif
+
+// Any callable, captures included, up to EVENT_CB_SIZE bytes; stored inline
+typedef InlineFn<void(const ECBArg &), EVENT_CB_SIZE> event_cb;
+
+class EventScheduler;
 
+// The scheduler an event is registered with; copies start out unregistered, and assigning keeps the target's
+struct event_sched_link
+{
+  EventScheduler *scheduler;
+  event_sched_link() : scheduler(NULL) {}
+  event_sched_link(const event_sched_link &) : scheduler(NULL) {}
+  event_sched_link &operator=(const event_sched_link &) { return *this; }
+};
+
+/*
+  Times are kept in us internally (in the event's time base: state, device or epoch); the
+  unsigned long getters and setters take and return the event's time unit (s for
+  START_EPOCH_SEC, else ms).
+*/
 class AF1Event
 {
 private:
-  unsigned long intervalTime;
+  time_us intervalUs;
   unsigned long cbCnt;
-  unsigned long startTime;
+  time_us startUs;
   start_time_type startTimeType;
   String name;
   unsigned long maxCbCnt;
   event_type type;
   event_mode mode;
   event_cb cb;
+  event_handle handle;
+  event_catchup catchup;
+  unsigned long catchupLimit;
+  unsigned long phaseUs;
+  bool worker;
+  event_sched_link link; // Set by EventScheduler
+
+  void changed(); // Reschedules after a change to when it fires
+  void fire(time_us curUs, unsigned long late, unsigned long missed);
+  bool fireOnWorker(const ECBArg &a);
+#if EVENT_STATS
+  event_stats stats;
+  void recordStats(unsigned long late, unsigned long durUs, unsigned long missed);
+#endif
 
 public:
   AF1Event();
@@ -81,27 +143,48 @@ public:
   void setCbCnt(unsigned long c);
   String getName();
   void setName(String s);
+  event_handle getHandle();
+  void setHandle(event_handle h); // Set by Base::addEvent()
   unsigned long getMaxCbCnt();
   void setMaxCbCnt(unsigned long c);
   unsigned long getStartTime();
   void setStartTime(unsigned long s);
   void setCb(event_cb c);
-  event_cb getCb();
+  const event_cb &getCb();
   start_time_type getStartTimeType();
+  void setCatchup(event_catchup c, unsigned long limit = 0); // limit: max lateness (skip; event time unit) or extra callbacks (burst)
+  event_catchup getCatchup();
 
   unsigned long getLastCbTime();
   unsigned long getNextCbTime();
+  time_us getNextCbUs(); // In the event's time base, phase included
   bool isTime(unsigned long curTime);
+  bool isTimeUs(time_us curUs);
+  bool isDone(); // maxCbCnt reached
+  time_us getNextCbDeviceUs(); // getNextCbTime() + phase as AF1Clock time; an estimate for START_EPOCH_SEC
+  void setPhaseUs(unsigned long p); // Fires this much after each whole ms; for sub-ms alignment (not START_EPOCH_SEC)
+  unsigned long getPhaseUs();
+  void setWorker(bool w); // Run the callback on the worker task if it's running (on the loop if its queue is full or the name is WORKER_EVENT_NAME_SIZE or longer); stats then time the hand-off
+  bool getWorker();
   bool cbIfTimeAndActive(unsigned long curTime);
+  bool cbIfTimeAndActiveUs(time_us curUs);
   unsigned long getCurTime();
+  time_us getCurUs();
   bool cbIfTimeAndActive();
   void setMode(event_mode m);
   event_mode getMode();
   event_type getType();
 
+#if EVENT_STATS
+  const event_stats &getStats();
+  void resetStats();
+#endif
+
   void reset();
   void activate();
   void deactivate();
+
+  friend class EventScheduler;
 };
 
 #endif // STATEENT_BASE_EVENT_H_
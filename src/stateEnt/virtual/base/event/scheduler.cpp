@@ -0,0 +1,156 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <algorithm>
+
+#include "scheduler.h"
+
+bool EventScheduler::later(const entry &a, const entry &b)
+{
+  return a.deadline > b.deadline;
+}
+
+void EventScheduler::push(AF1Event *e, time_us deadline)
+{
+  entry en = {deadline, e};
+  heap.push_back(en);
+  std::push_heap(heap.begin(), heap.end(), later);
+}
+
+void EventScheduler::schedule(AF1Event *e)
+{
+  e->link.scheduler = this;
+  if (e->getMode() == MODE_ACTIVE && !e->isDone())
+  {
+    push(e, e->getNextCbDeviceUs());
+  }
+  else
+  {
+    dormant.push_back(e);
+  }
+}
+
+void EventScheduler::remove(AF1Event *e)
+{
+  size_t n = heap.size();
+  heap.erase(std::remove_if(heap.begin(), heap.end(), [e](const entry &en)
+                            { return en.event == e; }),
+             heap.end());
+  if (heap.size() != n)
+  {
+    std::make_heap(heap.begin(), heap.end(), later);
+  }
+  dormant.erase(std::remove(dormant.begin(), dormant.end(), e), dormant.end());
+  // May be called from a callback during run()
+  for (size_t i = 0; i < fired.size(); i++)
+  {
+    if (fired[i].event == e)
+    {
+      fired[i].event = NULL;
+    }
+  }
+}
+
+void EventScheduler::unschedule(AF1Event *e)
+{
+  remove(e);
+  e->link.scheduler = NULL;
+}
+
+void EventScheduler::reschedule(AF1Event *e)
+{
+  remove(e);
+  schedule(e);
+}
+
+void EventScheduler::clear()
+{
+  for (size_t i = 0; i < heap.size(); i++)
+  {
+    heap[i].event->link.scheduler = NULL;
+  }
+  for (size_t i = 0; i < dormant.size(); i++)
+  {
+    dormant[i]->link.scheduler = NULL;
+  }
+  for (size_t i = 0; i < fired.size(); i++)
+  {
+    if (fired[i].event != NULL)
+    {
+      fired[i].event->link.scheduler = NULL;
+      fired[i].event = NULL;
+    }
+  }
+  heap.clear();
+  dormant.clear();
+}
+
+void EventScheduler::run(time_us now)
+{
+  // Take all due entries first, so an event that is due again right away fires once per run()
+  fired.clear();
+  while (!heap.empty() && heap.front().deadline <= now)
+  {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    fired.push_back(heap.back());
+    heap.pop_back();
+  }
+
+  for (size_t i = 0; i < fired.size(); i++)
+  {
+    AF1Event *e = fired[i].event;
+    if (e == NULL)
+    {
+      continue; // Removed or rescheduled since it was taken
+    }
+    if (e->getMode() == MODE_ACTIVE)
+    {
+      e->cbIfTimeAndActive(); // Deadlines are estimates for non-device time bases; rechecked here
+    }
+    if (fired[i].event == NULL)
+    {
+      continue; // Its callback removed or changed it
+    }
+    if (e->getMode() != MODE_ACTIVE || e->isDone())
+    {
+      dormant.push_back(e);
+    }
+    else
+    {
+      time_us d = e->getNextCbDeviceUs();
+      push(e, d > now ? d : now + 1000); // Still due (e.g. no interval); again in 1ms
+    }
+  }
+  fired.clear();
+}
+
+bool EventScheduler::getNextDeadline(time_us &t)
+{
+  if (heap.empty())
+  {
+    return false;
+  }
+  t = heap.front().deadline;
+  return true;
+}
+
+size_t EventScheduler::size()
+{
+  return heap.size();
+}
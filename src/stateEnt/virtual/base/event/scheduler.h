@@ -0,0 +1,60 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef STATEENT_BASE_EVENT_SCHEDULER_H_
+#define STATEENT_BASE_EVENT_SCHEDULER_H_
+
+#include <Arduino.h>
+#include <vector>
+
+#include "event.h"
+
+/*
+  Min-heap of events keyed on their next callback time (AF1Clock), so each update() only
+  touches due events. Holds at most one entry per event; events must be unscheduled before
+  they are destroyed. Inactive and finished events are kept aside until a change to them
+  (activate(), setCbCnt(), ...) puts them back on the heap.
+*/
+class EventScheduler
+{
+  struct entry
+  {
+    time_us deadline;
+    AF1Event *event;
+  };
+
+  std::vector<entry> heap;
+  std::vector<entry> fired;       // Due entries of the current run(); reused
+  std::vector<AF1Event *> dormant; // Registered, but inactive or done
+
+  static bool later(const entry &a, const entry &b);
+  void push(AF1Event *e, time_us deadline);
+  void remove(AF1Event *e);
+
+public:
+  void schedule(AF1Event *e);
+  void unschedule(AF1Event *e);
+  void reschedule(AF1Event *e); // After a change to it; see AF1Event::changed()
+  void clear();
+  void run(time_us now);
+  bool getNextDeadline(time_us &t); // AF1Clock time; false if nothing is scheduled
+  size_t size();
+};
+
+#endif // STATEENT_BASE_EVENT_SCHEDULER_H_
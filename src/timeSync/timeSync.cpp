@@ -0,0 +1,213 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <math.h>
+
+#include "timeSync.h"
+
+TimeSync::TimeSync()
+{
+  reset();
+}
+
+void TimeSync::reset()
+{
+  cnt = 0;
+  next = 0;
+  inRound = false;
+  burst = 0;
+  refUs = 0;
+  offsetUs = 0;
+  skew = 0;
+  intervalMs = MS_TIME_SYNC;
+  lastRoundUs = 0;
+  errorUs = 0;
+}
+
+bool TimeSync::addSample(time_us t1, time_us t2, time_us t3, time_us t4)
+{
+  if (t4 < t1 || t3 < t2 || t4 - t1 < t3 - t2)
+  {
+    return false;
+  }
+  time_sync_sample s;
+  s.atUs = t1 + (t4 - t1) / 2;
+  s.offsetUs = ((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2;
+  s.rttUs = (t4 - t1) - (t3 - t2);
+  if (!inRound || s.rttUs < round.rttUs)
+  {
+    round = s;
+  }
+  inRound = true;
+  return true;
+}
+
+void TimeSync::addOffset(time_us at, int64_t o)
+{
+  round.atUs = at;
+  round.offsetUs = o;
+  round.rttUs = 0;
+  inRound = true;
+  finishRound();
+}
+
+void TimeSync::finishRound()
+{
+  if (!inRound)
+  {
+    return;
+  }
+  inRound = false;
+
+  if (cnt)
+  {
+    // Beyond what the round's own uncertainty (rtt / 2) explains
+    int64_t e = round.offsetUs - getOffsetUs(round.atUs);
+    e = e < 0 ? -e : e;
+    errorUs = (time_us)e > round.rttUs / 2 ? e - round.rttUs / 2 : 0;
+    if (errorUs > TIME_SYNC_TARGET_US)
+    {
+      intervalMs = intervalMs / 2 > MS_TIME_SYNC_MIN ? intervalMs / 2 : MS_TIME_SYNC_MIN;
+    }
+    else if (errorUs < TIME_SYNC_TARGET_US / 2 && cnt > 1)
+    {
+      intervalMs = intervalMs * 2 < MS_TIME_SYNC_MAX ? intervalMs * 2 : MS_TIME_SYNC_MAX;
+    }
+  }
+
+  if (errorUs > TIME_SYNC_RESET_US)
+  {
+    cnt = 0; // Peer restarted (or we missed a clock step); the old rounds are from another timeline
+    next = 0;
+  }
+
+  samples[next] = round;
+  next = (next + 1) % TIME_SYNC_WINDOW;
+  if (cnt < TIME_SYNC_WINDOW)
+  {
+    cnt++;
+  }
+  fit();
+}
+
+// Least squares, relative to the latest round so the numbers stay small. A round's error is up to rtt / 2,
+// so it's weighted by 1 / rtt^2: a round whose every exchange sat in a queue barely moves the line
+void TimeSync::fit()
+{
+  refUs = round.atUs;
+  double w[TIME_SYNC_WINDOW];
+  double sw = 0, mx = 0, my = 0;
+  for (uint8_t i = 0; i < cnt; i++)
+  {
+    double r = (double)samples[i].rttUs + TIME_SYNC_TARGET_US; // Beacon rounds (rtt 0) weigh the same
+    w[i] = 1 / (r * r);
+    sw += w[i];
+    mx += w[i] * (double)(int64_t)(samples[i].atUs - refUs);
+    my += w[i] * (double)samples[i].offsetUs;
+  }
+  mx /= sw;
+  my /= sw;
+  double sxy = 0, sxx = 0;
+  for (uint8_t i = 0; i < cnt; i++)
+  {
+    double dx = (double)(int64_t)(samples[i].atUs - refUs) - mx;
+    sxy += w[i] * dx * ((double)samples[i].offsetUs - my);
+    sxx += w[i] * dx * dx;
+  }
+  skew = sxx > 0 ? sxy / sxx : 0;
+  if (skew > TIME_SYNC_MAX_PPM / 1e6 || skew < -TIME_SYNC_MAX_PPM / 1e6)
+  {
+    skew = 0; // Not a crystal; more likely a restarted peer or a bad sample
+  }
+  offsetUs = llround(my - skew * mx);
+}
+
+bool TimeSync::isSynced()
+{
+  return cnt > 0;
+}
+
+uint8_t TimeSync::getSampleCnt()
+{
+  return cnt;
+}
+
+int64_t TimeSync::getOffsetUs()
+{
+  return getOffsetUs(AF1Clock::now());
+}
+
+int64_t TimeSync::getOffsetUs(time_us at)
+{
+  return offsetUs + (int64_t)(skew * (double)(int64_t)(at - refUs));
+}
+
+time_us TimeSync::getRttUs()
+{
+  return cnt ? samples[(next + TIME_SYNC_WINDOW - 1) % TIME_SYNC_WINDOW].rttUs : 0;
+}
+
+double TimeSync::getSkewPpm()
+{
+  return skew * 1e6;
+}
+
+time_us TimeSync::getErrorUs()
+{
+  return errorUs;
+}
+
+time_us TimeSync::toLocal(time_us t)
+{
+  // The offset depends on our time, which is what we're after; one step is plenty at crystal skews
+  return t - getOffsetUs(t - offsetUs);
+}
+
+time_us TimeSync::toPeer(time_us t)
+{
+  return t + getOffsetUs(t);
+}
+
+void TimeSync::startBurst(uint8_t n)
+{
+  finishRound();
+  burst = n;
+  lastRoundUs = AF1Clock::now();
+}
+
+bool TimeSync::takeBurst()
+{
+  if (!burst)
+  {
+    finishRound();
+    return false;
+  }
+  burst--;
+  return true;
+}
+
+unsigned long TimeSync::getIntervalMs()
+{
+  return intervalMs;
+}
+
+bool TimeSync::isDue(time_us now)
+{
+  return !cnt || now - lastRoundUs >= intervalMs * 1000ULL;
+}
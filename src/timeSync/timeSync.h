@@ -0,0 +1,92 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef TIME_SYNC_TIME_SYNC_H_
+#define TIME_SYNC_TIME_SYNC_H_
+
+#include <Arduino.h>
+
+#include "clock/clock.h"
+#include "pre.h"
+
+struct time_sync_sample
+{
+  time_us atUs;     // Our clock, halfway through the exchange
+  int64_t offsetUs; // Peer clock minus ours
+  time_us rttUs;    // Round trip, less the peer's turnaround
+};
+
+/*
+  Clock offset and drift to one peer, NTP style. Each exchange gives four timestamps: t1 our send, t2 the peer's
+  receive, t3 the peer's send, t4 our receive. Then offset = ((t2 - t1) + (t3 - t4)) / 2 and rtt = (t4 - t1) - (t3 - t2).
+  The offset is exact when both directions take equally long, and the error is at most rtt / 2.
+
+  Exchanges come in rounds (bursts); a round's sample with the smallest rtt is kept. The offset is then fitted as a
+  line (least squares, each round weighted by 1 / rtt^2) over the last TIME_SYNC_WINDOW rounds, so conversions account for the crystals' rate
+  difference too. How far each new round lands from the line sets when the next one is due.
+*/
+class TimeSync
+{
+  time_sync_sample samples[TIME_SYNC_WINDOW];
+  uint8_t cnt;
+  uint8_t next;
+  time_sync_sample round; // Best of the current round
+  bool inRound;
+  uint8_t burst;
+
+  // offset(t) = offsetUs + skew * (t - refUs)
+  time_us refUs;
+  int64_t offsetUs;
+  double skew;
+
+  unsigned long intervalMs;
+  time_us lastRoundUs;
+  time_us errorUs;
+
+  void finishRound();
+  void fit();
+
+public:
+  TimeSync();
+  void reset();
+  bool addSample(time_us t1, time_us t2, time_us t3, time_us t4); // False (and ignored) if the timestamps don't add up
+  void addOffset(time_us at, int64_t offsetUs); // A measured offset (e.g. from a broadcast beacon); a round on its own
+  bool isSynced();
+  uint8_t getSampleCnt(); // Rounds in the fit
+  int64_t getOffsetUs();  // Now
+  int64_t getOffsetUs(time_us at);
+  time_us getRttUs();     // Of the latest round
+  double getSkewPpm();    // How much faster the peer's clock runs
+  time_us getErrorUs();   // The latest round's distance from the previous fit
+  time_us toLocal(time_us t); // Peer time to ours
+  time_us toPeer(time_us t);
+  void startBurst(uint8_t n); // Starts a round; n more exchanges to do back to back
+  bool takeBurst();           // True if another exchange is due; else the round is over
+  unsigned long getIntervalMs(); // Until the next round; adapts between MS_TIME_SYNC_MIN and MS_TIME_SYNC_MAX
+  bool isDue(time_us now);
+};
+
+// When a broadcast beacon was in the air, by our clock (TIME_SYNC_BROADCAST)
+struct time_sync_beacon
+{
+  uint16_t seq;
+  time_us atUs; // 0 if unused
+};
+
+#endif // TIME_SYNC_TIME_SYNC_H_
@@ -27,6 +27,7 @@
 #include <queue>
 #include <mutex>
 #include <condition_variable>
+#include <utility>
 
 // A threadsafe-queue.
 template <class T>
@@ -43,13 +44,20 @@ public:
   }
 
   // Add an element to the queue.
-  void enqueue(T t)
+  void enqueue(const T &t)
   {
     std::lock_guard<std::mutex> lock(m);
     q.push(t);
     c.notify_one();
   }
 
+  void enqueue(T &&t)
+  {
+    std::lock_guard<std::mutex> lock(m);
+    q.push(std::move(t));
+    c.notify_one();
+  }
+
   // Get the "front"-element.
   // If the queue is empty, wait till a element is avaiable.
   T dequeue(void)
@@ -60,7 +68,7 @@ public:
       // release lock as long as the wait and reaquire it afterwards.
       c.wait(lock);
     }
-    T val = q.front();
+    T val = std::move(q.front());
     q.pop();
     return val;
   }
@@ -0,0 +1,243 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "txQueue.h"
+
+tx_frame TxQueue::frames[TX_FRAMES_TOTAL];
+tx_stats TxQueue::stats;
+int TxQueue::queued;
+int TxQueue::inUse[TX_FRAME_KINDS];
+
+// Set aside for each kind; beyond that, kinds take from the ESPNOW_TX_FRAMES everyone shares
+static const int own[TX_FRAME_KINDS] = {0, 0, MAX_PEERS * RELIABLE_WINDOW, ESPNOW_BCAST_HISTORY + 1};
+
+TxQueue::TxQueue()
+{
+  head = 0;
+  cnt = 0;
+  inFlight = 0;
+  nextTag = 0;
+  late = 0;
+  lastSendUs = 0;
+}
+
+bool TxQueue::push(const tx_entry &e)
+{
+  if (cnt >= ESPNOW_TX_QUEUE)
+  {
+    return false;
+  }
+  entries[(head + cnt) % ESPNOW_TX_QUEUE] = e;
+  cnt++;
+  queued++;
+  return true;
+}
+
+void TxQueue::pop()
+{
+  head = (head + 1) % ESPNOW_TX_QUEUE;
+  cnt--;
+  queued--;
+}
+
+bool TxQueue::push(tx_frame *f, uint8_t maxRetries)
+{
+  tx_entry e = {f, 0, maxRetries, 0};
+  if (!push(e))
+  {
+    stats.dropped++;
+    return false;
+  }
+  f->refs++;
+  return true;
+}
+
+tx_entry *TxQueue::next()
+{
+  if (inFlight >= cnt || inFlight >= ESPNOW_TX_WINDOW)
+  {
+    return NULL;
+  }
+  return &entries[(head + inFlight) % ESPNOW_TX_QUEUE];
+}
+
+void TxQueue::sent(time_us now)
+{
+  tx_entry &e = entries[(head + inFlight) % ESPNOW_TX_QUEUE];
+  e.sends++;
+  e.tag = nextTag++;
+  inFlight++;
+  lastSendUs = now;
+  stats.sent++;
+}
+
+void TxQueue::drop()
+{
+  if (inFlight || !cnt)
+  {
+    return;
+  }
+  releaseFrame(entries[head].frame);
+  pop();
+  stats.dropped++;
+}
+
+void TxQueue::complete(uint8_t tag, bool ok)
+{
+  while (inFlight)
+  {
+    int8_t d = tag - entries[head].tag;
+    if (d < 0)
+    {
+      if (late)
+      {
+        late--; // For a frame that already timed out
+        return;
+      }
+      // Nothing is late, so the completion count fell behind ours (completions that
+      // couldn't be matched to a peer); catch our in-flight tags up to it
+      for (uint8_t i = 0; i < inFlight; i++)
+      {
+        entries[(head + i) % ESPNOW_TX_QUEUE].tag += d;
+      }
+      nextTag += d;
+      d = 0;
+    }
+    if (d == 0)
+    {
+      finish(ok);
+      return;
+    }
+    finish(false); // Its completion was lost
+  }
+  if (late)
+  {
+    late--;
+  }
+}
+
+void TxQueue::finish(bool ok)
+{
+  tx_entry e = entries[head];
+  pop();
+  inFlight--;
+  if (ok)
+  {
+    releaseFrame(e.frame);
+    return;
+  }
+  stats.failed++;
+  if (e.sends <= e.maxRetries && push(e))
+  {
+    stats.retried++;
+    return;
+  }
+  releaseFrame(e.frame);
+  stats.dropped++;
+}
+
+void TxQueue::expire(time_us now)
+{
+  if (inFlight && now - lastSendUs > (time_us)ESPNOW_TX_TIMEOUT_MS * 1000)
+  {
+    stats.timedOut++;
+    finish(false);
+    if (late < 255)
+    {
+      late++;
+    }
+    lastSendUs = now; // The rest of the window gets its own timeout
+  }
+}
+
+time_us TxQueue::getExpiryUs()
+{
+  return inFlight ? lastSendUs + (time_us)ESPNOW_TX_TIMEOUT_MS * 1000 + 1 : 0;
+}
+
+uint8_t TxQueue::size()
+{
+  return cnt;
+}
+
+uint8_t TxQueue::getInFlight()
+{
+  return inFlight;
+}
+
+int TxQueue::getFramesFree(tx_frame_kind k)
+{
+  int shared = ESPNOW_TX_FRAMES;
+  for (int i = 0; i < TX_FRAME_KINDS; i++)
+  {
+    if (inUse[i] > own[i])
+    {
+      shared -= inUse[i] - own[i];
+    }
+  }
+  if (k == TX_FRAME_QUEUED)
+  {
+    shared -= ESPNOW_TX_FRAMES_RESERVE;
+  }
+  return (inUse[k] < own[k] ? own[k] - inUse[k] : 0) + (shared > 0 ? shared : 0);
+}
+
+tx_frame *TxQueue::newFrame(const uint8_t *data, size_t len, tx_frame_kind k)
+{
+  if (len > ESPNOW_FRAME_SIZE || getFramesFree(k) == 0)
+  {
+    return NULL;
+  }
+  for (int i = 0; i < TX_FRAMES_TOTAL; i++)
+  {
+    if (frames[i].refs == 0)
+    {
+      memcpy(frames[i].data, data, len);
+      frames[i].len = len;
+      frames[i].refs = 1;
+      frames[i].kind = k;
+      inUse[k]++;
+      return &frames[i];
+    }
+  }
+  return NULL;
+}
+
+void TxQueue::releaseFrame(tx_frame *f)
+{
+  if (--f->refs == 0)
+  {
+    inUse[f->kind]--;
+  }
+}
+
+bool TxQueue::hasPending()
+{
+  return queued > 0;
+}
+
+tx_stats TxQueue::getStats()
+{
+  return stats;
+}
+
+void TxQueue::noteDropped()
+{
+  stats.dropped++;
+}
@@ -0,0 +1,123 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef TX_QUEUE_TX_QUEUE_H_
+#define TX_QUEUE_TX_QUEUE_H_
+
+#include <Arduino.h>
+
+#include "clock/clock.h"
+#include "peer/handle.h"
+#include "pre.h"
+
+// What a frame is for. Reliable and broadcast frames have their own, so they're never short
+// while their windows have room; the rest share ESPNOW_TX_FRAMES.
+enum tx_frame_kind
+{
+  TX_FRAME_QUEUED,    // Plain unicast
+  TX_FRAME_CONTROL,   // PRIORITY_HIGH unicast; may also take the ESPNOW_TX_FRAMES_RESERVE
+  TX_FRAME_RELIABLE,  // Up to RELIABLE_WINDOW per peer, kept until acked
+  TX_FRAME_BROADCAST, // ESPNOW_BCAST_HISTORY kept for repairs, and the one being sent
+  TX_FRAME_KINDS
+};
+
+#define TX_FRAMES_TOTAL (ESPNOW_TX_FRAMES + MAX_PEERS * RELIABLE_WINDOW + ESPNOW_BCAST_HISTORY + 1)
+
+// An encoded ESP-Now frame, shared by every recipient queue holding it
+struct tx_frame
+{
+  uint8_t data[ESPNOW_FRAME_SIZE]; // Static, so sending never falls back to the heap
+  uint16_t len;
+  uint8_t refs;
+  uint8_t kind;
+};
+
+struct tx_entry
+{
+  tx_frame *frame;
+  uint8_t sends;
+  uint8_t maxRetries;
+  uint8_t tag; // Of the latest send
+};
+
+// A send completion, from onESPNowDataSent() to the loop
+struct tx_done
+{
+  peer_handle peer;
+  uint8_t tag; // Counts completions per peer, as TxQueue counts sends
+  bool ok;
+};
+
+struct tx_stats
+{
+  unsigned long sent;     // Handed to the driver, retries included
+  unsigned long failed;   // Completions reporting no ack
+  unsigned long retried;  // Failures queued again
+  unsigned long dropped;  // Given up on: out of retries, queue or frames full, or a send error
+  unsigned long timedOut; // In flight without a completion for ESPNOW_TX_TIMEOUT_MS
+};
+
+/*
+  Frames queued for one peer. Up to ESPNOW_TX_WINDOW of them are in flight (sent, awaiting their
+  completion callback) at once. ESP-Now reports completions per peer in send order, and each send
+  and each completion is numbered, so a completion is matched to its frame by tag: one arriving
+  after its frame timed out is ignored, and one that skips ahead fails the frames whose completions
+  were lost. A failed frame with retries left goes to the back of the queue. Loop task only;
+  completions reach it through Base's tx_done ring.
+*/
+class TxQueue
+{
+  tx_entry entries[ESPNOW_TX_QUEUE];
+  uint8_t head;
+  uint8_t cnt;
+  uint8_t inFlight;
+  uint8_t nextTag;
+  uint8_t late; // Timed out frames whose completions may still arrive
+  time_us lastSendUs;
+
+  static tx_frame frames[TX_FRAMES_TOTAL];
+  static tx_stats stats;
+  static int queued; // Across all peers
+  static int inUse[TX_FRAME_KINDS];
+
+  bool push(const tx_entry &e);
+  void pop();
+  void finish(bool ok);
+
+public:
+  TxQueue();
+  bool push(tx_frame *f, uint8_t maxRetries); // Takes a reference to f; false if full
+  tx_entry *next();                           // The next frame to send, if the window has room
+  void sent(time_us now);                     // next() went to the driver
+  void drop();                                // next() can't be sent; only when nothing is in flight
+  void complete(uint8_t tag, bool ok);        // The frame sent with tag is done
+  void expire(time_us now);                   // Fails the oldest frame in flight if its completion is overdue
+  time_us getExpiryUs();                      // When expire() would fail it; 0 if nothing is in flight
+  uint8_t size();
+  uint8_t getInFlight();
+
+  static tx_frame *newFrame(const uint8_t *data, size_t len, tx_frame_kind k); // One reference, for the caller; NULL if k has none left or len is too big
+  static int getFramesFree(tx_frame_kind k);
+  static void releaseFrame(tx_frame *f);
+  static bool hasPending(); // Any peer has frames queued
+  static tx_stats getStats();
+  static void noteDropped();
+};
+
+#endif // TX_QUEUE_TX_QUEUE_H_
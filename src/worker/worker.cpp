@@ -0,0 +1,200 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#ifndef ESP32
+#include <thread>
+#endif
+
+#include "worker.h"
+#include "ringBuffer/ringBuffer.h"
+
+static RingBuffer<worker_task> tasks(WORKER_QUEUE_SIZE);
+static RingBuffer<worker_task> loopTasks(WORKER_QUEUE_SIZE);
+static const size_t boxCapacity[PRIORITY_CNT] = {WORKER_BOX_CAPACITY, WORKER_BOX_CAPACITY, WORKER_BOX_CAPACITY};
+static Box box(boxCapacity, WORKER_POLICY);
+
+static std::atomic<bool> running(false);
+static thread_local bool onWorker = false;
+
+static std::mutex waitMutex;
+static std::condition_variable waitCv;
+static std::atomic<bool> waiting(false);
+static std::atomic<bool> pushed(false);
+
+static std::atomic<unsigned long> posted(0);
+static std::atomic<unsigned long> full(0);
+static std::atomic<unsigned long> ran(0);
+static std::atomic<unsigned long> loopPosted(0);
+static std::atomic<unsigned long> loopFull(0);
+static std::atomic<unsigned long> loopRan(0);
+
+bool Worker::begin(int core)
+{
+  bool expected = false;
+  if (!running.compare_exchange_strong(expected, true))
+  {
+    return false;
+  }
+#ifdef ESP32
+  TaskHandle_t h;
+  if (xTaskCreatePinnedToCore(run, "AF1Worker", WORKER_STACK_SIZE, NULL, WORKER_PRIORITY, &h, core) != pdPASS)
+  {
+    Serial.println("Worker task creation failed");
+    running = false;
+    return false;
+  }
+#else
+  std::thread(run, (void *)NULL).detach();
+#endif
+  Serial.printf("Worker started on core %d\n", core);
+  return true;
+}
+
+void Worker::run(void *arg)
+{
+  onWorker = true;
+  while (true)
+  {
+    pushed = false;
+    // At most one queue's worth of tasks per pass, so messages aren't starved
+    int n = 0;
+    while (n < WORKER_QUEUE_SIZE && tasks.consume([](worker_task &t)
+                                                  { t(); }))
+    {
+      n++;
+    }
+    ran += n;
+    n += box.handleMessages();
+    if (n == 0)
+    {
+      std::unique_lock<std::mutex> l(waitMutex);
+      waiting = true;
+      waitCv.wait_for(l, std::chrono::milliseconds(WORKER_WAIT_MS), []
+                      { return pushed.load(); });
+      waiting = false;
+    }
+  }
+}
+
+void Worker::notify()
+{
+  pushed = true;
+  if (waiting)
+  {
+    std::lock_guard<std::mutex> l(waitMutex);
+    waitCv.notify_all();
+  }
+}
+
+bool Worker::isRunning()
+{
+  return running;
+}
+
+bool Worker::isWorker()
+{
+  return onWorker;
+}
+
+bool Worker::post(const worker_task &t)
+{
+  if (!running)
+  {
+    return false;
+  }
+  if (!tasks.enqueue(t))
+  {
+    full++;
+    return false;
+  }
+  posted++;
+  notify();
+  return true;
+}
+
+bool Worker::pushMsg(AF1Msg &&m)
+{
+  if (!running || !box.push(std::move(m)))
+  {
+    return false;
+  }
+  notify();
+  return true;
+}
+
+void Worker::setMsgHandler(msg_handler h)
+{
+  box.setMsgHandler(h);
+}
+
+bool Worker::runOnLoop(const worker_task &t)
+{
+  if (!loopTasks.enqueue(t))
+  {
+    loopFull++;
+    return false;
+  }
+  loopPosted++;
+  Box::notify(); // Wakes the loop from a tickless idle
+  return true;
+}
+
+int Worker::handleLoopTasks()
+{
+  // Only what's queued now; tasks that queue more run next time
+  int n = 0;
+  int max = loopTasks.size();
+  while (n < max && loopTasks.consume([](worker_task &t)
+                                      { t(); }))
+  {
+    n++;
+  }
+  loopRan += n;
+  return n;
+}
+
+bool Worker::hasLoopTasks()
+{
+  return !loopTasks.empty();
+}
+
+worker_stats Worker::getStats()
+{
+  worker_stats s;
+  s.posted = posted;
+  s.full = full;
+  s.ran = ran;
+  s.loopPosted = loopPosted;
+  s.loopFull = loopFull;
+  s.loopRan = loopRan;
+  return s;
+}
+
+box_stats Worker::getBoxStats()
+{
+  return box.getStats();
+}
+
+int Worker::getBoxSize()
+{
+  return box.size();
+}
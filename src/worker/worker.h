@@ -0,0 +1,68 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef WORKER_WORKER_H_
+#define WORKER_WORKER_H_
+
+#include <Arduino.h>
+
+#include "box/box.h"
+#include "inlineFn/inlineFn.h"
+#include "pre.h"
+
+// Any callable, captures included, up to WORKER_TASK_SIZE bytes; stored inline
+typedef InlineFn<void(), WORKER_TASK_SIZE> worker_task;
+
+struct worker_stats
+{
+  unsigned long posted;     // Tasks queued for the worker
+  unsigned long full;       // post() calls refused by a full queue
+  unsigned long ran;        // Tasks run on the worker
+  unsigned long loopPosted; // Tasks queued back to the loop
+  unsigned long loopFull;
+  unsigned long loopRan;
+};
+
+/*
+  An optional second task (pinned to a core on ESP32; a std::thread elsewhere) for work handed over by the loop.
+  Both directions go through lock-free rings, so neither side blocks on the other.
+  Work on the worker must not touch loop-owned state (events, states, peers) directly; hand it back with runOnLoop().
+  pushInbox()/pushOutbox() are safe from either side.
+*/
+class Worker
+{
+  static void run(void *arg);
+  static void notify();
+
+public:
+  static bool begin(int core = WORKER_CORE); // False if already running or the task couldn't be created
+  static bool isRunning();
+  static bool isWorker(); // True on the worker itself
+  static bool post(const worker_task &t); // False if not running or the queue is full; run it yourself then
+  static bool pushMsg(AF1Msg &&m); // Handled on the worker by the setMsgHandler() handler; false if not queued
+  static void setMsgHandler(msg_handler h);
+  static bool runOnLoop(const worker_task &t); // Runs at the next update(); false if the queue is full
+  static int handleLoopTasks(); // Called by Base::update(); returns the number run
+  static bool hasLoopTasks();
+  static worker_stats getStats();
+  static box_stats getBoxStats();
+  static int getBoxSize();
+};
+
+#endif // WORKER_WORKER_H_
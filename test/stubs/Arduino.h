@@ -0,0 +1,166 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef TEST_STUBS_ARDUINO_H_
+#define TEST_STUBS_ARDUINO_H_
+
+// Just enough of the Arduino core for the native test env; time only moves when a test moves it
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#define HEX 16
+#define OUTPUT 1
+
+class String
+{
+public:
+  std::string s;
+  String() {}
+  String(const char *c) : s(c ? c : "") {}
+  String(const std::string &x) : s(x) {}
+  explicit String(int v) : s(std::to_string(v)) {}
+  explicit String(unsigned v) : s(std::to_string(v)) {}
+  explicit String(long v) : s(std::to_string(v)) {}
+  explicit String(unsigned long v) : s(std::to_string(v)) {}
+  explicit String(long long v) : s(std::to_string(v)) {}
+  explicit String(unsigned long long v) : s(std::to_string(v)) {}
+  explicit String(double v) : s(std::to_string(v)) {}
+  explicit String(char c) : s(1, c) {}
+  unsigned int length() const { return s.size(); }
+  const char *c_str() const { return s.c_str(); }
+  String substring(unsigned a) const { return s.substr(a); }
+  String substring(unsigned a, unsigned b) const { return s.substr(a, b - a); }
+  int indexOf(const char *x) const
+  {
+    size_t p = s.find(x);
+    return p == std::string::npos ? -1 : (int)p;
+  }
+  int indexOf(const String &x) const { return indexOf(x.c_str()); }
+  void toLowerCase() {}
+  long toInt() const { return atol(s.c_str()); }
+  bool reserve(unsigned n)
+  {
+    s.reserve(n);
+    return true;
+  }
+  char operator[](unsigned i) const { return s[i]; }
+  bool concat(const char *o)
+  {
+    s += o;
+    return true;
+  }
+  bool concat(const String &o) { return concat(o.c_str()); }
+  String &operator+=(const String &o)
+  {
+    s += o.s;
+    return *this;
+  }
+  String &operator+=(const char *o)
+  {
+    s += o;
+    return *this;
+  }
+  String &operator+=(char o)
+  {
+    s += o;
+    return *this;
+  }
+  bool operator==(const String &o) const { return s == o.s; }
+  bool operator==(const char *o) const { return s == o; }
+  bool operator!=(const String &o) const { return s != o.s; }
+  bool operator<(const String &o) const { return s < o.s; }
+  bool equals(const String &o) const { return s == o.s; }
+};
+
+// ArduinoJson's String adapter names it
+class StringSumHelper : public String
+{
+public:
+  StringSumHelper(const String &s) : String(s) {}
+};
+
+inline StringSumHelper operator+(const String &a, const String &b) { return String(a.s + b.s); }
+inline StringSumHelper operator+(const String &a, const char *b) { return String(a.s + b); }
+inline StringSumHelper operator+(const char *a, const String &b) { return String(a + b.s); }
+
+class Print
+{
+public:
+  template <class T>
+  size_t print(const T &) { return 0; }
+  template <class T>
+  size_t print(const T &, int) { return 0; }
+  template <class T>
+  size_t println(const T &) { return 0; }
+  template <class T>
+  size_t println(const T &, int) { return 0; }
+  size_t println() { return 0; }
+  size_t printf(const char *, ...) { return 0; }
+  size_t write(const uint8_t *, size_t) { return 0; }
+};
+
+class HardwareSerial : public Print
+{
+public:
+  int available() { return 0; }
+  String readString() { return ""; }
+  void begin(int) {}
+  void setTimeout(int) {}
+};
+
+extern HardwareSerial Serial; // Defined in nativeStubs.h
+
+// The test clock; see setMicros()/advanceMicros() in nativeStubs.h. Atomic, as the worker reads it too
+inline std::atomic<uint32_t> &fakeMicros()
+{
+  static std::atomic<uint32_t> us(0);
+  return us;
+}
+
+inline unsigned long micros() { return fakeMicros(); }
+inline unsigned long millis() { return fakeMicros() / 1000; }
+inline void delay(unsigned long ms) { fakeMicros() += ms * 1000; }
+inline void delayMicroseconds(unsigned int us) { fakeMicros() += us; }
+inline long random(long m) { return m > 0 ? rand() % m : 0; }
+inline void pinMode(int, int) {}
+inline void digitalWrite(int, int) {}
+
+class EspClass
+{
+public:
+  void restart() {}
+  uint32_t getFreeHeap() { return 0; }
+};
+
+extern EspClass ESP; // Defined in nativeStubs.h
+
+class IPAddress
+{
+public:
+  IPAddress() {}
+  IPAddress(int, int, int, int) {}
+};
+
+#endif // TEST_STUBS_ARDUINO_H_
@@ -0,0 +1,37 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef TEST_STUBS_HTTP_CLIENT_H_
+#define TEST_STUBS_HTTP_CLIENT_H_
+
+#include <Arduino.h>
+
+class HTTPClient
+{
+public:
+  void begin(String) {}
+  int GET() { return 0; }
+  int POST(String) { return 0; }
+  String getString() { return ""; }
+  void end() {}
+  void addHeader(const char *, const char *) {}
+  String errorToString(int) { return ""; }
+};
+
+#endif // TEST_STUBS_HTTP_CLIENT_H_
@@ -0,0 +1,38 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef TEST_STUBS_WIFI_H_
+#define TEST_STUBS_WIFI_H_
+
+#include <Arduino.h>
+#include <esp_now.h>
+
+#define WL_CONNECTED 3
+#define WIFI_MODE_APSTA 3
+
+class WiFiClass
+{
+public:
+  int status() { return 0; }
+  void macAddress(uint8_t *m) { memset(m, 0, 6); }
+};
+
+extern WiFiClass WiFi; // Defined in nativeStubs.h
+
+#endif // TEST_STUBS_WIFI_H_
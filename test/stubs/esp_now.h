@@ -0,0 +1,67 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef TEST_STUBS_ESP_NOW_H_
+#define TEST_STUBS_ESP_NOW_H_
+
+// Types only; the native tests don't touch the radio
+
+#include <cstddef>
+#include <cstdint>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_MAX_DATA_LEN 250
+
+enum
+{
+  ESP_ERR_ESPNOW_NOT_INIT = 1,
+  ESP_ERR_ESPNOW_ARG,
+  ESP_ERR_ESPNOW_INTERNAL,
+  ESP_ERR_ESPNOW_NO_MEM,
+  ESP_ERR_ESPNOW_NOT_FOUND,
+  ESP_ERR_ESPNOW_IF,
+  ESP_ERR_ESPNOW_FULL,
+  ESP_ERR_ESPNOW_EXIST
+};
+
+typedef enum
+{
+  ESP_NOW_SEND_SUCCESS = 0,
+  ESP_NOW_SEND_FAIL
+} esp_now_send_status_t;
+
+typedef enum
+{
+  WIFI_IF_STA = 0,
+  WIFI_IF_AP
+} wifi_interface_t;
+
+typedef struct
+{
+  uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+  uint8_t lmk[16];
+  uint8_t channel;
+  wifi_interface_t ifidx;
+  bool encrypt;
+  void *priv;
+} esp_now_peer_info_t;
+
+#endif // TEST_STUBS_ESP_NOW_H_
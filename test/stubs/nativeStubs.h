@@ -0,0 +1,91 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef TEST_STUBS_NATIVE_STUBS_H_
+#define TEST_STUBS_NATIVE_STUBS_H_
+
+/*
+  What the library modules need from Base, for the native test env; Base itself needs the radio.
+  Include from exactly one file per test.
+*/
+
+#include <Arduino.h>
+
+#include "clock/clock.h"
+#include "stateEnt/virtual/base/base.h"
+
+// One of each for the whole test, as the Arduino core has them
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+WiFiUDP Base::ntpUDP;
+NTPClient Base::timeClient(ntpUDP);
+
+int Base::getCurState()
+{
+  return 0;
+}
+
+Base *Base::getCurStateEnt()
+{
+  return NULL;
+}
+
+String Base::getDeviceID()
+{
+  return "test";
+}
+
+peer_handle Base::getPeerHandle(String id)
+{
+  return PEER_NONE;
+}
+
+String Base::getPeerId(peer_handle h)
+{
+  return "";
+}
+
+void Base::hexdump(const void *mem, uint32_t len, uint8_t cols)
+{
+}
+
+time_us Base::getStartUs()
+{
+  return 0;
+}
+
+time_us Base::getElapsedUs()
+{
+  return AF1Clock::now();
+}
+
+// AF1Clock reads micros(), which only moves when a test moves it
+inline void setMicros(uint32_t us)
+{
+  fakeMicros() = us;
+}
+
+inline void advanceMicros(uint32_t us)
+{
+  fakeMicros() += us;
+}
+
+#endif // TEST_STUBS_NATIVE_STUBS_H_
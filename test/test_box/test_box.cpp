@@ -0,0 +1,413 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <unity.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "nativeStubs.h"
+#include "box/box.h"
+#include "pool/pool.h"
+
+#define TYPE_A 200
+#define TYPE_B 201
+
+static std::vector<int> handled;
+
+static void record(AF1Msg &m)
+{
+  handled.push_back(m.readJson()["v"].as<int>());
+}
+
+static AF1Msg msg(uint8_t type, int v, msg_priority p = PRIORITY_NORMAL)
+{
+  AF1Msg m(type);
+  m.json()["v"] = v;
+  m.setPriority(p);
+  return m;
+}
+
+static void expectHandled(const std::vector<int> &want)
+{
+  TEST_ASSERT_EQUAL_UINT(want.size(), handled.size());
+  for (size_t i = 0; i < want.size(); i++)
+  {
+    TEST_ASSERT_EQUAL_INT(want[i], handled[i]);
+  }
+}
+
+static const size_t caps[PRIORITY_CNT] = {2, 2, 2};
+
+// Heap allocations by anything, while counting
+static std::atomic<bool> counting(false);
+static std::atomic<unsigned long> heapAllocs(0);
+
+void *operator new(size_t n)
+{
+  if (counting)
+  {
+    heapAllocs++;
+  }
+  void *p = malloc(n ? n : 1);
+  if (p == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t n)
+{
+  return operator new(n);
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+  free(p);
+}
+
+// Raw buffers as built, by their first byte, and whether the handler saw the same ones
+static const uint8_t *built[256];
+static int sameBuffer;
+
+static void checkBuffer(AF1Msg &m)
+{
+  const uint8_t *r = m.getRaw();
+  if (r == built[r[1]])
+  {
+    sameBuffer++;
+  }
+}
+
+void setUp()
+{
+  handled.clear();
+  setMicros(1000);
+}
+
+void tearDown()
+{
+}
+
+void test_drop_newest_keeps_the_queue()
+{
+  Box b(caps, BOX_DROP_NEWEST);
+  b.setMsgHandler(record);
+  TEST_ASSERT_TRUE(b.push(msg(TYPE_A, 1)));
+  TEST_ASSERT_TRUE(b.push(msg(TYPE_A, 2)));
+  TEST_ASSERT_FALSE(b.push(msg(TYPE_A, 3)));
+  TEST_ASSERT_EQUAL_INT(2, b.handleMessages());
+  expectHandled({1, 2});
+  TEST_ASSERT_EQUAL_UINT32(1, b.getStats().dropped);
+  TEST_ASSERT_EQUAL_UINT32(2, b.getStats().accepted);
+}
+
+void test_drop_oldest_makes_room()
+{
+  Box b(caps, BOX_DROP_OLDEST);
+  b.setMsgHandler(record);
+  b.push(msg(TYPE_A, 1));
+  b.push(msg(TYPE_A, 2));
+  TEST_ASSERT_TRUE(b.push(msg(TYPE_A, 3)));
+  b.handleMessages();
+  expectHandled({2, 3});
+  TEST_ASSERT_EQUAL_UINT32(1, b.getStats().dropped);
+}
+
+void test_coalesce_replaces_the_same_type_in_place()
+{
+  Box b(caps, BOX_COALESCE_TYPE);
+  b.setMsgHandler(record);
+  b.push(msg(TYPE_A, 1));
+  b.push(msg(TYPE_B, 2));
+  TEST_ASSERT_TRUE(b.push(msg(TYPE_A, 3)));
+  TEST_ASSERT_EQUAL_INT(2, b.size());
+  b.handleMessages();
+  expectHandled({3, 2});
+  TEST_ASSERT_EQUAL_UINT32(1, b.getStats().coalesced);
+  TEST_ASSERT_EQUAL_UINT32(0, b.getStats().dropped);
+}
+
+void test_coalesce_without_a_match_drops_oldest()
+{
+  Box b(caps, BOX_COALESCE_TYPE);
+  b.setMsgHandler(record);
+  b.push(msg(TYPE_A, 1));
+  b.push(msg(TYPE_A, 2));
+  TEST_ASSERT_TRUE(b.push(msg(TYPE_B, 3)));
+  b.handleMessages();
+  expectHandled({2, 3});
+  TEST_ASSERT_EQUAL_UINT32(1, b.getStats().dropped);
+}
+
+void test_reject_refuses_and_leaves_the_message()
+{
+  Box b(caps, BOX_REJECT);
+  b.setMsgHandler(record);
+  b.push(msg(TYPE_A, 1));
+  b.push(msg(TYPE_A, 2));
+  AF1Msg m = msg(TYPE_A, 3);
+  TEST_ASSERT_FALSE(b.push(std::move(m)));
+  TEST_ASSERT_EQUAL_INT(3, m.readJson()["v"].as<int>());
+  TEST_ASSERT_EQUAL_UINT32(1, b.getStats().rejected);
+  TEST_ASSERT_EQUAL_UINT32(0, b.getStats().dropped);
+}
+
+void test_lanes_are_separate()
+{
+  Box b(caps, BOX_DROP_NEWEST);
+  b.push(msg(TYPE_A, 1, PRIORITY_LOW));
+  b.push(msg(TYPE_A, 2, PRIORITY_LOW));
+  TEST_ASSERT_TRUE(b.push(msg(TYPE_A, 3, PRIORITY_HIGH)));
+  TEST_ASSERT_EQUAL_INT(2, b.size(PRIORITY_LOW));
+  TEST_ASSERT_EQUAL_INT(1, b.size(PRIORITY_HIGH));
+}
+
+void test_strict_drain_takes_high_first()
+{
+  Box b(caps, BOX_DROP_NEWEST, BOX_DRAIN_STRICT);
+  b.setMsgHandler(record);
+  b.push(msg(TYPE_A, 1, PRIORITY_LOW));
+  b.push(msg(TYPE_A, 2, PRIORITY_NORMAL));
+  b.push(msg(TYPE_A, 3, PRIORITY_HIGH));
+  b.handleMessages();
+  expectHandled({3, 2, 1});
+}
+
+void test_weighted_drain_round_robins_by_weight()
+{
+  const size_t c[PRIORITY_CNT] = {4, 4, 4};
+  Box b(c, BOX_DROP_NEWEST, BOX_DRAIN_WEIGHTED);
+  b.setMsgHandler(record);
+  b.setWeight(PRIORITY_HIGH, 2);
+  b.setWeight(PRIORITY_NORMAL, 1);
+  b.setWeight(PRIORITY_LOW, 1);
+  for (int i = 0; i < 4; i++)
+  {
+    b.push(msg(TYPE_A, 10 + i, PRIORITY_HIGH));
+    b.push(msg(TYPE_A, 20 + i, PRIORITY_NORMAL));
+    b.push(msg(TYPE_A, 30 + i, PRIORITY_LOW));
+  }
+  b.handleMessages();
+  expectHandled({10, 11, 20, 30, 12, 13, 21, 31, 22, 32, 23, 33});
+}
+
+void test_budget_stops_early()
+{
+  Box b(caps, BOX_DROP_NEWEST);
+  b.setMsgHandler(record);
+  b.setBudget(1, 0);
+  b.push(msg(TYPE_A, 1));
+  b.push(msg(TYPE_A, 2));
+  TEST_ASSERT_EQUAL_INT(1, b.handleMessages());
+  TEST_ASSERT_EQUAL_UINT32(1, b.getStats().budgetExhausted);
+  TEST_ASSERT_EQUAL_INT(1, b.handleMessages());
+  TEST_ASSERT_EQUAL_UINT32(1, b.getStats().budgetExhausted);
+}
+
+void test_latency_is_measured_from_arrival()
+{
+  Box b(caps, BOX_DROP_NEWEST);
+  AF1Msg m = msg(TYPE_A, 1);
+  m.setRxUs(AF1Clock::now());
+  b.push(std::move(m));
+  advanceMicros(250);
+  b.handleMessages();
+  TEST_ASSERT_EQUAL_UINT32(1, b.getStats().latencyCnt);
+  TEST_ASSERT_EQUAL_UINT32(250, b.getStats().latencyMaxUs);
+}
+
+void test_wait_wakes_on_push_and_times_out_otherwise()
+{
+  Box b(caps, BOX_DROP_NEWEST);
+  Box::prepareWait();
+  TEST_ASSERT_FALSE(Box::wait(10));
+
+  Box::prepareWait();
+  std::thread t([&b]()
+                {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    b.push(msg(TYPE_A, 1)); });
+  TEST_ASSERT_TRUE(Box::wait(5000));
+  t.join();
+
+  // A push between prepareWait() and wait() isn't missed
+  Box::prepareWait();
+  b.push(msg(TYPE_A, 2));
+  TEST_ASSERT_TRUE(Box::wait(0));
+}
+
+// Built once, moved into the box and handed to the handler: the one MsgPool block from the
+// constructor is all it takes, with no copies of the message or its bytes
+void test_messages_are_moved_not_copied()
+{
+  const int n = POOL_SMALL_CNT;
+  const size_t c[PRIORITY_CNT] = {n, n, n};
+  Box b(c);
+  b.setMsgHandler(checkBuffer);
+  uint8_t payload[64];
+  memset(payload, 0, sizeof(payload));
+  sameBuffer = 0;
+
+  pool_stats before = MsgPool::getStats();
+  for (int i = 0; i < n; i++)
+  {
+    payload[0] = i;
+    AF1Msg m(TYPE_A, payload, sizeof(payload));
+    built[i] = m.getRaw();
+    counting = true;
+    TEST_ASSERT_TRUE(b.push(std::move(m)));
+    counting = false;
+  }
+  pool_stats queued = MsgPool::getStats();
+  int handledCnt = 0;
+  counting = true;
+  while (b.size())
+  {
+    handledCnt += b.handleMessages();
+  }
+  counting = false;
+  pool_stats after = MsgPool::getStats();
+
+  TEST_ASSERT_EQUAL_UINT32(0, heapAllocs.load());
+  TEST_ASSERT_EQUAL_UINT32(n, queued.allocs - before.allocs);
+  TEST_ASSERT_EQUAL_UINT32(0, after.allocs - queued.allocs);
+  TEST_ASSERT_EQUAL_UINT32(0, after.fallbacks - before.fallbacks);
+  TEST_ASSERT_EQUAL_INT(n, handledCnt);
+  TEST_ASSERT_EQUAL_INT(n, sameBuffer);
+  TEST_ASSERT_EQUAL_UINT32(before.inUse, after.inUse);
+}
+
+#define FLOOD_ROUNDS 50
+#define FLOOD_BULK_PER_ROUND 8 // Twice what each round drains, so the backlog keeps growing
+#define FLOOD_BULK_COST_US 400
+#define FLOOD_LOOP_US 100
+#define FLOOD_BUDGET_US 2000
+
+// Control message latencies, in arrival order
+static std::vector<unsigned long> controlUs;
+
+static void flooded(AF1Msg &m)
+{
+  if (m.getType() == TYPE_TIME_SYNC_RESPONSE)
+  {
+    controlUs.push_back(AF1Clock::now() - m.getRxUs());
+  }
+  else
+  {
+    advanceMicros(FLOOD_BULK_COST_US);
+  }
+}
+
+// Each loop round: a burst of bulk data and one time sync response arrive, the loop does other work,
+// then drains within FLOOD_BUDGET_US. Returns the longest handleMessages() call
+static unsigned long flood(box_drain d, msg_priority control)
+{
+  const size_t c[PRIORITY_CNT] = {16, 16, FLOOD_ROUNDS * FLOOD_BULK_PER_ROUND};
+  Box b(c, BOX_DROP_NEWEST, d);
+  b.setMsgHandler(flooded);
+  b.setBudget(0, FLOOD_BUDGET_US);
+  controlUs.clear();
+  unsigned long longestUs = 0;
+  for (int r = 0; r < FLOOD_ROUNDS; r++)
+  {
+    for (int i = 0; i < FLOOD_BULK_PER_ROUND; i++)
+    {
+      b.push(msg(TYPE_A, i, PRIORITY_LOW));
+    }
+    AF1Msg m(TYPE_TIME_SYNC_RESPONSE);
+    if (control != PRIORITY_HIGH)
+    {
+      m.setPriority(control);
+    }
+    m.setRxUs(AF1Clock::now());
+    TEST_ASSERT_TRUE(b.push(std::move(m)));
+    advanceMicros(FLOOD_LOOP_US);
+    unsigned long startUs = micros();
+    b.handleMessages();
+    longestUs = std::max(longestUs, (unsigned long)(micros() - startUs));
+  }
+  return longestUs;
+}
+
+// Control traffic keeps its latency while bulk data piles up behind it; each drain stays in budget
+void test_control_latency_stays_flat_under_a_flood()
+{
+  TEST_ASSERT_LESS_OR_EQUAL(FLOOD_BUDGET_US + FLOOD_BULK_COST_US, flood(BOX_DRAIN_STRICT, PRIORITY_HIGH));
+  TEST_ASSERT_EQUAL_UINT(FLOOD_ROUNDS, controlUs.size());
+  for (size_t i = 0; i < controlUs.size(); i++)
+  {
+    TEST_ASSERT_EQUAL_UINT32(FLOOD_LOOP_US, controlUs[i]);
+  }
+
+  // Weighted: at most one turn of the bulk lane ahead of it
+  TEST_ASSERT_LESS_OR_EQUAL(FLOOD_BUDGET_US + FLOOD_BULK_COST_US, flood(BOX_DRAIN_WEIGHTED, PRIORITY_HIGH));
+  TEST_ASSERT_EQUAL_UINT(FLOOD_ROUNDS, controlUs.size());
+  for (size_t i = 0; i < controlUs.size(); i++)
+  {
+    TEST_ASSERT_LESS_OR_EQUAL(FLOOD_LOOP_US + FLOOD_BULK_COST_US, controlUs[i]);
+  }
+
+  // In the bulk lane it waits behind the whole backlog, and falls further behind every round
+  flood(BOX_DRAIN_STRICT, PRIORITY_LOW);
+  TEST_ASSERT_GREATER_THAN(10, controlUs.size());
+  TEST_ASSERT_GREATER_THAN(10 * controlUs.front(), controlUs.back());
+
+  char line[120];
+  snprintf(line, sizeof(line), "control latency under a flood: %d us in its own lane, up to %lu us behind the bulk",
+           FLOOD_LOOP_US, controlUs.back());
+  TEST_MESSAGE(line);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_drop_newest_keeps_the_queue);
+  RUN_TEST(test_drop_oldest_makes_room);
+  RUN_TEST(test_coalesce_replaces_the_same_type_in_place);
+  RUN_TEST(test_coalesce_without_a_match_drops_oldest);
+  RUN_TEST(test_reject_refuses_and_leaves_the_message);
+  RUN_TEST(test_lanes_are_separate);
+  RUN_TEST(test_strict_drain_takes_high_first);
+  RUN_TEST(test_weighted_drain_round_robins_by_weight);
+  RUN_TEST(test_budget_stops_early);
+  RUN_TEST(test_latency_is_measured_from_arrival);
+  RUN_TEST(test_wait_wakes_on_push_and_times_out_otherwise);
+  RUN_TEST(test_messages_are_moved_not_copied);
+  RUN_TEST(test_control_latency_stays_flat_under_a_flood);
+  return UNITY_END();
+}
@@ -0,0 +1,160 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <unity.h>
+
+#include "nativeStubs.h"
+#include "broadcast/broadcast.h"
+
+static const uint8_t payload[] = {1, 2, 3};
+
+// BroadcastTx is static, so the sender's sequence carries over from test to test
+static tx_frame *send()
+{
+  tx_frame *f = TxQueue::newFrame(payload, sizeof(payload), TX_FRAME_BROADCAST);
+  BroadcastTx::keep(f);
+  TxQueue::releaseFrame(f); // Sent; only the history holds it now
+  return f;
+}
+
+void setUp()
+{
+  advanceMicros(1000000);
+}
+
+void tearDown()
+{
+}
+
+void test_in_order_frames_leave_nothing_missing()
+{
+  BroadcastRx r;
+  for (uint16_t s = 10; s < 20; s++)
+  {
+    TEST_ASSERT_TRUE(r.receive(s));
+  }
+  TEST_ASSERT_EQUAL_UINT16(19, r.getLatest());
+  TEST_ASSERT_EQUAL_UINT32(0, r.getMissing());
+  TEST_ASSERT_FALSE(r.isNackDue(AF1Clock::now()));
+}
+
+void test_gaps_are_tracked_and_repairs_fill_them()
+{
+  BroadcastRx r;
+  r.receive(1);
+  TEST_ASSERT_TRUE(r.receive(4));
+  TEST_ASSERT_EQUAL_UINT32(0x6, r.getMissing()); // 3 and 2
+
+  TEST_ASSERT_TRUE(r.receive(2));
+  TEST_ASSERT_EQUAL_UINT32(0x2, r.getMissing());
+  unsigned long dups = BroadcastTx::getStats().duplicates;
+  TEST_ASSERT_FALSE(r.receive(2));
+  TEST_ASSERT_FALSE(r.receive(4));
+  TEST_ASSERT_EQUAL_UINT32(dups + 2, BroadcastTx::getStats().duplicates);
+  TEST_ASSERT_TRUE(r.receive(3));
+  TEST_ASSERT_EQUAL_UINT32(0, r.getMissing());
+}
+
+void test_heartbeat_announces_a_lost_last_frame()
+{
+  BroadcastRx r;
+  r.receive(7);
+  TEST_ASSERT_FALSE(r.receive(8, true));
+  TEST_ASSERT_EQUAL_UINT16(8, r.getLatest());
+  TEST_ASSERT_EQUAL_UINT32(0x1, r.getMissing());
+  TEST_ASSERT_FALSE(r.receive(8, true));
+  TEST_ASSERT_TRUE(r.receive(8));
+  TEST_ASSERT_EQUAL_UINT32(0, r.getMissing());
+}
+
+void test_only_the_resendable_history_is_asked_for()
+{
+  BroadcastRx r;
+  r.receive(100);
+  r.receive(100 + ESPNOW_BCAST_HISTORY + 10);
+  TEST_ASSERT_EQUAL_UINT32((1UL << ESPNOW_BCAST_HISTORY) - 2, r.getMissing());
+}
+
+void test_a_big_step_back_is_a_restarted_sender()
+{
+  BroadcastRx r;
+  r.receive(1000);
+  r.receive(1003);
+  TEST_ASSERT_TRUE(r.receive(5));
+  TEST_ASSERT_EQUAL_UINT16(5, r.getLatest());
+  TEST_ASSERT_EQUAL_UINT32(0, r.getMissing());
+}
+
+void test_nacks_are_spaced_out()
+{
+  BroadcastRx r;
+  r.receive(1);
+  r.receive(3);
+  time_us t = AF1Clock::now();
+  TEST_ASSERT_TRUE(r.isNackDue(t));
+  TEST_ASSERT_FALSE(r.isNackDue(t + ESPNOW_BCAST_NACK_MS * 1000ULL - 1));
+  TEST_ASSERT_TRUE(r.isNackDue(t + ESPNOW_BCAST_NACK_MS * 1000ULL));
+}
+
+// The first test to send, so the history starts empty
+void test_history_keeps_the_last_frames_for_repairs()
+{
+  int freeBefore = TxQueue::getFramesFree(TX_FRAME_BROADCAST);
+  uint16_t first = BroadcastTx::getNextSeq();
+  tx_frame *f = send();
+  TEST_ASSERT_EQUAL_UINT16(first, BroadcastTx::getLastSeq());
+  TEST_ASSERT_EQUAL_UINT8(1, f->refs);
+  TEST_ASSERT_EQUAL_PTR(f, BroadcastTx::find(first));
+
+  for (int i = 0; i < ESPNOW_BCAST_HISTORY; i++)
+  {
+    send();
+  }
+  TEST_ASSERT_EQUAL_UINT8(0, f->refs); // Pushed out and released
+  unsigned long expired = BroadcastTx::getStats().expired;
+  TEST_ASSERT_NULL(BroadcastTx::find(first));
+  TEST_ASSERT_EQUAL_UINT32(expired + 1, BroadcastTx::getStats().expired);
+  TEST_ASSERT_NOT_NULL(BroadcastTx::find(first + 1));
+  TEST_ASSERT_EQUAL_INT(freeBefore - ESPNOW_BCAST_HISTORY, TxQueue::getFramesFree(TX_FRAME_BROADCAST));
+}
+
+void test_heartbeat_follows_the_last_broadcast_once()
+{
+  send();
+  time_us t = AF1Clock::now();
+  TEST_ASSERT_TRUE(BroadcastTx::getHeartbeatUs() == t + ESPNOW_BCAST_HEARTBEAT_MS * 1000ULL);
+  TEST_ASSERT_FALSE(BroadcastTx::takeHeartbeat(t + ESPNOW_BCAST_HEARTBEAT_MS * 1000ULL - 1));
+  TEST_ASSERT_TRUE(BroadcastTx::takeHeartbeat(t + ESPNOW_BCAST_HEARTBEAT_MS * 1000ULL));
+  TEST_ASSERT_FALSE(BroadcastTx::takeHeartbeat(t + ESPNOW_BCAST_HEARTBEAT_MS * 2000ULL));
+  TEST_ASSERT_TRUE(BroadcastTx::getHeartbeatUs() == 0);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_in_order_frames_leave_nothing_missing);
+  RUN_TEST(test_gaps_are_tracked_and_repairs_fill_them);
+  RUN_TEST(test_heartbeat_announces_a_lost_last_frame);
+  RUN_TEST(test_only_the_resendable_history_is_asked_for);
+  RUN_TEST(test_a_big_step_back_is_a_restarted_sender);
+  RUN_TEST(test_nacks_are_spaced_out);
+  RUN_TEST(test_history_keeps_the_last_frames_for_repairs);
+  RUN_TEST(test_heartbeat_follows_the_last_broadcast_once);
+  return UNITY_END();
+}
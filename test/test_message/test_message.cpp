@@ -0,0 +1,190 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <unity.h>
+#include <chrono>
+
+#include "nativeStubs.h"
+#include "message/message.h"
+
+void setUp()
+{
+  setMicros(1000);
+}
+
+void tearDown()
+{
+}
+
+void test_round_trip_keeps_header_and_payload()
+{
+  AF1Msg m(TYPE_CHANGE_STATE);
+  m.json()["state"] = 3;
+  m.json()["count"] = 42;
+  m.json()["ratio"] = 0.5;
+  m.json()["name"] = "lamp";
+  m.json()["on"] = true;
+
+  uint8_t buf[AF1_MSG_SIZE];
+  size_t len = m.toWire(buf, sizeof(buf));
+  TEST_ASSERT_GREATER_THAN(AF1_WIRE_HEADER_LEN, len);
+  TEST_ASSERT_TRUE(AF1Msg::isWire(buf, len));
+
+  AF1Msg r;
+  TEST_ASSERT_TRUE(r.fromWire(buf, len));
+  TEST_ASSERT_EQUAL_UINT8(TYPE_CHANGE_STATE, r.getType());
+  TEST_ASSERT_EQUAL_UINT8(3, r.getState());
+  TEST_ASSERT_EQUAL_UINT16(m.getSeq(), r.getSeq());
+  TEST_ASSERT_EQUAL_INT(42, r.readJson()["count"].as<int>());
+  TEST_ASSERT_EQUAL_FLOAT(0.5, r.readJson()["ratio"].as<float>());
+  TEST_ASSERT_EQUAL_STRING("lamp", r.readJson()["name"].as<const char *>());
+  TEST_ASSERT_TRUE(r.readJson()["on"].as<bool>());
+  TEST_ASSERT_FALSE(r.getTxStamp());
+  TEST_ASSERT_FALSE(r.isBroadcast());
+  TEST_ASSERT_FALSE(r.isReliable());
+}
+
+void test_round_trip_keeps_optional_fields()
+{
+  AF1Msg m(TYPE_CHANGE_STATE);
+  m.setTxStamp(true);
+  m.setBroadcast(true, 7, 517);
+  m.setReliable(true);
+
+  size_t len;
+  const uint8_t *enc = m.encode(WIRE_FORMAT_BINARY, len);
+  TEST_ASSERT_NOT_NULL(enc);
+  uint8_t buf[AF1_MSG_SIZE];
+  memcpy(buf, enc, len);
+  AF1Msg::stampTx(buf, len, 0x0102030405060708ULL);
+  AF1Msg::setReliableSeq(buf, len, 0xBEEF);
+
+  AF1Msg r;
+  TEST_ASSERT_TRUE(r.fromWire(buf, len));
+  TEST_ASSERT_TRUE(r.getTxStamp());
+  TEST_ASSERT_TRUE(r.getTxUs() == 0x0102030405060708ULL);
+  TEST_ASSERT_TRUE(r.isBroadcast());
+  TEST_ASSERT_EQUAL_UINT8(7, r.getGroup());
+  TEST_ASSERT_EQUAL_UINT16(517, r.getBroadcastSeq());
+  TEST_ASSERT_TRUE(r.isReliable());
+  TEST_ASSERT_EQUAL_UINT16(0xBEEF, r.getReliableSeq());
+}
+
+void test_handshake_carries_sender_id()
+{
+  AF1Msg m(TYPE_HANDSHAKE_REQUEST);
+  uint8_t buf[AF1_MSG_SIZE];
+  size_t len = m.toWire(buf, sizeof(buf));
+  TEST_ASSERT_TRUE(buf[2] & WIRE_FLAG_SENDER_ID);
+
+  AF1Msg r;
+  TEST_ASSERT_TRUE(r.fromWire(buf, len));
+  TEST_ASSERT_EQUAL_STRING("test", r.getSenderId().c_str());
+}
+
+void test_rejects_truncated_frames()
+{
+  AF1Msg m(TYPE_CHANGE_STATE);
+  m.setTxStamp(true);
+  uint8_t buf[AF1_MSG_SIZE];
+  size_t len = m.toWire(buf, sizeof(buf));
+
+  AF1Msg r;
+  TEST_ASSERT_FALSE(r.fromWire(buf, AF1_WIRE_HEADER_LEN - 1));
+  TEST_ASSERT_FALSE(r.fromWire(buf, AF1_WIRE_HEADER_LEN + AF1_WIRE_TX_STAMP_LEN - 1));
+  buf[0] = '{';
+  TEST_ASSERT_FALSE(r.fromWire(buf, len));
+}
+
+void test_to_wire_refuses_small_buffers()
+{
+  AF1Msg m(TYPE_CHANGE_STATE);
+  m.json()["name"] = "a fairly long value that won't fit";
+  uint8_t buf[AF1_WIRE_HEADER_LEN + 4];
+  TEST_ASSERT_EQUAL_UINT(0, m.toWire(buf, sizeof(buf)));
+}
+
+#define BENCH_ROUNDS 20000
+
+static AF1Msg benchMsg()
+{
+  AF1Msg m(TYPE_CHANGE_STATE);
+  m.json()["state"] = 3;
+  m.json()["count"] = 0;
+  m.json()["ratio"] = 0.5;
+  m.json()["name"] = "lamp";
+  m.json()["on"] = true;
+  return m;
+}
+
+static double nsPer(std::chrono::steady_clock::time_point start, int n)
+{
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / n;
+}
+
+// Each round changes the payload, encodes it, then decodes the header and a field as the receiver
+// does. Binary: encode() then fromWire(). JSON: encode() then deserializeJson() into an AF1Msg
+void test_benchmark_binary_against_json()
+{
+  AF1Msg m = benchMsg();
+  size_t binLen = 0, jsonLen = 0;
+  long sum = 0;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ROUNDS; i++)
+  {
+    m.json()["count"] = i;
+    const uint8_t *d = m.encode(WIRE_FORMAT_BINARY, binLen);
+    AF1Msg r;
+    TEST_ASSERT_TRUE(r.fromWire(d, binLen));
+    sum += r.getType() + r.getState() + r.readJson()["count"].as<int>();
+  }
+  double binNs = nsPer(start, BENCH_ROUNDS);
+
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_ROUNDS; i++)
+  {
+    m.json()["count"] = i;
+    const uint8_t *d = m.encode(WIRE_FORMAT_JSON, jsonLen);
+    AF1JsonDoc doc;
+    TEST_ASSERT_FALSE(deserializeJson(doc, (const char *)d, jsonLen));
+    AF1Msg r(doc);
+    sum -= r.getType() + r.getState() + r.readJson()["count"].as<int>();
+  }
+  double jsonNs = nsPer(start, BENCH_ROUNDS);
+
+  char line[160];
+  snprintf(line, sizeof(line), "binary: %u bytes, %.0f ns/round; JSON: %u bytes, %.0f ns/round",
+           (unsigned)binLen, binNs, (unsigned)jsonLen, jsonNs);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_EQUAL_INT(0, sum); // Both decoded the same
+  TEST_ASSERT_LESS_THAN(jsonLen, binLen);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_round_trip_keeps_header_and_payload);
+  RUN_TEST(test_round_trip_keeps_optional_fields);
+  RUN_TEST(test_handshake_carries_sender_id);
+  RUN_TEST(test_rejects_truncated_frames);
+  RUN_TEST(test_to_wire_refuses_small_buffers);
+  RUN_TEST(test_benchmark_binary_against_json);
+  return UNITY_END();
+}
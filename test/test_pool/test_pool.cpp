@@ -0,0 +1,267 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <unity.h>
+#include <atomic>
+#include <new>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "nativeStubs.h"
+#include "pool/pool.h"
+#include "box/box.h"
+#include "reliable/reliable.h"
+
+#define TYPE_A 200
+
+// Heap allocations by anything, while counting
+static std::atomic<bool> counting(false);
+static std::atomic<unsigned long> heapAllocs(0);
+
+void *operator new(size_t n)
+{
+  if (counting)
+  {
+    heapAllocs++;
+  }
+  void *p = malloc(n ? n : 1);
+  if (p == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t n)
+{
+  return operator new(n);
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+  free(p);
+}
+
+static int handledSum;
+
+static void sum(AF1Msg &m)
+{
+  handledSum += m.readJson()["v"].as<int>();
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_blocks_are_distinct_and_reused()
+{
+  std::set<uint8_t *> seen;
+  uint8_t *p[POOL_SMALL_CNT];
+  for (int i = 0; i < POOL_SMALL_CNT; i++)
+  {
+    p[i] = MsgPool::alloc(POOL_SMALL_SIZE);
+    memset(p[i], i, POOL_SMALL_SIZE);
+    seen.insert(p[i]);
+  }
+  TEST_ASSERT_EQUAL_UINT(POOL_SMALL_CNT, seen.size());
+  for (int i = 0; i < POOL_SMALL_CNT; i++)
+  {
+    TEST_ASSERT_EQUAL_UINT8(i, p[i][POOL_SMALL_SIZE - 1]);
+    MsgPool::release(p[i]);
+  }
+  uint8_t *q = MsgPool::alloc(10);
+  TEST_ASSERT_TRUE(seen.count(q));
+  MsgPool::release(q);
+}
+
+void test_small_overflows_into_large_then_the_heap()
+{
+  pool_stats before = MsgPool::getStats();
+  std::vector<uint8_t *> p;
+  for (int i = 0; i < POOL_SMALL_CNT + POOL_LARGE_CNT + 1; i++)
+  {
+    p.push_back(MsgPool::alloc(1));
+  }
+  pool_stats s = MsgPool::getStats();
+  TEST_ASSERT_EQUAL_UINT32(POOL_SMALL_CNT + POOL_LARGE_CNT, s.allocs - before.allocs);
+  TEST_ASSERT_EQUAL_UINT32(1, s.fallbacks - before.fallbacks);
+  TEST_ASSERT_EQUAL_UINT32(1, s.exhausted - before.exhausted);
+  TEST_ASSERT_EQUAL_UINT32(POOL_SMALL_CNT + POOL_LARGE_CNT, s.inUse);
+  TEST_ASSERT_GREATER_OR_EQUAL(POOL_SMALL_CNT + POOL_LARGE_CNT, s.highWater);
+  for (size_t i = 0; i < p.size(); i++)
+  {
+    MsgPool::release(p[i]);
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, MsgPool::getStats().inUse);
+}
+
+void test_oversized_requests_go_to_the_heap()
+{
+  pool_stats before = MsgPool::getStats();
+  uint8_t *p = MsgPool::alloc(POOL_LARGE_SIZE + 1);
+  p[POOL_LARGE_SIZE] = 1;
+  pool_stats s = MsgPool::getStats();
+  TEST_ASSERT_EQUAL_UINT32(1, s.fallbacks - before.fallbacks);
+  TEST_ASSERT_EQUAL_UINT32(0, s.exhausted - before.exhausted);
+  TEST_ASSERT_EQUAL_UINT32(0, s.inUse);
+  MsgPool::release(p);
+  MsgPool::release(NULL);
+}
+
+void test_concurrent_alloc_and_release()
+{
+  std::atomic<bool> clash(false);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++)
+  {
+    threads.emplace_back([&clash, t]()
+                         {
+      for (int i = 0; i < 20000; i++)
+      {
+        uint8_t *p = MsgPool::alloc(100);
+        p[0] = t;
+        p[99] = t;
+        std::this_thread::yield();
+        if (p[0] != t || p[99] != t)
+          clash = true;
+        MsgPool::release(p);
+      } });
+  }
+  for (size_t i = 0; i < threads.size(); i++)
+  {
+    threads[i].join();
+  }
+  TEST_ASSERT_FALSE(clash.load());
+  TEST_ASSERT_EQUAL_UINT32(0, MsgPool::getStats().inUse);
+}
+
+// A message received (as onESPNowDataRecv() does it) and handled, and one sent reliably and acked
+static void steadyStateRound(Box &inbox, ReliableTx &tx, const uint8_t *wire, size_t wireLen, int v)
+{
+  AF1Msg wm;
+  TEST_ASSERT_TRUE(wm.fromWire(wire, wireLen));
+  wm.setRxUs(AF1Clock::now());
+  TEST_ASSERT_TRUE(inbox.push(std::move(wm)));
+  TEST_ASSERT_EQUAL_INT(1, inbox.handleMessages());
+
+  AF1Msg m(TYPE_A);
+  m.json()["v"] = v;
+  m.setReliable(true);
+  size_t len;
+  const uint8_t *d = m.encode(WIRE_FORMAT_BINARY, len);
+  TEST_ASSERT_NOT_NULL(d);
+  tx_frame *f = TxQueue::newFrame(d, len, TX_FRAME_RELIABLE);
+  TEST_ASSERT_NOT_NULL(f);
+  AF1Msg::setReliableSeq(f->data, f->len, tx.getNextSeq());
+  tx.add(f, AF1Clock::now());
+  TxQueue::releaseFrame(f);
+  tx.ack(tx.getNextSeq(), 0);
+}
+
+void test_steady_state_messages_never_touch_the_heap()
+{
+  static const size_t caps[PRIORITY_CNT] = {4, 4, 4};
+  Box inbox(caps);
+  inbox.setMsgHandler(sum);
+  ReliableTx tx;
+  AF1Msg src(TYPE_A);
+  src.json()["v"] = 1;
+  uint8_t wire[ESPNOW_FRAME_SIZE];
+  size_t wireLen = src.toWire(wire, sizeof(wire));
+  TEST_ASSERT_GREATER_THAN(0, wireLen);
+  steadyStateRound(inbox, tx, wire, wireLen, 0); // Warm-up
+
+  pool_stats before = MsgPool::getStats();
+  handledSum = 0;
+  heapAllocs = 0;
+  counting = true;
+  for (int i = 0; i < 1000; i++)
+  {
+    steadyStateRound(inbox, tx, wire, wireLen, i);
+  }
+  counting = false;
+  pool_stats s = MsgPool::getStats();
+  TEST_ASSERT_EQUAL_UINT32(0, heapAllocs.load());
+  TEST_ASSERT_EQUAL_UINT32(0, s.fallbacks - before.fallbacks);
+  TEST_ASSERT_EQUAL_INT(1000, handledSum);
+  TEST_ASSERT_EQUAL_UINT32(0, s.inUse);
+  TEST_ASSERT_FALSE(ReliableTx::hasUnacked());
+}
+
+// Every reliable window full at once still has frames, none from the pool or heap
+void test_full_reliable_windows_have_frames()
+{
+  std::vector<tx_frame *> f;
+  f.reserve(MAX_PEERS * RELIABLE_WINDOW);
+  uint8_t d[ESPNOW_FRAME_SIZE] = {0};
+  pool_stats before = MsgPool::getStats();
+  heapAllocs = 0;
+  counting = true;
+  for (int i = 0; i < MAX_PEERS * RELIABLE_WINDOW; i++)
+  {
+    tx_frame *x = TxQueue::newFrame(d, sizeof(d), TX_FRAME_RELIABLE);
+    if (x == NULL)
+    {
+      break;
+    }
+    f.push_back(x);
+  }
+  counting = false;
+  TEST_ASSERT_EQUAL_UINT(MAX_PEERS * RELIABLE_WINDOW, f.size());
+  TEST_ASSERT_EQUAL_UINT32(0, heapAllocs.load());
+  TEST_ASSERT_EQUAL_UINT32(before.allocs, MsgPool::getStats().allocs);
+  TEST_ASSERT_NULL(TxQueue::newFrame(d, sizeof(d) + 1, TX_FRAME_QUEUED));
+  for (size_t i = 0; i < f.size(); i++)
+  {
+    TxQueue::releaseFrame(f[i]);
+  }
+  TEST_ASSERT_EQUAL_INT(MAX_PEERS * RELIABLE_WINDOW + ESPNOW_TX_FRAMES, TxQueue::getFramesFree(TX_FRAME_RELIABLE));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_blocks_are_distinct_and_reused);
+  RUN_TEST(test_small_overflows_into_large_then_the_heap);
+  RUN_TEST(test_oversized_requests_go_to_the_heap);
+  RUN_TEST(test_concurrent_alloc_and_release);
+  RUN_TEST(test_steady_state_messages_never_touch_the_heap);
+  RUN_TEST(test_full_reliable_windows_have_frames);
+  return UNITY_END();
+}
@@ -0,0 +1,326 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <unity.h>
+#include <map>
+#include <vector>
+
+#include "nativeStubs.h"
+#include "pool/pool.h"
+#include "reliable/reliable.h"
+
+// What the receiver handed over, in order; payloads are the sequence numbers
+static std::vector<uint16_t> out;
+
+static void hold(ReliableRx &rx, uint16_t seq, time_us now)
+{
+  rx.hold(seq, (const uint8_t *)&seq, sizeof(seq), now, 0);
+}
+
+static void takeHeld(ReliableRx &rx, time_us now)
+{
+  reliable_held h;
+  while (rx.next(h, now))
+  {
+    uint16_t p;
+    memcpy(&p, h.data, sizeof(p));
+    out.push_back(p);
+    MsgPool::release(h.data);
+  }
+}
+
+// As Base does it
+static reliable_result receive(ReliableRx &rx, uint16_t seq, time_us now)
+{
+  reliable_result r = rx.receive(seq, now);
+  if (r == RELIABLE_RESYNC)
+  {
+    takeHeld(rx, now);
+    r = rx.receive(seq, now);
+  }
+  if (r == RELIABLE_DELIVER)
+  {
+    out.push_back(seq);
+  }
+  else if (r == RELIABLE_HOLD)
+  {
+    hold(rx, seq, now);
+  }
+  takeHeld(rx, now);
+  return r;
+}
+
+static tx_frame *frame(uint16_t seq)
+{
+  return TxQueue::newFrame((const uint8_t *)&seq, sizeof(seq), TX_FRAME_RELIABLE);
+}
+
+// Sends one; the channel keeps the only reference
+static void add(ReliableTx &tx, time_us now)
+{
+  tx_frame *f = frame(tx.getNextSeq());
+  tx.add(f, now);
+  TxQueue::releaseFrame(f);
+}
+
+static void expectOut(const std::vector<uint16_t> &want)
+{
+  TEST_ASSERT_EQUAL_UINT(want.size(), out.size());
+  for (size_t i = 0; i < want.size(); i++)
+  {
+    TEST_ASSERT_EQUAL_UINT16(want[i], out[i]);
+  }
+}
+
+void setUp()
+{
+  out.clear();
+  advanceMicros(1000000);
+}
+
+void tearDown()
+{
+  TEST_ASSERT_FALSE(ReliableTx::hasUnacked());
+}
+
+void test_in_order_frames_are_delivered_and_acked()
+{
+  ReliableRx rx;
+  uint16_t n;
+  uint32_t held;
+  TEST_ASSERT_FALSE(rx.takeAck(n, held));
+  for (uint16_t s = 0; s < 3; s++)
+  {
+    TEST_ASSERT_EQUAL_INT(RELIABLE_DELIVER, receive(rx, s, 1000));
+  }
+  TEST_ASSERT_TRUE(rx.takeAck(n, held));
+  TEST_ASSERT_EQUAL_UINT16(3, n);
+  TEST_ASSERT_EQUAL_UINT32(0, held);
+  TEST_ASSERT_FALSE(rx.takeAck(n, held));
+  expectOut({0, 1, 2});
+}
+
+void test_duplicates_are_not_handed_over_twice()
+{
+  ReliableRx rx;
+  receive(rx, 0, 1000);
+  receive(rx, 2, 1000);
+  TEST_ASSERT_EQUAL_INT(RELIABLE_DUP, receive(rx, 0, 1000));
+  TEST_ASSERT_EQUAL_INT(RELIABLE_DUP, receive(rx, 2, 1000));
+  expectOut({0});
+  uint16_t n;
+  uint32_t held;
+  rx.takeAck(n, held); // Duplicates are acked again, in case the ack was lost
+  TEST_ASSERT_EQUAL_UINT16(1, n);
+  TEST_ASSERT_EQUAL_UINT32(0x1, held); // 2
+  rx.reset();
+}
+
+void test_frames_after_a_gap_wait_for_it()
+{
+  ReliableRx rx;
+  TEST_ASSERT_EQUAL_INT(RELIABLE_HOLD, receive(rx, 2, 1000));
+  TEST_ASSERT_EQUAL_INT(RELIABLE_HOLD, receive(rx, 1, 1000));
+  TEST_ASSERT_EQUAL_UINT(0, out.size());
+  TEST_ASSERT_TRUE(rx.getExpiryUs() == 1000 + RELIABLE_HOLD_MS * 1000ULL);
+  TEST_ASSERT_EQUAL_INT(RELIABLE_DELIVER, receive(rx, 0, 2000));
+  expectOut({0, 1, 2});
+  TEST_ASSERT_TRUE(rx.getExpiryUs() == 0);
+}
+
+void test_a_gap_is_skipped_after_the_hold_time()
+{
+  ReliableRx rx;
+  receive(rx, 3, 1000);
+  rx.expire(1000 + RELIABLE_HOLD_MS * 1000ULL - 1);
+  takeHeld(rx, 0);
+  TEST_ASSERT_EQUAL_UINT(0, out.size());
+  rx.expire(1000 + RELIABLE_HOLD_MS * 1000ULL);
+  takeHeld(rx, 0);
+  expectOut({3});
+  // The skipped ones are now behind
+  TEST_ASSERT_EQUAL_INT(RELIABLE_DUP, receive(rx, 1, 1000));
+}
+
+void test_resync_hands_over_the_held_frames_first()
+{
+  ReliableRx rx;
+  receive(rx, 2, 1000);
+  receive(rx, 3, 1000);
+  // The sender gave up on 0 and 1 and moved on a whole window
+  TEST_ASSERT_EQUAL_INT(RELIABLE_HOLD, receive(rx, RELIABLE_WINDOW + 3, 1000));
+  expectOut({2, 3});
+  for (uint16_t s = 4; s < RELIABLE_WINDOW + 3; s++)
+  {
+    receive(rx, s, 1000);
+  }
+  TEST_ASSERT_EQUAL_UINT(RELIABLE_WINDOW + 2, out.size());
+  for (size_t i = 0; i < out.size(); i++)
+  {
+    TEST_ASSERT_EQUAL_UINT16(i + 2, out[i]);
+  }
+}
+
+void test_window_fills_and_acks_free_it()
+{
+  ReliableTx tx;
+  for (int i = 0; i < RELIABLE_WINDOW; i++)
+  {
+    TEST_ASSERT_FALSE(tx.isFull());
+    add(tx, 1000);
+  }
+  TEST_ASSERT_TRUE(tx.isFull());
+  TEST_ASSERT_TRUE(ReliableTx::hasUnacked());
+
+  tx.ack(2, 0x2); // 0, 1 and 3
+  TEST_ASSERT_FALSE(tx.isFull());
+  tx.ack(1, 0);   // Stale
+  tx.ack(RELIABLE_WINDOW + 5, 0); // Not ours
+  TEST_ASSERT_EQUAL_UINT16(RELIABLE_WINDOW, tx.getNextSeq());
+  tx.ack(RELIABLE_WINDOW, 0);
+  TEST_ASSERT_FALSE(ReliableTx::hasUnacked());
+  TEST_ASSERT_TRUE(tx.getDueUs() == 0);
+}
+
+void test_resends_back_off_then_give_up()
+{
+  ReliableTx tx;
+  reliable_stats before = ReliableTx::getStats();
+  time_us t = 1000;
+  add(tx, t);
+  tx_frame *f = NULL;
+  TEST_ASSERT_TRUE(tx.getDueUs() == t + RELIABLE_RTO_MS * 1000ULL);
+  TEST_ASSERT_NULL(tx.takeDue(t + RELIABLE_RTO_MS * 1000ULL - 1));
+
+  unsigned long rto = RELIABLE_RTO_MS;
+  for (int i = 1; i < RELIABLE_MAX_TRIES; i++)
+  {
+    t += rto * 1000;
+    f = tx.takeDue(t);
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_NULL(tx.takeDue(t));
+    rto = rto * 2 < RELIABLE_RTO_MAX_MS ? rto * 2 : RELIABLE_RTO_MAX_MS;
+    TEST_ASSERT_TRUE(tx.getDueUs() == t + rto * 1000);
+  }
+  TEST_ASSERT_NULL(tx.takeDue(t + rto * 1000));
+  TEST_ASSERT_FALSE(ReliableTx::hasUnacked());
+  reliable_stats s = ReliableTx::getStats();
+  TEST_ASSERT_EQUAL_UINT32(RELIABLE_MAX_TRIES - 1, s.retransmits - before.retransmits);
+  TEST_ASSERT_EQUAL_UINT32(1, s.failed - before.failed);
+}
+
+// A small deterministic generator, so the run is the same everywhere
+static uint32_t lcg;
+
+static uint32_t rnd()
+{
+  lcg = lcg * 1664525 + 1013904223;
+  return lcg >> 8;
+}
+
+/*
+  A lossy link, both ways, with 1-21 ms of random delay (so frames and acks also overtake each
+  other). The sender sends as fast as its window allows; everything has to come out the other end
+  once and in order.
+*/
+void test_lossy_link_delivers_everything_once_in_order()
+{
+  const int msgs = 2000;
+  const uint32_t lossPct = 10;
+  struct pkt
+  {
+    bool ack;
+    uint16_t seq;
+    uint32_t held;
+  };
+  ReliableTx tx;
+  ReliableRx rx;
+  reliable_stats before = ReliableTx::getStats();
+  std::multimap<time_us, pkt> air;
+  lcg = 1;
+  time_us now = 1000;
+  int sent = 0;
+  while ((sent < msgs || ReliableTx::hasUnacked() || !air.empty()) && now < 600000000ULL)
+  {
+    while (sent < msgs && !tx.isFull())
+    {
+      uint16_t seq = tx.getNextSeq();
+      add(tx, now);
+      if (rnd() % 100 >= lossPct)
+      {
+        air.insert(std::make_pair(now + 1000 + rnd() % 20000, pkt{false, seq, 0}));
+      }
+      sent++;
+    }
+    tx_frame *f;
+    while ((f = tx.takeDue(now)) != NULL)
+    {
+      uint16_t seq;
+      memcpy(&seq, f->data, sizeof(seq));
+      if (rnd() % 100 >= lossPct)
+      {
+        air.insert(std::make_pair(now + 1000 + rnd() % 20000, pkt{false, seq, 0}));
+      }
+    }
+    rx.expire(now);
+    while (!air.empty() && air.begin()->first <= now)
+    {
+      pkt p = air.begin()->second;
+      air.erase(air.begin());
+      if (p.ack)
+      {
+        tx.ack(p.seq, p.held);
+      }
+      else
+      {
+        receive(rx, p.seq, now);
+      }
+    }
+    uint16_t n;
+    uint32_t held;
+    if (rx.takeAck(n, held) && rnd() % 100 >= lossPct)
+    {
+      air.insert(std::make_pair(now + 1000 + rnd() % 20000, pkt{true, n, held}));
+    }
+    now += 1000;
+  }
+  TEST_ASSERT_EQUAL_INT(msgs, out.size());
+  for (int i = 0; i < msgs; i++)
+  {
+    TEST_ASSERT_EQUAL_UINT16(i, out[i]);
+  }
+  reliable_stats st = ReliableTx::getStats();
+  TEST_ASSERT_GREATER_THAN(0, st.retransmits - before.retransmits);
+  TEST_ASSERT_GREATER_THAN(0, st.held - before.held);
+  rx.reset();
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_in_order_frames_are_delivered_and_acked);
+  RUN_TEST(test_duplicates_are_not_handed_over_twice);
+  RUN_TEST(test_frames_after_a_gap_wait_for_it);
+  RUN_TEST(test_a_gap_is_skipped_after_the_hold_time);
+  RUN_TEST(test_resync_hands_over_the_held_frames_first);
+  RUN_TEST(test_window_fills_and_acks_free_it);
+  RUN_TEST(test_resends_back_off_then_give_up);
+  RUN_TEST(test_lossy_link_delivers_everything_once_in_order);
+  return UNITY_END();
+}
@@ -0,0 +1,269 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <unity.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "nativeStubs.h"
+#include "ringBuffer/ringBuffer.h"
+#include "tsQueue/tsQueue.h"
+
+struct Counted
+{
+  static int live;
+  int v;
+  Counted(int x = 0) : v(x) { live++; }
+  Counted(const Counted &c) : v(c.v) { live++; }
+  Counted &operator=(const Counted &c)
+  {
+    v = c.v;
+    return *this;
+  }
+  ~Counted() { live--; }
+};
+int Counted::live = 0;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_capacity_rounds_up_to_a_power_of_2()
+{
+  RingBuffer<int> a(5), b(8), c(1);
+  TEST_ASSERT_EQUAL_UINT(8, a.capacity());
+  TEST_ASSERT_EQUAL_UINT(8, b.capacity());
+  TEST_ASSERT_EQUAL_UINT(2, c.capacity());
+}
+
+void test_fifo_until_full_then_refuses()
+{
+  RingBuffer<int> rb(4);
+  TEST_ASSERT_TRUE(rb.empty());
+  for (int i = 0; i < 4; i++)
+  {
+    TEST_ASSERT_TRUE(rb.enqueue(i));
+  }
+  TEST_ASSERT_FALSE(rb.enqueue(99));
+  TEST_ASSERT_EQUAL_INT(4, rb.size());
+  int v;
+  for (int i = 0; i < 4; i++)
+  {
+    TEST_ASSERT_TRUE(rb.tryDequeue(v));
+    TEST_ASSERT_EQUAL_INT(i, v);
+  }
+  TEST_ASSERT_FALSE(rb.tryDequeue(v));
+  TEST_ASSERT_TRUE(rb.empty());
+}
+
+void test_wraps_around()
+{
+  RingBuffer<int> rb(4);
+  int v;
+  for (int i = 0; i < 100; i++)
+  {
+    TEST_ASSERT_TRUE(rb.enqueue(i));
+    TEST_ASSERT_TRUE(rb.enqueue(i + 1000));
+    TEST_ASSERT_TRUE(rb.tryDequeue(v));
+    TEST_ASSERT_EQUAL_INT(i, v);
+    TEST_ASSERT_TRUE(rb.tryDequeue(v));
+    TEST_ASSERT_EQUAL_INT(i + 1000, v);
+  }
+}
+
+void test_replace_if_overwrites_the_first_match_in_place()
+{
+  RingBuffer<int> rb(8);
+  rb.enqueue(1);
+  rb.enqueue(12);
+  rb.enqueue(14);
+  TEST_ASSERT_TRUE(rb.replaceIf([](int &x)
+                                { return x > 10; },
+                                50));
+  TEST_ASSERT_FALSE(rb.replaceIf([](int &x)
+                                 { return x > 100; },
+                                 60));
+  int v;
+  rb.tryDequeue(v);
+  TEST_ASSERT_EQUAL_INT(1, v);
+  rb.tryDequeue(v);
+  TEST_ASSERT_EQUAL_INT(50, v);
+  rb.tryDequeue(v);
+  TEST_ASSERT_EQUAL_INT(14, v);
+}
+
+void test_destroys_what_it_holds()
+{
+  {
+    RingBuffer<Counted> rb(4);
+    rb.enqueue(Counted(1));
+    rb.enqueue(Counted(2));
+    TEST_ASSERT_EQUAL_INT(2, Counted::live);
+    TEST_ASSERT_TRUE(rb.consume([](Counted &c) {}));
+    TEST_ASSERT_EQUAL_INT(1, Counted::live);
+  }
+  TEST_ASSERT_EQUAL_INT(0, Counted::live);
+}
+
+void test_concurrent_producers_and_consumers_lose_nothing()
+{
+  const int producers = 4, perProducer = 20000;
+  RingBuffer<int> rb(64);
+  std::atomic<long long> sum(0);
+  std::atomic<int> got(0);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; p++)
+  {
+    threads.emplace_back([&rb, p]()
+                         {
+      for (int i = 1; i <= perProducer; i++)
+      {
+        while (!rb.enqueue(p * perProducer + i))
+          std::this_thread::yield();
+      } });
+  }
+  for (int c = 0; c < 2; c++)
+  {
+    threads.emplace_back([&]()
+                         {
+      int v;
+      while (got.load() < producers * perProducer)
+      {
+        if (rb.tryDequeue(v))
+        {
+          sum += v;
+          got++;
+        }
+        else
+          std::this_thread::yield();
+      } });
+  }
+  for (size_t i = 0; i < threads.size(); i++)
+  {
+    threads[i].join();
+  }
+  long long n = (long long)producers * perProducer;
+  TEST_ASSERT_EQUAL_INT(n, got.load());
+  TEST_ASSERT_TRUE(sum.load() == n * (n + 1) / 2);
+  TEST_ASSERT_TRUE(rb.empty());
+}
+
+#define BENCH_PRODUCERS 2
+#define BENCH_PER_PRODUCER 200000
+
+// About the size of a send completion or received-frame handoff
+struct bench_item
+{
+  uint32_t v;
+  uint8_t pad[28];
+};
+
+static double itemsPerSec(std::chrono::steady_clock::time_point start, long long n)
+{
+  return n / std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// BENCH_PRODUCERS threads (the WiFi callbacks) feeding one consumer (the loop), through each queue
+void test_benchmark_ring_buffer_against_mutex_queue()
+{
+  const long long n = (long long)BENCH_PRODUCERS * BENCH_PER_PRODUCER;
+  std::vector<std::thread> threads;
+  long long rbSum = 0, tsSum = 0;
+
+  RingBuffer<bench_item> rb(64);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int p = 0; p < BENCH_PRODUCERS; p++)
+  {
+    threads.emplace_back([&rb]()
+                         {
+      bench_item it = {};
+      for (int i = 1; i <= BENCH_PER_PRODUCER; i++)
+      {
+        it.v = i;
+        while (!rb.enqueue(it))
+          std::this_thread::yield();
+      } });
+  }
+  bench_item it;
+  for (long long got = 0; got < n;)
+  {
+    if (rb.tryDequeue(it))
+    {
+      rbSum += it.v;
+      got++;
+    }
+    else
+      std::this_thread::yield();
+  }
+  double rbRate = itemsPerSec(start, n);
+  for (size_t i = 0; i < threads.size(); i++)
+  {
+    threads[i].join();
+  }
+  threads.clear();
+
+  TSQueue<bench_item> ts;
+  start = std::chrono::steady_clock::now();
+  for (int p = 0; p < BENCH_PRODUCERS; p++)
+  {
+    threads.emplace_back([&ts]()
+                         {
+      bench_item it = {};
+      for (int i = 1; i <= BENCH_PER_PRODUCER; i++)
+      {
+        it.v = i;
+        ts.enqueue(it);
+      } });
+  }
+  for (long long got = 0; got < n; got++)
+  {
+    tsSum += ts.dequeue().v;
+  }
+  double tsRate = itemsPerSec(start, n);
+  for (size_t i = 0; i < threads.size(); i++)
+  {
+    threads[i].join();
+  }
+
+  char line[160];
+  snprintf(line, sizeof(line), "RingBuffer: %.2f M items/s; TSQueue: %.2f M items/s (%d producers, 1 consumer)",
+           rbRate / 1e6, tsRate / 1e6, BENCH_PRODUCERS);
+  TEST_MESSAGE(line);
+  long long want = (long long)BENCH_PRODUCERS * BENCH_PER_PRODUCER * (BENCH_PER_PRODUCER + 1) / 2;
+  TEST_ASSERT_TRUE(rbSum == want);
+  TEST_ASSERT_TRUE(tsSum == want);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_capacity_rounds_up_to_a_power_of_2);
+  RUN_TEST(test_fifo_until_full_then_refuses);
+  RUN_TEST(test_wraps_around);
+  RUN_TEST(test_replace_if_overwrites_the_first_match_in_place);
+  RUN_TEST(test_destroys_what_it_holds);
+  RUN_TEST(test_concurrent_producers_and_consumers_lose_nothing);
+  RUN_TEST(test_benchmark_ring_buffer_against_mutex_queue);
+  return UNITY_END();
+}
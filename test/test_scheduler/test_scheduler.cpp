@@ -0,0 +1,375 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <unity.h>
+#include <vector>
+
+#include "nativeStubs.h"
+#include "stateEnt/virtual/base/event/scheduler.h"
+
+/*
+  Device-time events only; the state and epoch time bases need a running StateEnt/NTP.
+  Periodic events count from device time 0, like the library's own, so tests start on a whole second.
+*/
+static unsigned long baseMs;
+
+static void at(unsigned long ms)
+{
+  setMicros((baseMs + ms) * 1000);
+}
+
+static AF1Event every(unsigned long intervalMs, int *cnt, unsigned long maxCbCnt = 0)
+{
+  return AF1Event("test", [cnt](const ECBArg &arg)
+                  { (*cnt)++; },
+                  EVENT_TYPE_TEMP, intervalMs, maxCbCnt, 0, START_DEVICE_MS);
+}
+
+void setUp()
+{
+  // Forward only; AF1Clock treats a smaller micros() as a wrap
+  advanceMicros(1000000);
+  baseMs = (AF1Clock::nowMs() / 1000 + 1) * 1000;
+  at(0);
+}
+
+void tearDown()
+{
+}
+
+void test_fires_each_event_when_due()
+{
+  int fast = 0, slow = 0;
+  AF1Event a = every(2, &fast), b = every(10, &slow);
+  EventScheduler s;
+  s.schedule(&a);
+  s.schedule(&b);
+  TEST_ASSERT_EQUAL_UINT(2, s.size());
+
+  // The first run catches up to now
+  for (unsigned long t = 0; t <= 30; t++)
+  {
+    at(t);
+    s.run(AF1Clock::now());
+  }
+  TEST_ASSERT_EQUAL_INT(16, fast);
+  TEST_ASSERT_EQUAL_INT(4, slow);
+  TEST_ASSERT_EQUAL_UINT(2, s.size());
+}
+
+void test_next_deadline_is_the_earliest()
+{
+  int n = 0;
+  AF1Event a = every(10, &n), b = every(4, &n);
+  EventScheduler s;
+  time_us t;
+  TEST_ASSERT_FALSE(s.getNextDeadline(t));
+  s.schedule(&a);
+  s.schedule(&b);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_TRUE(s.getNextDeadline(t));
+  TEST_ASSERT_TRUE(t == (baseMs + 4) * 1000ULL);
+
+  b.setPhaseUs(300);
+  s.unschedule(&b);
+  s.schedule(&b);
+  s.getNextDeadline(t);
+  TEST_ASSERT_TRUE(t == (baseMs + 4) * 1000ULL + 300);
+}
+
+void test_skips_inactive_and_done_events()
+{
+  int n = 0;
+  AF1Event a = every(5, &n), b = every(5, &n, 1);
+  a.deactivate();
+  b.setCbCnt(1);
+  EventScheduler s;
+  s.schedule(&a);
+  s.schedule(&b);
+  TEST_ASSERT_EQUAL_UINT(0, s.size());
+}
+
+void test_one_shot_is_dropped_after_it_fires()
+{
+  int n = 0;
+  AF1Event a("once", [&n](const ECBArg &arg)
+             { n++; },
+             EVENT_TYPE_TEMP, 0, 1, baseMs + 5, START_DEVICE_MS);
+  EventScheduler s;
+  s.schedule(&a);
+  at(4);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(0, n);
+  at(5);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(1, n);
+  TEST_ASSERT_EQUAL_UINT(0, s.size());
+}
+
+void test_late_run_coalesces_missed_intervals()
+{
+  unsigned long missed = 0;
+  int n = 0;
+  AF1Event a("late", [&n, &missed](const ECBArg &arg)
+             { n++; missed = arg.missedCnt; },
+             EVENT_TYPE_TEMP, 2, 0, 0, START_DEVICE_MS);
+  EventScheduler s;
+  s.schedule(&a);
+  s.run(AF1Clock::now());
+  at(9);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(2, n);
+  TEST_ASSERT_EQUAL_UINT32(3, missed);
+  at(10);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(3, n);
+  TEST_ASSERT_EQUAL_UINT32(0, missed);
+}
+
+// cbCnt and missedCnt of each callback
+static std::vector<std::pair<unsigned long, unsigned long>> fires;
+
+static AF1Event recorded(unsigned long intervalMs, unsigned long startMs = 0)
+{
+  return AF1Event("recorded", [](const ECBArg &arg)
+                  { fires.push_back(std::make_pair(arg.cbCnt, arg.missedCnt)); },
+                  EVENT_TYPE_TEMP, intervalMs, 0, startMs, START_DEVICE_MS);
+}
+
+static void runAt(EventScheduler &s, unsigned long ms)
+{
+  at(ms);
+  s.run(AF1Clock::now());
+}
+
+void test_skip_drops_callbacks_later_than_the_limit()
+{
+  fires.clear();
+  AF1Event a = recorded(2);
+  a.setCatchup(CATCHUP_SKIP, 3);
+  a.setCbCnt(baseMs / 2 - 1); // Next at baseMs
+  EventScheduler s;
+  s.schedule(&a);
+  runAt(s, 0);
+  runAt(s, 5); // 3 ms late; within the limit
+  TEST_ASSERT_EQUAL_UINT(2, fires.size());
+  TEST_ASSERT_EQUAL_UINT32(1, fires[1].second);
+  runAt(s, 12); // 6 ms late
+  TEST_ASSERT_EQUAL_UINT(2, fires.size());
+  runAt(s, 13);
+  TEST_ASSERT_EQUAL_UINT(2, fires.size());
+  runAt(s, 14); // Realigned to the interval
+  TEST_ASSERT_EQUAL_UINT(3, fires.size());
+  TEST_ASSERT_EQUAL_UINT32(0, fires[2].second);
+}
+
+void test_burst_replays_up_to_the_limit()
+{
+  fires.clear();
+  AF1Event a = recorded(2);
+  a.setCatchup(CATCHUP_BURST, 2);
+  unsigned long c = baseMs / 2;
+  a.setCbCnt(c); // Next at baseMs + 2
+  EventScheduler s;
+  s.schedule(&a);
+  runAt(s, 9); // 7 ms late: 3 ticks missed, 2 replayed
+  TEST_ASSERT_EQUAL_UINT(3, fires.size());
+  for (unsigned long i = 0; i < 3; i++)
+  {
+    TEST_ASSERT_EQUAL_UINT32(c + i, fires[i].first);
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, fires[0].second);
+  TEST_ASSERT_EQUAL_UINT32(0, fires[1].second);
+  TEST_ASSERT_EQUAL_UINT32(1, fires[2].second);
+  runAt(s, 10);
+  TEST_ASSERT_EQUAL_UINT(4, fires.size());
+  TEST_ASSERT_EQUAL_UINT32(0, fires[3].second);
+}
+
+void test_realigns_from_the_start_time()
+{
+  fires.clear();
+  AF1Event a = recorded(4, baseMs + 1);
+  EventScheduler s;
+  s.schedule(&a);
+  runAt(s, 4);
+  TEST_ASSERT_EQUAL_UINT(0, fires.size());
+  runAt(s, 5);
+  runAt(s, 9);
+  TEST_ASSERT_EQUAL_UINT(2, fires.size());
+  runAt(s, 14); // Due at 13
+  TEST_ASSERT_EQUAL_UINT32(0, fires[2].second);
+  runAt(s, 26); // Due at 17; 21 and 25 missed
+  TEST_ASSERT_EQUAL_UINT(4, fires.size());
+  TEST_ASSERT_EQUAL_UINT32(2, fires[3].second);
+  runAt(s, 28);
+  TEST_ASSERT_EQUAL_UINT(4, fires.size());
+  runAt(s, 29);
+  TEST_ASSERT_EQUAL_UINT(5, fires.size());
+}
+
+void test_realigns_with_the_phase()
+{
+  fires.clear();
+  AF1Event a = recorded(4, baseMs);
+  a.setPhaseUs(500);
+  EventScheduler s;
+  s.schedule(&a);
+  runAt(s, 4);
+  TEST_ASSERT_EQUAL_UINT(0, fires.size());
+  setMicros((baseMs + 4) * 1000 + 500);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_UINT(1, fires.size());
+  time_us t;
+  s.getNextDeadline(t);
+  TEST_ASSERT_TRUE(t == (baseMs + 8) * 1000ULL + 500);
+}
+
+void test_unschedule_from_a_callback_stops_a_due_event()
+{
+  int n = 0;
+  EventScheduler s;
+  AF1Event b = every(5, &n);
+  AF1Event a("first", [&s, &b](const ECBArg &) { s.unschedule(&b); },
+             EVENT_TYPE_TEMP, 5, 0, 0, START_DEVICE_MS);
+  b.setPhaseUs(1); // So a comes out of the heap first
+  s.schedule(&a);
+  s.schedule(&b);
+  at(6);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(0, n);
+  TEST_ASSERT_EQUAL_UINT(1, s.size());
+}
+
+void test_clear_empties_the_heap()
+{
+  int n = 0;
+  AF1Event a = every(1, &n);
+  EventScheduler s;
+  s.schedule(&a);
+  s.clear();
+  at(5);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(0, n);
+  TEST_ASSERT_EQUAL_UINT(0, s.size());
+}
+
+// Changed directly, as through Base::findEvent(), not through the scheduler
+void test_reactivated_event_fires_again()
+{
+  int n = 0;
+  AF1Event a = every(5, &n);
+  EventScheduler s;
+  s.schedule(&a);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(1, n);
+
+  a.deactivate();
+  TEST_ASSERT_EQUAL_UINT(0, s.size());
+  at(5);
+  s.run(AF1Clock::now());
+  at(10);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(1, n);
+
+  a.activate();
+  TEST_ASSERT_EQUAL_UINT(1, s.size());
+  at(15);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(2, n);
+  a.setMode(MODE_INACTIVE);
+  a.setMode(MODE_ACTIVE);
+  at(20);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(3, n);
+}
+
+void test_finished_event_resumes_when_its_count_changes()
+{
+  int n = 0;
+  AF1Event a = every(5, &n);
+  EventScheduler s;
+  s.schedule(&a);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(1, n);
+
+  a.setMaxCbCnt(a.getCbCnt()); // Done
+  TEST_ASSERT_EQUAL_UINT(0, s.size());
+  at(5);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(1, n);
+
+  a.setMaxCbCnt(0);
+  at(10);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(2, n);
+}
+
+void test_deactivating_from_its_own_callback_stops_it()
+{
+  int n = 0;
+  AF1Event *self;
+  AF1Event a("self", [&n, &self](const ECBArg &arg)
+             { n++; self->deactivate(); },
+             EVENT_TYPE_TEMP, 5, 0, 0, START_DEVICE_MS);
+  self = &a;
+  EventScheduler s;
+  s.schedule(&a);
+  s.run(AF1Clock::now());
+  at(5);
+  s.run(AF1Clock::now());
+  TEST_ASSERT_EQUAL_INT(1, n);
+  TEST_ASSERT_EQUAL_UINT(0, s.size());
+}
+
+void test_copies_are_not_scheduled()
+{
+  int n = 0;
+  AF1Event a = every(5, &n);
+  EventScheduler s;
+  s.schedule(&a);
+  AF1Event b = a;
+  b.deactivate();
+  b.activate();
+  TEST_ASSERT_EQUAL_UINT(1, s.size());
+  s.unschedule(&a);
+  a.activate();
+  TEST_ASSERT_EQUAL_UINT(0, s.size());
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_fires_each_event_when_due);
+  RUN_TEST(test_next_deadline_is_the_earliest);
+  RUN_TEST(test_skips_inactive_and_done_events);
+  RUN_TEST(test_one_shot_is_dropped_after_it_fires);
+  RUN_TEST(test_late_run_coalesces_missed_intervals);
+  RUN_TEST(test_skip_drops_callbacks_later_than_the_limit);
+  RUN_TEST(test_burst_replays_up_to_the_limit);
+  RUN_TEST(test_realigns_from_the_start_time);
+  RUN_TEST(test_realigns_with_the_phase);
+  RUN_TEST(test_unschedule_from_a_callback_stops_a_due_event);
+  RUN_TEST(test_clear_empties_the_heap);
+  RUN_TEST(test_reactivated_event_fires_again);
+  RUN_TEST(test_finished_event_resumes_when_its_count_changes);
+  RUN_TEST(test_deactivating_from_its_own_callback_stops_it);
+  RUN_TEST(test_copies_are_not_scheduled);
+  return UNITY_END();
+}
@@ -0,0 +1,432 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <unity.h>
+#include <algorithm>
+
+#include "nativeStubs.h"
+#include "message/message.h"
+#include "timeSync/timeSync.h"
+
+// A peer whose clock is ahead by offsetUs and runs ppm fast
+static int64_t peerOffsetUs;
+static double peerPpm;
+
+static time_us peerTime(time_us t)
+{
+  return t + peerOffsetUs + (int64_t)((double)t * peerPpm / 1e6);
+}
+
+// One exchange starting at t1; up and down are the one-way delays
+static bool exchange(TimeSync &s, time_us t1, time_us up, time_us down, time_us turnaround = 50)
+{
+  time_us t2 = peerTime(t1 + up);
+  time_us t3 = peerTime(t1 + up + turnaround);
+  return s.addSample(t1, t2, t3, t1 + up + turnaround + down);
+}
+
+static void syncRound(TimeSync &s, time_us t1, time_us up = 500, time_us down = 500)
+{
+  s.startBurst(1);
+  while (s.takeBurst())
+  {
+    exchange(s, t1, up, down);
+  }
+}
+
+void setUp()
+{
+  peerOffsetUs = 1000000;
+  peerPpm = 0;
+  setMicros(1000);
+}
+
+void tearDown()
+{
+}
+
+void test_symmetric_exchange_gives_the_exact_offset()
+{
+  TimeSync s;
+  TEST_ASSERT_FALSE(s.isSynced());
+  syncRound(s, 10000000);
+  TEST_ASSERT_TRUE(s.isSynced());
+  TEST_ASSERT_EQUAL_INT64(1000000, s.getOffsetUs(10000000));
+  TEST_ASSERT_EQUAL_UINT64(1000, s.getRttUs());
+}
+
+void test_round_keeps_the_fastest_exchange()
+{
+  TimeSync s;
+  s.startBurst(0);
+  TEST_ASSERT_TRUE(exchange(s, 10000000, 5000, 200));
+  TEST_ASSERT_TRUE(exchange(s, 10020000, 300, 300));
+  TEST_ASSERT_TRUE(exchange(s, 10040000, 200, 4000));
+  s.takeBurst();
+  TEST_ASSERT_EQUAL_UINT8(1, s.getSampleCnt());
+  TEST_ASSERT_EQUAL_UINT64(600, s.getRttUs());
+  TEST_ASSERT_EQUAL_INT64(1000000, s.getOffsetUs(10020000));
+}
+
+void test_rejects_timestamps_that_dont_add_up()
+{
+  TimeSync s;
+  TEST_ASSERT_FALSE(s.addSample(2000, 5000, 6000, 1000)); // Back before we sent
+  TEST_ASSERT_FALSE(s.addSample(1000, 6000, 5000, 2000)); // Peer replied before it received
+  TEST_ASSERT_FALSE(s.addSample(1000, 5000, 8000, 2000)); // Peer took longer than the round trip
+  s.takeBurst();
+  TEST_ASSERT_FALSE(s.isSynced());
+}
+
+void test_fits_the_skew_and_converts_both_ways()
+{
+  peerPpm = 50;
+  TimeSync s;
+  for (int i = 0; i < TIME_SYNC_WINDOW; i++)
+  {
+    syncRound(s, 10000000 + i * 10000000ULL);
+  }
+  TEST_ASSERT_TRUE(s.getSkewPpm() > 49 && s.getSkewPpm() < 51);
+
+  time_us t = 200000000;
+  TEST_ASSERT_INT_WITHIN(2, (int64_t)peerTime(t), (int64_t)s.toPeer(t));
+  TEST_ASSERT_INT_WITHIN(2, (int64_t)t, (int64_t)s.toLocal(peerTime(t)));
+}
+
+void test_interval_backs_off_when_steady_and_tightens_on_error()
+{
+  TimeSync s;
+  for (int i = 0; i < 3; i++)
+  {
+    s.addOffset(10000000 + i * 1000000ULL, 1000000);
+  }
+  TEST_ASSERT_EQUAL_UINT32(MS_TIME_SYNC * 2, s.getIntervalMs());
+
+  s.addOffset(14000000, 1000000 + TIME_SYNC_TARGET_US * 2);
+  TEST_ASSERT_EQUAL_UINT32(MS_TIME_SYNC, s.getIntervalMs());
+  TEST_ASSERT_EQUAL_UINT64(TIME_SYNC_TARGET_US * 2, s.getErrorUs());
+}
+
+void test_a_jump_starts_a_new_timeline()
+{
+  TimeSync s;
+  for (int i = 0; i < 4; i++)
+  {
+    s.addOffset(10000000 + i * 1000000ULL, 1000000);
+  }
+  TEST_ASSERT_EQUAL_UINT8(4, s.getSampleCnt());
+  s.addOffset(15000000, 1000000 - TIME_SYNC_RESET_US * 2);
+  TEST_ASSERT_EQUAL_UINT8(1, s.getSampleCnt());
+  TEST_ASSERT_EQUAL_INT64(1000000 - TIME_SYNC_RESET_US * 2, s.getOffsetUs(15000000));
+}
+
+void test_due_until_synced_then_after_the_interval()
+{
+  TimeSync s;
+  TEST_ASSERT_TRUE(s.isDue(AF1Clock::now()));
+  syncRound(s, 10000000);
+  time_us start = AF1Clock::now();
+  TEST_ASSERT_FALSE(s.isDue(start));
+  TEST_ASSERT_TRUE(s.isDue(start + s.getIntervalMs() * 1000ULL));
+}
+
+// Deterministic jitter, so the simulations below always see the same link
+static uint32_t lcg = 1;
+
+static time_us jitterUs(time_us max)
+{
+  lcg = lcg * 1664525 + 1013904223;
+  return (lcg >> 8) % (max + 1);
+}
+
+#define DRIFT_SIM_S 7200
+#define DRIFT_WARMUP_S 600
+#define DRIFT_PPM 80 // Two +-40 ppm crystals, at opposite ends
+#define LINK_US 800
+#define LINK_JITTER_US 300
+
+// Two hours against a peer 80 ppm fast over a link with jittery one-way delays: rounds run when isDue(),
+// and after a warm-up every second's conversion is checked against the peer's true clock. The baseline is
+// what we did before: one exchange every MS_TIME_SYNC, offset only
+void test_drift_simulation_stays_accurate_with_fewer_messages()
+{
+  peerPpm = DRIFT_PPM;
+  lcg = 1;
+  TimeSync s;
+  int rounds = 0, msgs = 0, baseMsgs = 0;
+  time_us maxErrUs = 0, baseMaxErrUs = 0;
+  int64_t baseOffsetUs = 0;
+  time_us baseLastUs = 0;
+  for (int sec = 0; sec < DRIFT_SIM_S; sec++)
+  {
+    advanceMicros(1000000);
+    time_us now = AF1Clock::now();
+    if (s.isDue(now))
+    {
+      rounds++;
+      s.startBurst(TIME_SYNC_BURST);
+      for (int i = 0; s.takeBurst(); i++)
+      {
+        exchange(s, now + i * 20000, LINK_US + jitterUs(LINK_JITTER_US), LINK_US + jitterUs(LINK_JITTER_US));
+        msgs += 2;
+      }
+    }
+    if (!baseLastUs || now - baseLastUs >= MS_TIME_SYNC * 1000ULL)
+    {
+      time_us up = LINK_US + jitterUs(LINK_JITTER_US), down = LINK_US + jitterUs(LINK_JITTER_US);
+      baseOffsetUs = ((int64_t)(peerTime(now + up) - now) + (int64_t)(peerTime(now + up) - (now + up + down))) / 2;
+      baseLastUs = now;
+      baseMsgs += 2;
+    }
+    if (sec >= DRIFT_WARMUP_S)
+    {
+      int64_t e = (int64_t)s.toPeer(now) - (int64_t)peerTime(now);
+      int64_t b = (int64_t)(now + baseOffsetUs) - (int64_t)peerTime(now);
+      maxErrUs = std::max(maxErrUs, (time_us)(e < 0 ? -e : e));
+      baseMaxErrUs = std::max(baseMaxErrUs, (time_us)(b < 0 ? -b : b));
+    }
+  }
+
+  char line[200];
+  snprintf(line, sizeof(line), "drift %d ppm: max error %llu us, %d messages (%d rounds, skew %.2f ppm, interval %lu ms); "
+                               "offset only every %d ms: max error %llu us, %d messages",
+           DRIFT_PPM, (unsigned long long)maxErrUs, msgs, rounds, s.getSkewPpm(), s.getIntervalMs(),
+           MS_TIME_SYNC, (unsigned long long)baseMaxErrUs, baseMsgs);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_LESS_OR_EQUAL(TIME_SYNC_TARGET_US, maxErrUs);
+  TEST_ASSERT_GREATER_THAN(DRIFT_PPM * MS_TIME_SYNC / 1000 / 2, baseMaxErrUs);
+  TEST_ASSERT_EQUAL_UINT32(MS_TIME_SYNC_MAX, s.getIntervalMs());
+  TEST_ASSERT_LESS_THAN(baseMsgs, msgs);
+  TEST_ASSERT_TRUE(s.getSkewPpm() > DRIFT_PPM - 1 && s.getSkewPpm() < DRIFT_PPM + 1);
+}
+
+#define JITTER_ROUNDS 200
+#define QUEUE_CHANCE 3     // In 10 one-way trips wait behind other traffic...
+#define QUEUE_MAX_US 20000 // ...for up to this long
+
+// A one-way trip: the radio, then maybe a wait in a queue (DELAY_SEND, a busy inbox)
+static time_us tripUs()
+{
+  return LINK_US + jitterUs(LINK_JITTER_US) + (jitterUs(9) < QUEUE_CHANCE ? jitterUs(QUEUE_MAX_US) : 0);
+}
+
+static time_us absUs(int64_t e)
+{
+  return (time_us)(e < 0 ? -e : e);
+}
+
+// A peer 30 ppm fast over a link whose one-way delays have queueing spikes. Each round, compares three
+// offset estimates with the truth: what we did before (the peer's stamp against our receive, delays ignored),
+// a single NTP exchange, and TimeSync (bursts, the fastest exchange of each, fitted over the window)
+void test_jitter_simulation_reports_sync_accuracy()
+{
+  peerPpm = 30;
+  lcg = 3;
+  TimeSync s;
+  time_us naiveMaxUs = 0, singleMaxUs = 0, syncMaxUs = 0;
+  double naiveSum = 0, singleSum = 0, syncSum = 0;
+  int checked = 0;
+  for (int r = 0; r < JITTER_ROUNDS; r++)
+  {
+    advanceMicros(MS_TIME_SYNC_MIN * 1000);
+    time_us now = AF1Clock::now();
+    int64_t truth = (int64_t)peerTime(now) - (int64_t)now;
+
+    time_us up = tripUs(), down = tripUs();
+    time_us t2 = peerTime(now + up), t3 = peerTime(now + up + 50), t4 = now + up + 50 + down;
+    int64_t naive = (int64_t)t3 - (int64_t)t4;
+    int64_t single = ((int64_t)(t2 - now) + (int64_t)(t3 - t4)) / 2;
+
+    s.startBurst(TIME_SYNC_BURST);
+    for (int i = 0; s.takeBurst(); i++)
+    {
+      exchange(s, now + i * 50000, tripUs(), tripUs());
+    }
+    if (r < TIME_SYNC_WINDOW)
+    {
+      continue;
+    }
+    time_us n = absUs(naive - truth), o = absUs(single - truth), t = absUs(s.getOffsetUs(now) - truth);
+    naiveMaxUs = std::max(naiveMaxUs, n);
+    singleMaxUs = std::max(singleMaxUs, o);
+    syncMaxUs = std::max(syncMaxUs, t);
+    naiveSum += n;
+    singleSum += o;
+    syncSum += t;
+    checked++;
+  }
+
+  char line[200];
+  snprintf(line, sizeof(line), "sync error, mean/max us: receive stamp only %.0f/%llu; one exchange %.0f/%llu; TimeSync %.0f/%llu",
+           naiveSum / checked, (unsigned long long)naiveMaxUs, singleSum / checked, (unsigned long long)singleMaxUs,
+           syncSum / checked, (unsigned long long)syncMaxUs);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_LESS_OR_EQUAL(TIME_SYNC_TARGET_US, syncMaxUs);
+  TEST_ASSERT_TRUE(syncSum < singleSum && singleSum < naiveSum);
+  TEST_ASSERT_GREATER_THAN(QUEUE_MAX_US / 4, singleMaxUs);
+}
+
+#define FLEET_NODES 51 // The master (0) and 50 receivers
+#define FLEET_ROUNDS 60
+#define FLEET_WARMUP_ROUNDS TIME_SYNC_WINDOW
+#define AIR_US 300       // Beacon stamped to beacon heard
+#define RX_JITTER_US 20  // Between receivers hearing the same frame
+
+// A device in the fleet: its clock, and what it knows about everyone else's
+struct fleet_node
+{
+  time_us offsetUs;
+  double ppm;
+  TimeSync peers[FLEET_NODES];
+  time_sync_beacon beacons[TIME_SYNC_BEACONS];
+
+  time_us clock(time_us t) { return t + offsetUs + (int64_t)((double)t * ppm / 1e6); }
+  void noteBeacon(uint16_t seq, time_us at)
+  {
+    beacons[seq % TIME_SYNC_BEACONS].seq = seq;
+    beacons[seq % TIME_SYNC_BEACONS].atUs = at;
+  }
+};
+
+static fleet_node fleet[FLEET_NODES];
+
+// Largest error any node makes converting its clock to each other node's, at true time t
+static time_us fleetErrorUs(time_us t, bool master)
+{
+  time_us worst = 0;
+  for (int i = 0; i < FLEET_NODES; i++)
+  {
+    for (int j = 0; j < FLEET_NODES; j++)
+    {
+      if (i == j || (i == 0 || j == 0) != master)
+      {
+        continue;
+      }
+      int64_t e = (int64_t)fleet[i].peers[j].toPeer(fleet[i].clock(t)) - (int64_t)fleet[j].clock(t);
+      worst = std::max(worst, (time_us)(e < 0 ? -e : e));
+    }
+  }
+  return worst;
+}
+
+// The broadcast time sync (TIME_SYNC_BROADCAST) across 51 nodes with +-40 ppm crystals, as Base does it: the
+// master broadcasts a stamped beacon, every receiver stamps its arrival and broadcasts that in a report, and
+// everyone compares the reports with their own stamps. Frames go over the wire format
+void test_fleet_of_51_syncs_off_broadcast_beacons()
+{
+  lcg = 7;
+  for (int i = 0; i < FLEET_NODES; i++)
+  {
+    fleet[i].offsetUs = 1000000 + jitterUs(10000000);
+    fleet[i].ppm = (double)jitterUs(80) - 40;
+    memset(fleet[i].beacons, 0, sizeof(fleet[i].beacons));
+    for (int j = 0; j < FLEET_NODES; j++)
+    {
+      fleet[i].peers[j].reset();
+    }
+  }
+  uint8_t wire[AF1_MSG_SIZE];
+  int frames = 0;
+  time_us rxMaxUs = 0, masterMaxUs = 0;
+  for (int r = 0; r < FLEET_ROUNDS; r++)
+  {
+    time_us t = (r + 1) * MS_TIME_SYNC_BEACON * 1000ULL;
+    advanceMicros(MS_TIME_SYNC_BEACON * 1000);
+
+    AF1Msg beacon(TYPE_TIME_SYNC_BEACON);
+    beacon.setTxStamp(true);
+    size_t len = beacon.toWire(wire, sizeof(wire));
+    TEST_ASSERT_GREATER_THAN(0, len);
+    AF1Msg::stampTx(wire, len, fleet[0].clock(t)); // As it's handed to the radio
+    fleet[0].noteBeacon(beacon.getSeq(), fleet[0].clock(t) + TIME_SYNC_BEACON_US);
+    frames++;
+
+    // Everyone hears it at once, give or take their interrupt latency
+    time_us rx[FLEET_NODES];
+    uint16_t seq = 0;
+    for (int i = 1; i < FLEET_NODES; i++)
+    {
+      AF1Msg m;
+      TEST_ASSERT_TRUE(m.fromWire(wire, len));
+      seq = m.getSeq();
+      rx[i] = fleet[i].clock(t + AIR_US + jitterUs(RX_JITTER_US));
+      fleet[i].noteBeacon(seq, rx[i]);
+      fleet[i].peers[0].addOffset(rx[i], (int64_t)(m.getTxUs() + TIME_SYNC_BEACON_US - rx[i]));
+    }
+
+    // Reports, heard by everyone else
+    for (int i = 1; i < FLEET_NODES; i++)
+    {
+      AF1Msg report(TYPE_TIME_SYNC_REPORT);
+      report.json()["b"] = seq;
+      report.json()["rx"] = rx[i];
+      len = report.toWire(wire, sizeof(wire));
+      TEST_ASSERT_GREATER_THAN(0, len);
+      frames++;
+      for (int j = 0; j < FLEET_NODES; j++)
+      {
+        AF1Msg m;
+        TEST_ASSERT_TRUE(m.fromWire(wire, len));
+        uint16_t b = m.readJson()["b"];
+        const time_sync_beacon &mine = fleet[j].beacons[b % TIME_SYNC_BEACONS];
+        if (j == i || !mine.atUs || mine.seq != b)
+        {
+          continue;
+        }
+        fleet[j].peers[i].addOffset(mine.atUs, (int64_t)(m.readJson()["rx"].as<time_us>() - mine.atUs));
+      }
+    }
+
+    // Checked halfway to the next beacon, when the fits have to extrapolate furthest
+    if (r >= FLEET_WARMUP_ROUNDS)
+    {
+      time_us mid = t + MS_TIME_SYNC_BEACON * 500ULL;
+      rxMaxUs = std::max(rxMaxUs, fleetErrorUs(mid, false));
+      masterMaxUs = std::max(masterMaxUs, fleetErrorUs(mid, true));
+    }
+  }
+
+  // Pairwise rounds (TIME_SYNC_BURST exchanges, two frames each) between every pair, over the same time
+  long pairwise = (long)FLEET_NODES * (FLEET_NODES - 1) / 2 * TIME_SYNC_BURST * 2 * FLEET_ROUNDS * MS_TIME_SYNC_BEACON / MS_TIME_SYNC;
+  char line[200];
+  snprintf(line, sizeof(line), "%d nodes, %d rounds: %d frames (pairwise for every pair: %ld); max error %llu us between receivers, "
+                               "%llu us to the master",
+           FLEET_NODES, FLEET_ROUNDS, frames, pairwise, (unsigned long long)rxMaxUs, (unsigned long long)masterMaxUs);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_EQUAL_INT(FLEET_ROUNDS * FLEET_NODES, frames);
+  TEST_ASSERT_LESS_OR_EQUAL(2 * RX_JITTER_US, rxMaxUs);
+  TEST_ASSERT_LESS_OR_EQUAL(AIR_US + 2 * RX_JITTER_US, masterMaxUs);
+  TEST_ASSERT_EQUAL_UINT8(TIME_SYNC_WINDOW, fleet[FLEET_NODES - 1].peers[1].getSampleCnt());
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_symmetric_exchange_gives_the_exact_offset);
+  RUN_TEST(test_round_keeps_the_fastest_exchange);
+  RUN_TEST(test_rejects_timestamps_that_dont_add_up);
+  RUN_TEST(test_fits_the_skew_and_converts_both_ways);
+  RUN_TEST(test_interval_backs_off_when_steady_and_tightens_on_error);
+  RUN_TEST(test_a_jump_starts_a_new_timeline);
+  RUN_TEST(test_due_until_synced_then_after_the_interval);
+  RUN_TEST(test_drift_simulation_stays_accurate_with_fewer_messages);
+  RUN_TEST(test_jitter_simulation_reports_sync_accuracy);
+  RUN_TEST(test_fleet_of_51_syncs_off_broadcast_beacons);
+  return UNITY_END();
+}
@@ -0,0 +1,226 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <unity.h>
+#include <vector>
+
+#include "nativeStubs.h"
+#include "txQueue/txQueue.h"
+
+// A queued frame whose only reference is the queue's
+static tx_frame *queue(TxQueue &q, uint8_t id, uint8_t maxRetries = 0)
+{
+  tx_frame *f = TxQueue::newFrame(&id, 1, TX_FRAME_QUEUED);
+  TEST_ASSERT_NOT_NULL(f);
+  TEST_ASSERT_TRUE(q.push(f, maxRetries));
+  TxQueue::releaseFrame(f);
+  return f;
+}
+
+// Sends what the window allows; returns the tags used
+static std::vector<uint8_t> sendAll(TxQueue &q, time_us now)
+{
+  std::vector<uint8_t> tags;
+  tx_entry *e;
+  while ((e = q.next()) != NULL)
+  {
+    q.sent(now);
+    tags.push_back(e->tag);
+  }
+  return tags;
+}
+
+void setUp()
+{
+  advanceMicros(1000000);
+}
+
+void tearDown()
+{
+  TEST_ASSERT_FALSE(TxQueue::hasPending());
+}
+
+void test_window_limits_frames_in_flight()
+{
+  TxQueue q;
+  tx_frame *a = queue(q, 1), *b = queue(q, 2), *c = queue(q, 3);
+  std::vector<uint8_t> tags = sendAll(q, AF1Clock::now());
+  TEST_ASSERT_EQUAL_UINT(ESPNOW_TX_WINDOW, tags.size());
+  TEST_ASSERT_EQUAL_UINT8(ESPNOW_TX_WINDOW, q.getInFlight());
+  TEST_ASSERT_EQUAL_UINT8(3, q.size());
+
+  q.complete(tags[0], true);
+  TEST_ASSERT_EQUAL_UINT8(0, a->refs);
+  TEST_ASSERT_EQUAL_UINT8(c->data[0], q.next()->frame->data[0]);
+  std::vector<uint8_t> more = sendAll(q, AF1Clock::now());
+  q.complete(tags[1], true);
+  q.complete(more[0], true);
+  TEST_ASSERT_EQUAL_UINT8(0, b->refs);
+  TEST_ASSERT_EQUAL_UINT8(0, c->refs);
+  TEST_ASSERT_EQUAL_UINT8(0, q.size());
+}
+
+void test_failures_retry_at_the_back_then_drop()
+{
+  TxQueue q;
+  tx_stats before = TxQueue::getStats();
+  tx_frame *a = queue(q, 1, 1);
+  queue(q, 2);
+  std::vector<uint8_t> tags = sendAll(q, AF1Clock::now());
+  q.complete(tags[0], false);
+  TEST_ASSERT_EQUAL_UINT8(2, q.size());
+  q.complete(tags[1], true);
+  TEST_ASSERT_EQUAL_PTR(a, q.next()->frame);
+
+  tags = sendAll(q, AF1Clock::now());
+  q.complete(tags[0], false); // Out of retries
+  TEST_ASSERT_EQUAL_UINT8(0, q.size());
+  TEST_ASSERT_EQUAL_UINT8(0, a->refs);
+  tx_stats s = TxQueue::getStats();
+  TEST_ASSERT_EQUAL_UINT32(3, s.sent - before.sent);
+  TEST_ASSERT_EQUAL_UINT32(2, s.failed - before.failed);
+  TEST_ASSERT_EQUAL_UINT32(1, s.retried - before.retried);
+  TEST_ASSERT_EQUAL_UINT32(1, s.dropped - before.dropped);
+}
+
+void test_full_queue_refuses()
+{
+  TxQueue q;
+  for (int i = 0; i < ESPNOW_TX_QUEUE; i++)
+  {
+    queue(q, i);
+  }
+  uint8_t id = 99;
+  tx_frame *f = TxQueue::newFrame(&id, 1, TX_FRAME_QUEUED);
+  TEST_ASSERT_FALSE(q.push(f, 0));
+  TEST_ASSERT_EQUAL_UINT8(1, f->refs);
+  TxQueue::releaseFrame(f);
+  while (q.size())
+  {
+    q.drop();
+  }
+}
+
+void test_timeout_fails_the_oldest_and_ignores_its_late_completion()
+{
+  TxQueue q;
+  tx_frame *a = queue(q, 1);
+  tx_frame *b = queue(q, 2);
+  time_us t = AF1Clock::now();
+  std::vector<uint8_t> tags = sendAll(q, t);
+  TEST_ASSERT_TRUE(q.getExpiryUs() == t + ESPNOW_TX_TIMEOUT_MS * 1000ULL + 1);
+
+  q.expire(t + ESPNOW_TX_TIMEOUT_MS * 1000ULL);
+  TEST_ASSERT_EQUAL_UINT8(2, q.getInFlight());
+  q.expire(q.getExpiryUs());
+  TEST_ASSERT_EQUAL_UINT8(1, q.getInFlight());
+  TEST_ASSERT_EQUAL_UINT8(0, a->refs);
+
+  // a's completion turns up after all; it mustn't be taken for b's
+  q.complete(tags[0], true);
+  TEST_ASSERT_EQUAL_UINT8(1, q.getInFlight());
+  TEST_ASSERT_EQUAL_UINT8(1, b->refs);
+  q.complete(tags[1], true);
+  TEST_ASSERT_EQUAL_UINT8(0, b->refs);
+  TEST_ASSERT_TRUE(q.getExpiryUs() == 0);
+}
+
+void test_skipped_completion_fails_the_lost_frames()
+{
+  TxQueue q;
+  tx_frame *a = queue(q, 1), *b = queue(q, 2);
+  tx_stats before = TxQueue::getStats();
+  std::vector<uint8_t> tags = sendAll(q, AF1Clock::now());
+  q.complete(tags[1], true); // a's never came
+  TEST_ASSERT_EQUAL_UINT8(0, q.size());
+  TEST_ASSERT_EQUAL_UINT8(0, a->refs);
+  TEST_ASSERT_EQUAL_UINT8(0, b->refs);
+  TEST_ASSERT_EQUAL_UINT32(1, TxQueue::getStats().failed - before.failed);
+}
+
+void test_completion_count_behind_catches_the_tags_up()
+{
+  TxQueue q;
+  tx_frame *a = queue(q, 1), *b = queue(q, 2);
+  std::vector<uint8_t> tags = sendAll(q, AF1Clock::now());
+  // Two completions went to no peer, so this one's count is two behind ours
+  q.complete(tags[0] - 2, true);
+  TEST_ASSERT_EQUAL_UINT8(0, a->refs);
+  TEST_ASSERT_EQUAL_UINT8(1, q.getInFlight());
+  q.complete(tags[1] - 2, true);
+  TEST_ASSERT_EQUAL_UINT8(0, b->refs);
+
+  // And later sends line up with the corrected count
+  tx_frame *c = queue(q, 3);
+  tags = sendAll(q, AF1Clock::now());
+  q.complete(tags[0], true);
+  TEST_ASSERT_EQUAL_UINT8(0, c->refs);
+}
+
+void test_frame_kinds_keep_their_shares()
+{
+  std::vector<tx_frame *> taken;
+  uint8_t id = 0;
+  tx_frame *f;
+  int plain = TxQueue::getFramesFree(TX_FRAME_QUEUED);
+  TEST_ASSERT_EQUAL_INT(ESPNOW_TX_FRAMES - ESPNOW_TX_FRAMES_RESERVE, plain);
+  while ((f = TxQueue::newFrame(&id, 1, TX_FRAME_QUEUED)) != NULL)
+  {
+    taken.push_back(f);
+  }
+  TEST_ASSERT_EQUAL_UINT(plain, taken.size());
+
+  // Control traffic gets the reserve
+  for (int i = 0; i < ESPNOW_TX_FRAMES_RESERVE; i++)
+  {
+    f = TxQueue::newFrame(&id, 1, TX_FRAME_CONTROL);
+    TEST_ASSERT_NOT_NULL(f);
+    taken.push_back(f);
+  }
+  TEST_ASSERT_NULL(TxQueue::newFrame(&id, 1, TX_FRAME_CONTROL));
+
+  // Reliable and broadcast frames are set aside
+  TEST_ASSERT_EQUAL_INT(MAX_PEERS * RELIABLE_WINDOW, TxQueue::getFramesFree(TX_FRAME_RELIABLE));
+  TEST_ASSERT_EQUAL_INT(ESPNOW_BCAST_HISTORY + 1, TxQueue::getFramesFree(TX_FRAME_BROADCAST));
+  f = TxQueue::newFrame(&id, 1, TX_FRAME_RELIABLE);
+  TEST_ASSERT_NOT_NULL(f);
+  taken.push_back(f);
+  f = TxQueue::newFrame(&id, 1, TX_FRAME_BROADCAST);
+  TEST_ASSERT_NOT_NULL(f);
+  taken.push_back(f);
+
+  for (size_t i = 0; i < taken.size(); i++)
+  {
+    TxQueue::releaseFrame(taken[i]);
+  }
+  TEST_ASSERT_EQUAL_INT(plain, TxQueue::getFramesFree(TX_FRAME_QUEUED));
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_window_limits_frames_in_flight);
+  RUN_TEST(test_failures_retry_at_the_back_then_drop);
+  RUN_TEST(test_full_queue_refuses);
+  RUN_TEST(test_timeout_fails_the_oldest_and_ignores_its_late_completion);
+  RUN_TEST(test_skipped_completion_fails_the_lost_frames);
+  RUN_TEST(test_completion_count_behind_catches_the_tags_up);
+  RUN_TEST(test_frame_kinds_keep_their_shares);
+  return UNITY_END();
+}
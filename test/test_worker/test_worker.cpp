@@ -0,0 +1,198 @@
+/*
+  AF1
+  Copyright (c) 2022 Jon Shaw. All rights reserved.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 3 of the license, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include <unity.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+
+#include "nativeStubs.h"
+#include "stateEnt/virtual/base/event/event.h"
+#include "worker/worker.h"
+
+#define BENCH_TASKS 200000
+#define EVENT_FIRES 1000
+
+// Heap allocations by anything, while counting
+static std::atomic<bool> counting(false);
+static std::atomic<unsigned long> heapAllocs(0);
+
+void *operator new(size_t n)
+{
+  if (counting)
+  {
+    heapAllocs++;
+  }
+  void *p = malloc(n ? n : 1);
+  if (p == NULL)
+  {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t n)
+{
+  return operator new(n);
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+  free(p);
+}
+
+static std::atomic<int> fired(0);
+static std::atomic<int> onWorker(0);
+static std::atomic<int> wrongName(0);
+static const char *wantName;
+
+static void record(const ECBArg &a)
+{
+  if (strcmp(a.nameStr, wantName))
+  {
+    wrongName++;
+  }
+  if (Worker::isWorker())
+  {
+    onWorker++;
+  }
+  fired++;
+}
+
+static void waitFor(std::atomic<int> &n, int want)
+{
+  for (int i = 0; i < 5000 && n.load() < want; i++)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// Fires a 1 ms event n times, as the scheduler would
+static void fire(AF1Event &e, int n)
+{
+  int start = fired.load();
+  for (int i = 0; i < n; i++)
+  {
+    advanceMicros(1000);
+    e.cbIfTimeAndActive();
+    if (i % WORKER_QUEUE_SIZE == WORKER_QUEUE_SIZE - 1)
+    {
+      waitFor(fired, start + i + 1); // Let the worker catch up, so none run on the loop for a full queue
+    }
+  }
+  waitFor(fired, start + n);
+}
+
+void setUp()
+{
+  fired = 0;
+  onWorker = 0;
+  wrongName = 0;
+  Worker::begin();
+}
+
+void tearDown()
+{
+}
+
+void test_events_hand_over_without_the_heap()
+{
+  wantName = "heartbeat-status-led"; // Past std::string's inline buffer, so a String copy would allocate
+  AF1Event e(wantName, record, EVENT_TYPE_TEMP, 1, 0, 0, START_DEVICE_MS);
+  e.setWorker(true);
+  fire(e, 1); // Warm-up
+  fired = 0;
+  onWorker = 0;
+
+  heapAllocs = 0;
+  counting = true;
+  fire(e, EVENT_FIRES);
+  counting = false;
+  TEST_ASSERT_EQUAL_INT(EVENT_FIRES, fired.load());
+  TEST_ASSERT_EQUAL_UINT32(0, heapAllocs.load());
+  TEST_ASSERT_EQUAL_INT(0, wrongName.load());
+  TEST_ASSERT_EQUAL_INT(EVENT_FIRES, onWorker.load());
+}
+
+void test_long_names_run_on_the_loop()
+{
+  wantName = "an event name too long for the worker's buffer";
+  TEST_ASSERT_GREATER_OR_EQUAL(WORKER_EVENT_NAME_SIZE, strlen(wantName));
+  AF1Event e(wantName, record, EVENT_TYPE_TEMP, 1, 0, 0, START_DEVICE_MS);
+  e.setWorker(true);
+  fire(e, 3);
+  TEST_ASSERT_EQUAL_INT(3, fired.load());
+  TEST_ASSERT_EQUAL_INT(0, onWorker.load());
+  TEST_ASSERT_EQUAL_INT(0, wrongName.load());
+}
+
+// Tasks posted from the loop as fast as the queue takes them, until the worker has run them all
+void test_benchmark_worker_throughput()
+{
+  static std::atomic<int> ran(0);
+  ran = 0;
+  worker_stats before = Worker::getStats();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_TASKS; i++)
+  {
+    while (!Worker::post([]()
+                         { ran++; }))
+    {
+      std::this_thread::yield();
+    }
+  }
+  waitFor(ran, BENCH_TASKS);
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  worker_stats s = Worker::getStats();
+
+  char line[120];
+  snprintf(line, sizeof(line), "worker: %.2f M tasks/s; the queue was full %lu times",
+           BENCH_TASKS / secs / 1e6, s.full - before.full);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_EQUAL_INT(BENCH_TASKS, ran.load());
+  TEST_ASSERT_EQUAL_UINT32(BENCH_TASKS, s.ran - before.ran);
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_events_hand_over_without_the_heap);
+  RUN_TEST(test_long_names_run_on_the_loop);
+  RUN_TEST(test_benchmark_worker_throughput);
+  int failed = UNITY_END();
+  // The worker never stops; leave without destroying the queues it's still waiting on
+  fflush(stdout);
+  _Exit(failed);
+}